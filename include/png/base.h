@@ -134,6 +134,11 @@ namespace PNG
         InvalidLMTMinute,
         InvalidLMTSecond,
         UpdatingClosedStreamError,
+        UnsupportedStreamOperation,
+        FileMappingError,
+        UnsupportedInterlaceMethod,
+        InvalidRestartIndex,
+        InvalidImageRegion,
         ZLib_NotAvailable,
         ZLib_DataError,
     };
@@ -10,6 +10,9 @@
 #include "png/interlace.h"
 #include "png/stream.h"
 
+#include <string>
+#include <string_view>
+
 namespace PNG
 {
     struct TextualData; // Forward Declaration
@@ -34,6 +37,9 @@ namespace PNG
         const uint32_t zTXt = 0x7a545874;
 
         const uint32_t tIME = 0x74494d45;
+
+        // Private chunks, see the structs which they hold
+        const uint32_t riDX = 0x72694458;
     }
 
     class Chunk
@@ -53,6 +59,52 @@ namespace PNG
         Result Write(OStream& out) const;
     };
 
+    /**
+     * A read-only Chunk whose data may point directly into the stream it was read from.
+     * If the stream can't provide views which outlive later reads (see `PNG::IStream::HasStableViews()`),
+     * the data is read into an internal buffer, so that the chunk can be kept while the stream is read further.
+     */
+    class ChunkView
+    {
+    public:
+        uint32_t Type = 0;
+        const uint8_t* Data = nullptr;
+        uint32_t CRC = 0;
+    public:
+        ChunkView() = default;
+        ChunkView(const Chunk& chunk)
+            : Type(chunk.Type), Data(chunk.Data.data()), CRC(chunk.CRC), m_Length(chunk.Length()) { }
+
+        ChunkView(const ChunkView& other) = delete;
+        ChunkView& operator=(const ChunkView& other) = delete;
+
+        uint32_t Length() const { return m_Length; }
+        uint32_t CalculateCRC() const;
+
+        /// Whether Data points into the stream the chunk was read from, instead of the internal buffer. Such data is valid for as long as the stream is.
+        bool IsBorrowed() const { return m_Borrowed; }
+        /// Moves the internal buffer out of the chunk. The chunk is left empty.
+        std::vector<uint8_t> ReleaseBuffer();
+
+        /// If reading fails, the chunk is left empty (see `PNG::ChunkView::ReadData()`).
+        static Result Read(IStream& in, ChunkView& chunk);
+        /// Reads the length and type of the next chunk, the rest of it must then be read by ReadData or skipped by SkipData.
+        static Result ReadHeader(IStream& in, ChunkView& chunk);
+        /// Reads the data and CRC of a chunk whose header was read by ReadHeader, the chunk is left empty if that fails.
+        Result ReadData(IStream& in);
+        /// Skips the data and CRC of a chunk whose header was read by ReadHeader (see `PNG::IStream::Skip()`), the chunk is left empty.
+        Result SkipData(IStream& in);
+
+    private:
+        // Leaves the chunk without data, the internal buffer is kept to be reused
+        void Reset();
+        Result ReadDataAndCRC(IStream& in);
+
+        uint32_t m_Length = 0;
+        bool m_Borrowed = false;
+        std::vector<uint8_t> m_Buffer;
+    };
+
     struct ImageHeader
     {
         uint32_t Width = 0;
@@ -64,7 +116,7 @@ namespace PNG
         uint8_t InterlaceMethod = InterlaceMethod::NONE;
 
         Result Validate() const;
-        static Result Parse(const Chunk& chunk, ImageHeader& ihdr);
+        static Result Parse(const ChunkView& chunk, ImageHeader& ihdr);
         Result Write(Chunk& chunk) const;
     };
 
@@ -75,9 +127,20 @@ namespace PNG
         std::string TranslatedKeyword = "";
         std::string Text = "";
         bool IsUTF8 = false;
+        // The deflated text of a zTXt or compressed iTXt chunk which was parsed without inflating it, see InflateText()
+        // Text is empty until then, and Write() writes these bytes back as they are
+        std::vector<uint8_t> CompressedText = {};
+        uint8_t TextCompressionMethod = CompressionMethod::ZLIB;
+
+        bool IsTextInflated() const { return CompressedText.empty(); }
+        /// Decompresses CompressedText into Text, does nothing if the text is already inflated.
+        Result InflateText();
 
         Result Validate() const;
-        static Result Parse(const Chunk& chunk, TextualData& textualData);
+        /// @param inflate If false, compressed text is kept in CompressedText and only decompressed by InflateText().
+        static Result Parse(const ChunkView& chunk, TextualData& textualData, bool inflate = true);
+        /// Reads the keyword of a text chunk without parsing the rest of it.
+        static Result ParseKeyword(const ChunkView& chunk, std::string_view& keyword);
         Result Write(Chunk& chunk, CompressionLevel compressionLevel = CompressionLevel::Default) const;
     };
 
@@ -94,7 +157,31 @@ namespace PNG
         static LastModificationTime Now();
 
         Result Validate() const;
-        static Result Parse(const Chunk& chunk, LastModificationTime& time);
+        static Result Parse(const ChunkView& chunk, LastModificationTime& time);
+        Result Write(Chunk& chunk) const;
+    };
+
+    /**
+     * Lists the rows of a non-interlaced image where decoding can start without decoding the ones before them.
+     * Each segment of image data starts with a row which doesn't use the previous one (filter type NONE or SUB),
+     *  compressed with a fresh deflate state, so segments can be inflated and unfiltered at the same time.
+     * It's stored in the private riDX chunk, which comes before the first IDAT and isn't safe to copy.
+     * Other decoders read the image normally, since it's still a single zlib stream.
+     */
+    struct RestartIndex
+    {
+        struct Segment
+        {
+            uint32_t Row = 0;
+            // Offset of the segment within the zlib stream, which is the concatenation of all IDATs
+            uint64_t Offset = 0;
+        };
+
+        std::vector<Segment> Segments;
+
+        /// Rows and offsets must be increasing, the first segment must start at row 0 right after the zlib header.
+        Result Validate(const ImageHeader& ihdr) const;
+        static Result Parse(const ChunkView& chunk, RestartIndex& index);
         Result Write(Chunk& chunk) const;
     };
 }
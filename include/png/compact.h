@@ -0,0 +1,149 @@
+#pragma once
+
+#ifndef _PNG_COMPACT_H
+#define _PNG_COMPACT_H
+
+#include "png/base.h"
+#include "png/color.h"
+#include "png/image.h"
+#include "png/kernel.h"
+#include "png/stream.h"
+
+namespace PNG
+{
+    /// How the pixels of a PNG::CompactImage are stored, channels are never premultiplied by alpha.
+    enum class PixelFormat
+    {
+        RGBA8, RGBA16, GA8, Float,
+        // IEEE half floats, which have 11 bits of precision and can go beyond [0; 1] like PixelFormat::Float
+        RGBA16F,
+    };
+
+    namespace Pixel
+    {
+        struct RGBA8 { uint8_t R, G, B, A; };
+        struct RGBA16 { uint16_t R, G, B, A; };
+        struct GA8 { uint8_t Gray, A; };
+        // Each channel holds the bits of a half float, see PNG::Half
+        struct RGBA16F { uint16_t R, G, B, A; };
+        // PixelFormat::Float is stored as PNG::Color
+    }
+
+    namespace Half
+    {
+        /// Rounds `value` to the nearest half float, ties to even.
+        uint16_t FromFloat(float value);
+        float ToFloat(uint16_t half);
+
+        /// Converts `count` values at once, using F16C instructions if the CPU supports them.
+        void FromFloats(const float* in, uint16_t* out, size_t count);
+        void ToFloats(const uint16_t* in, float* out, size_t count);
+    }
+
+    size_t GetPixelSize(PixelFormat format);
+    /// Returns the smallest format which holds all samples of a png image without losing precision.
+    PixelFormat GetNativePixelFormat(uint8_t colorType, size_t bitDepth);
+
+    /**
+     * An image whose pixels are stored in a PNG::PixelFormat instead of as `PNG::Color`s.
+     * 8-bit images take a quarter of the memory they take in a PNG::Image, and integer formats are processed with integer arithmetic.
+     * Half float images take half the memory, and are processed as colors a row at a time.
+     */
+    class CompactImage
+    {
+    public:
+        CompactImage(size_t width, size_t height, PixelFormat format = PixelFormat::RGBA8) { SetSize(width, height, format); }
+
+        CompactImage()
+            : CompactImage(0, 0) { }
+
+        CompactImage(const CompactImage& other) = default;
+        CompactImage(CompactImage&& other) { *this = std::move(other); }
+
+        CompactImage& operator=(const CompactImage& other) = default;
+        /// `other` is left empty.
+        CompactImage& operator=(CompactImage&& other);
+
+        /// Converts `img` into `format`, samples are rounded like `PNG::Image::WriteRawPixels()` does.
+        static CompactImage FromImage(const Image& img, PixelFormat format);
+        Image ToImage() const;
+        void Convert(PixelFormat format);
+
+        void Crop(size_t left, size_t top, size_t right, size_t bottom);
+        void Resize(size_t width, size_t height, ScalingMethod scalingMethod = ScalingMethod::Nearest);
+
+        void ApplyKernel(const Kernel& kernel, WrapMode wrapMode = WrapMode::None);
+        void ApplyGrayscale();
+
+        void ApplyVerticalFlip();
+        void ApplyHorizontalFlip();
+
+        void ApplyRotation90(bool clockwise = false);
+        void ApplyRotation180();
+
+        /// If `other` has a different format, its pixels are converted while blending.
+        void Blend(const CompactImage& other, size_t x, size_t y, int64_t dx = 0, int64_t dy = 0, WrapMode wrapMode = WrapMode::None);
+
+        void SetSize(size_t width, size_t height, PixelFormat format);
+        inline void SetSize(size_t width, size_t height) { SetSize(width, height, m_Format); }
+        inline void Clear() { SetSize(0, 0); }
+
+        inline size_t GetWidth() const { return m_Width; }
+        inline size_t GetHeight() const { return m_Height; }
+        inline PixelFormat GetFormat() const { return m_Format; }
+        inline size_t GetPixelSize() const { return PNG::GetPixelSize(m_Format); }
+        inline size_t GetRowSize() const { return m_Width * GetPixelSize(); }
+
+        inline const uint8_t* GetPixels() const { return m_Pixels.data(); }
+        inline uint8_t* GetPixels() { return m_Pixels.data(); }
+
+        inline const uint8_t* operator[](size_t y) const { return &m_Pixels[y * GetRowSize()]; }
+        inline uint8_t* operator[](size_t y) { return &m_Pixels[y * GetRowSize()]; }
+
+        /// Returns row `y` as pixels of the struct which matches the format of the image, see PNG::Pixel.
+        template<typename PixelT>
+        const PixelT* GetRow(size_t y) const
+        {
+            PNG_ASSERT(sizeof(PixelT) == GetPixelSize(), "PNG::CompactImage::GetRow Pixel type does not match the format.");
+            return (const PixelT*)(*this)[y];
+        }
+
+        template<typename PixelT>
+        PixelT* GetRow(size_t y)
+        {
+            PNG_ASSERT(sizeof(PixelT) == GetPixelSize(), "PNG::CompactImage::GetRow Pixel type does not match the format.");
+            return (PixelT*)(*this)[y];
+        }
+
+        Color GetColor(size_t x, size_t y) const;
+        void SetColor(size_t x, size_t y, const Color& color);
+
+        /**
+         * @brief Converts row `y` into raw pixels, pixels of less than 8 bits are not packed.
+         * Palette color type is not supported, see PNG::Image::WriteRawRow().
+         */
+        Result WriteRawRow(uint8_t colorType, size_t bitDepth, size_t y, uint8_t* out) const;
+
+        /// Images written with `PNG::ColorType::PALETTE` are dithered through a PNG::Image.
+        Result Write(OStream& out, const ExportSettings& cfg = ExportSettings{}, bool async = false) const;
+        Result WriteMT(OStream& out, const ExportSettings& cfg = ExportSettings{}) const
+        {
+            return Write(out, cfg, true);
+        }
+
+        /// Decodes the image straight into its native pixel format, see PNG::GetNativePixelFormat().
+        static Result Read(IStream& in, CompactImage& out, const ImportSettings& cfg = ImportSettings{}, bool async = false);
+        static Result ReadMT(IStream& in, CompactImage& out, const ImportSettings& cfg = ImportSettings{})
+        {
+            return Read(in, out, cfg, true);
+        }
+
+    private:
+        size_t m_Width = 0;
+        size_t m_Height = 0;
+        PixelFormat m_Format = PixelFormat::RGBA8;
+        std::vector<uint8_t> m_Pixels;
+    };
+}
+
+#endif // _PNG_COMPACT_H
@@ -6,8 +6,14 @@
 #include "png/base.h"
 #include "png/stream.h"
 
+#include <memory>
+
 #define PNG_USE_ZLIB
 
+#ifdef PNG_USE_ZLIB
+struct z_stream_s; // Forward Declaration
+#endif // PNG_USE_ZLIB
+
 namespace PNG
 {
     namespace CompressionMethod
@@ -30,11 +36,109 @@ namespace PNG
 
         Result DecompressData(IStream& in, OStream& out);
         Result CompressData(IStream& in, OStream& out, CompressionLevel level = CompressionLevel::Default);
+        /**
+         * @brief Compresses `in` into a single zlib stream using multiple threads, like pigz does.
+         * Data is split into blocks which are deflated on their own, each one using the 32KiB before it as its dictionary.
+         * Blocks end with a sync flush, so they can be joined and their adler32 checksums combined.
+         * @param threads The max number of blocks deflated at the same time, 0 to use one per core.
+         */
+        Result CompressDataParallel(IStream& in, OStream& out, CompressionLevel level = CompressionLevel::Default, size_t threads = 0);
+        /**
+         * @brief Compresses `in` into a single zlib stream made of segments of `segmentSize` bytes which can be inflated on their own.
+         * Each segment starts with a fresh deflate state and ends on a byte boundary, see `PNG::ZLib::InflateStream`.
+         * @param threads The max number of segments deflated at the same time, 0 to use one per core.
+         * @param segmentOffsets Filled with the offset of each segment within the compressed stream.
+         */
+        Result CompressSegments(IStream& in, OStream& out, CompressionLevel level, size_t segmentSize, size_t threads, std::vector<uint64_t>& segmentOffsets);
+        /**
+         * @brief Returns the adler32 checksum of two buffers one after the other, like zlib's adler32_combine.
+         * @param adler1 The adler32 of the first buffer.
+         * @param adler2 The adler32 of the second buffer.
+         * @param len2 The length of the second buffer in bytes.
+         */
+        uint32_t CombineAdler32(uint32_t adler1, uint32_t adler2, uint64_t len2);
+
+        /**
+         * A stream which inflates data from another one as it is read, so that nothing is decompressed ahead of time.
+         * If `in` supports views, compressed data is never copied.
+         * If `rawDeflate` is true, `in` holds deflate data with no zlib header and trailer (e.g. a segment of `PNG::ZLib::CompressSegments()`).
+         */
+        class InflateStream : public IStream
+        {
+        public:
+            InflateStream(IStream& in, bool rawDeflate = false);
+            ~InflateStream();
+
+            InflateStream(const InflateStream& other) = delete;
+            InflateStream& operator=(const InflateStream& other) = delete;
+
+            /// @see PNG::IStream::ReadBuffer()
+            /// @return `PNG::Result::ZLib_DataError` if zlib failed to initialize the stream.
+            virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+
+            bool IsFinished() const { return m_Finished; }
+            /// The number of bytes inflated so far.
+            uint64_t GetTotalOut() const;
+            /**
+             * @brief The adler32 checksum of the bytes inflated so far.
+             * Raw deflate data has no trailer to check it against, see `PNG::ZLib::CombineAdler32()` to join the checksums of segments.
+             */
+            uint32_t GetAdler32() const;
+
+        private:
+            // Makes sure that some compressed data is available to zlib
+            Result FillInput();
+
+            IStream& m_In;
+            bool m_RawDeflate;
+            // zlib only keeps the checksum of streams with a zlib header
+            uint32_t m_RawAdler = 1;
+            std::unique_ptr<z_stream_s> m_Stream;
+            // Returned by every read if inflateInit2 failed
+            Result m_InitResult = Result::OK;
+            std::vector<uint8_t> m_InBuffer;
+            bool m_UseViews = true;
+            bool m_Finished = false;
+        };
+
+        /**
+         * A stream which deflates the data written to it into another one.
+         * Compressed data is written to `out` in blocks, call `Finish()` to end the compressed stream.
+         */
+        class DeflateStream : public OStream
+        {
+        public:
+            DeflateStream(OStream& out, CompressionLevel level = CompressionLevel::Default);
+            ~DeflateStream();
+
+            DeflateStream(const DeflateStream& other) = delete;
+            DeflateStream& operator=(const DeflateStream& other) = delete;
+
+            /// @see PNG::OStream::WriteBuffer()
+            virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
+            /// Does not force zlib to output what it's holding, since it would make compression worse.
+            virtual Result Flush() override { return Result::OK; }
+
+            /// Compresses all remaining data and writes the end of the compressed stream.
+            Result Finish();
+            bool IsFinished() const { return m_Finished; }
+
+        private:
+            Result Deflate(int flush);
+
+            OStream& m_Out;
+            std::unique_ptr<z_stream_s> m_Stream;
+            std::vector<uint8_t> m_OutBuffer;
+            bool m_Finished = false;
+        };
     }
 #endif // PNG_USE_ZLIB
 
     Result DecompressData(uint8_t method, IStream& in, OStream& out);
-    Result CompressData(uint8_t method, IStream& in, OStream& out, CompressionLevel level = CompressionLevel::Default);
+    /// Uses `PNG::ZLib::CompressDataParallel()` unless `threads` is 1, see it for the meaning of `threads`.
+    Result CompressData(uint8_t method, IStream& in, OStream& out, CompressionLevel level = CompressionLevel::Default, size_t threads = 1);
+    /// @see PNG::ZLib::CompressSegments()
+    Result CompressSegments(uint8_t method, IStream& in, OStream& out, CompressionLevel level, size_t segmentSize, size_t threads, std::vector<uint64_t>& segmentOffsets);
 }
 
 #endif // _PNG_COMPRESSION_H
@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef _PNG_CPU_H
+#define _PNG_CPU_H
+
+#include "png/base.h"
+
+// Defining PNG_NO_SIMD when building png only leaves portable code
+#if !defined(PNG_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define PNG_X86_SIMD
+#endif // !PNG_NO_SIMD && x86
+
+// Compiles a function with instructions which are not enabled for the whole build
+// Such functions must only be called after checking PNG::CPU::GetFeatures()
+#if defined(__GNUC__) || defined(__clang__)
+#define PNG_TARGET(isa) __attribute__((target(isa)))
+#else // __GNUC__ || __clang__
+#define PNG_TARGET(isa)
+#endif // __GNUC__ || __clang__
+
+namespace PNG
+{
+    namespace CPU
+    {
+        struct Features
+        {
+            bool SSE2 = false;
+            bool SSSE3 = false;
+            bool SSE41 = false;
+            bool AVX2 = false;
+            bool PCLMUL = false;
+            bool F16C = false;
+        };
+
+        /**
+         * @brief Returns the instruction sets supported by the CPU, which are detected only once.
+         * If `PNG_NO_SIMD` was defined when building png, none of them is reported.
+         */
+        const Features& GetFeatures();
+    }
+}
+
+#endif // _PNG_CPU_H
@@ -11,14 +11,28 @@ namespace PNG
     {
     public:
         // Code taken from http://www.libpng.org/pub/png/spec/1.2/PNG-CRCAppendix.html
+        // Buffers are processed 8 bytes at a time, or folded with carry-less multiplications if the CPU supports them
         static uint32_t Update(uint32_t crc, const void* buf, size_t bufLen);
         static uint32_t Update(uint32_t crc, uint32_t val);
         static uint32_t Calculate(const void* buf, size_t bufLen);
+        /**
+         * @brief Returns the CRC of two buffers one after the other, like zlib's crc32_combine.
+         * @param crc1 The CRC of the first buffer, as returned by `PNG::CRC::Calculate()`.
+         * @param crc2 The CRC of the second buffer, as returned by `PNG::CRC::Calculate()`.
+         * @param len2 The length of the second buffer in bytes.
+         */
+        static uint32_t Combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
     
     private:
         CRC();
-        uint32_t m_Table[256]{0};
+        // m_Table[k][n] is the CRC of byte n followed by k zeros, used to process 8 bytes at a time
+        uint32_t m_Table[8][256]{};
+        // m_X2N[k] is x^(2^k) modulo the CRC polynomial, used to combine CRCs
+        uint32_t m_X2N[32]{};
         static const CRC m_Instance;
+
+        static uint32_t UpdateSliced(uint32_t crc, const uint8_t* buf, size_t bufLen);
+        static uint32_t MultiplyModP(uint32_t a, uint32_t b);
     };
 }
 
@@ -25,11 +25,36 @@ namespace PNG
             const uint8_t PAETH = 4;
         }
 
-        Result FilterPixels(size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out);
+        /**
+         * @brief Reads `height` raw scanlines from `in` and writes them filtered to `out`.
+         * @param parallel Whether to filter bands of rows on multiple threads, each band is written to `out` as a whole.
+         * @param restartInterval If not 0, every `restartInterval` rows one is filtered without using the previous one, see `PNG::RestartIndex`.
+         */
+        Result FilterPixels(size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out, bool parallel = false, size_t restartInterval = 0);
         Result UnfilterPixels(size_t width, size_t height, size_t pixelBits, IStream& in, std::vector<uint8_t>& out);
+
+        /**
+         * @brief Unfilters a single packed scanline in place.
+         * @param prevRow The previous unfiltered scanline, `nullptr` if `row` is the first one.
+         * @param bpp The number of bytes per complete pixel, rounded up to one.
+         */
+        Result UnfilterRow(uint8_t filterType, uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp);
+
+        /**
+         * @brief Filters a single packed scanline into `out`, choosing the filter type from `clevel`.
+         * @param prevRow The previous unfiltered scanline, `nullptr` if `row` is the first one or must not depend on it.
+         * @param fil A buffer of `rowSize` bytes used to score filters, only needed by `PNG::CompressionLevel::BestSize`.
+         * @return The filter type which was applied.
+         */
+        uint8_t FilterRow(CompressionLevel clevel, const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out, uint8_t* fil);
     }
 
-    Result FilterPixels(uint8_t method, size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out);
+    /// Unpacks `width` pixels of less than 8 bits each from `in` into one byte each in `out`.
+    void UnpackPixels(const uint8_t* in, uint8_t* out, size_t width, size_t pixelBits);
+    /// Packs `width` pixels of less than 8 bits each from one byte each in `in` into `out`, which may be `in`.
+    void PackPixels(const uint8_t* in, uint8_t* out, size_t width, size_t pixelBits);
+
+    Result FilterPixels(uint8_t method, size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out, bool parallel = false, size_t restartInterval = 0);
     Result UnfilterPixels(uint8_t method, size_t width, size_t height, size_t pixelBits, IStream& in, std::vector<uint8_t>& out);
 }
 
@@ -11,6 +11,9 @@
 #include "png/kernel.h"
 #include "png/stream.h"
 
+#include <functional>
+#include <unordered_set>
+
 namespace PNG
 {
     enum class ScalingMethod
@@ -23,12 +26,59 @@ namespace PNG
         None, Floyd, Atkinson
     };
 
+    class Image; // Forward Declaration
+
+    /// A rectangle of pixels within an image, see `PNG::ImportSettings::Region`.
+    struct ImageRegion
+    {
+        uint32_t X = 0;
+        uint32_t Y = 0;
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+
+        bool IsEmpty() const { return Width == 0 || Height == 0; }
+        /// Returns the region itself, or the whole image described by `ihdr` if the region is empty.
+        ImageRegion Resolve(const ImageHeader& ihdr) const;
+        /// Checks that the region fits into the image described by `ihdr`, empty regions always do.
+        Result Validate(const ImageHeader& ihdr) const;
+    };
+
     struct ImportSettings
     {
         ImageHeader* IHDROut = nullptr;
         Metadata_T* MetadataOut = nullptr;
         LastModificationTime* LastModificationTimeOut = nullptr;
         Palette_T* PaletteOut = nullptr;
+        // Max number of bytes buffered between the stages of a multi-threaded read, split evenly between them
+        // Producers wait for consumers when their share is full, single-threaded reads are not limited
+        // Set to 0 to not limit the amount of buffered bytes
+        // Images with a restart index (see PNG::RestartIndex) need all of their IDATs at once, only those which are not views of the input are held
+        size_t MaxPipelineBytes = 4194304; // 4MiB
+        // Set to false to skip CRC checks, only for sources which are trusted not to be corrupted
+        // Multi-threaded reads check the CRC of IDATs away from the reader, on a thread of their own or right before they are inflated
+        bool CheckCRC = true;
+        // Streams which are not buffered (see PNG::IStream::IsBuffered) are read in blocks of this many bytes
+        // Blocks may go past the end of the image, what is left of the last one is given back to streams which can seek (see PNG::IStream::Unread)
+        // Set to 0 to read streams which can't seek directly if they hold more data after the image
+        size_t ReadBufferSize = 65536; // 64KiB
+        // If not nullptr, only text chunks with one of these keywords are read into MetadataOut
+        // Other text chunks are skipped without being parsed or decompressed
+        const std::vector<std::string>* MetadataKeywords = nullptr;
+        // Whether compressed text is left deflated in MetadataOut until PNG::TextualData::InflateText() is called
+        bool LazyMetadata = false;
+        // If not empty, only this region is decoded and the image which is read has its size, IHDROut still describes the whole image
+        // Decoding of non-interlaced images stops after the last row of the region, interlaced ones are decoded up to Adam7Passes
+        // The region is within the image which is decoded, which is smaller than the whole one if Adam7Passes is less than 7
+        ImageRegion Region;
+        // Interlaced images are only decoded up to this Adam7 pass (from 1 to 7), image data after it is not inflated
+        // The image which is read is the grid of pixels held by those passes, see PNG::Adam7::GetPassGridSize
+        size_t Adam7Passes = 7;
+        // Whether the image decoded from fewer than 7 Adam7 passes has the whole size, each pixel of the grid is repeated over the missing ones
+        bool ExpandAdam7Passes = false;
+        // If set, PNG::Image::Read calls it after each Adam7 pass of an interlaced image with the pass (from 1) and the image read so far
+        // Pixels of later passes hold the closest one which was already decoded, returning anything but Result::OK stops the read
+        // Multi-threaded reads call it from the decoding thread
+        std::function<Result(size_t pass, const Image& image)> Adam7PassCallback;
     };
 
     struct ExportSettings
@@ -46,10 +96,107 @@ namespace PNG
         // This is four times the size GIMP uses (and I suppose the official libpng implementation)
         // Set to -1 (or ~0) to create the least amount of IDAT chunks
         uint32_t IDATSize = 32768;
+        // Max number of bytes buffered between the stages of a multi-threaded write, split evenly between them
+        // Producers wait for consumers when their share is full, single-threaded writes are not limited
+        // Set to 0 to not limit the amount of buffered bytes
+        size_t MaxPipelineBytes = 4194304; // 4MiB
+        // Streams which are not buffered (see PNG::OStream::IsBuffered) are written in blocks of this many bytes
+        // Set to 0 to write to the stream directly
+        size_t WriteBufferSize = 65536; // 64KiB
+        // Number of threads which deflate image data in a multi-threaded write, set to 0 to use one per core
+        // With more than 1 image data is deflated in blocks of 128KiB, which makes it slightly bigger
+        // Single-threaded writes always use 1
+        size_t CompressionThreads = 1;
+        // If not 0, image data is split into segments of this many rows which can be decoded at the same time
+        // Their position is stored in a private chunk, see PNG::RestartIndex, other decoders read the image normally
+        // Only supported by non-interlaced images written by PNG::Image::Write
+        uint32_t RestartInterval = 0;
 
         Result Validate() const;
     };
 
+    /**
+     * Reads the chunks of a png image one at a time, validating their order and storing the data they hold.
+     * Image data (IDAT) is left to the caller.
+     */
+    class ChunkReader
+    {
+    public:
+        ChunkReader(const ImportSettings& cfg = ImportSettings{})
+            : m_Settings(cfg) { }
+
+        /// Reads the png signature and the IHDR chunk.
+        Result ReadHeader(IStream& in);
+        /**
+         * @brief Reads the next chunk into `chunk` and handles it, the CRC of the chunk is also checked.
+         * @param checkIDATCRC Whether the CRC of IDAT chunks is checked, if false it is left to the caller which handles image data.
+         * CRCs are never checked if `PNG::ImportSettings::CheckCRC` is false.
+         */
+        Result ReadNext(IStream& in, ChunkView& chunk, bool checkIDATCRC = true);
+        /**
+         * @brief Like ReadNext, but the data of IDAT chunks is skipped (see `PNG::ChunkView::SkipData()`), leaving them empty.
+         * Used to reach the chunks which come after image data without decoding it.
+         */
+        Result ReadNextSkippingIDAT(IStream& in, ChunkView& chunk);
+
+        const ImportSettings& GetSettings() const { return m_Settings; }
+        /// Settings may be changed after ReadHeader to fit the image, as long as image data was not read yet.
+        ImportSettings& GetSettings() { return m_Settings; }
+        const ImageHeader& GetHeader() const { return m_IHDR; }
+        /// Returns the header of the image which `PNG::ReadImageData()` decodes, which is smaller if `PNG::ImportSettings::Adam7Passes` skips some passes.
+        ImageHeader GetDecodedHeader() const;
+        const Palette_T& GetPalette() const { return m_Palette; }
+        Palette_T& GetPalette() { return m_Palette; }
+
+        /// Returns the restart index of the image, which has no segments if riDX wasn't found before the first IDAT.
+        const RestartIndex& GetRestartIndex() const { return m_RestartIndex; }
+
+        bool HasRead(uint32_t chunkType) const { return m_ChunkTypesRead.contains(chunkType); }
+        bool HasReadHeader() const { return m_LastChunkType != 0; }
+        bool IsFinished() const { return m_LastChunkType == ChunkType::IEND; }
+
+    private:
+        // Validates the order of `chunk`, which was just read, and stores the data it holds
+        Result HandleChunk(const ChunkView& chunk, bool checkCRC);
+
+        ImportSettings m_Settings;
+        ImageHeader m_IHDR;
+        Palette_T m_Palette;
+        RestartIndex m_RestartIndex;
+        std::unordered_set<uint32_t> m_ChunkTypesRead;
+        uint32_t m_LastChunkType = 0;
+    };
+
+    /**
+     * Called with the index of each row of an image and its raw pixels, pixels of less than 8 bits are unpacked.
+     * Multi-threaded reads may load different rows at the same time. See `PNG::Image::LoadRawRow()`.
+     */
+    using RawRowLoader = std::function<Result(size_t y, const uint8_t* rawRow)>;
+    /// Writes the raw pixels of a whole image into the given stream, pixels of less than 8 bits are not packed.
+    using RawPixelsWriter = std::function<Result(OStream& out)>;
+
+    /**
+     * @brief Reads the png signature and all chunks up to the first IDAT, which is read into `idat`.
+     * If `PNG::ChunkReader::ReadHeader()` was already called, e.g. to change the settings of `chunkReader`, reading starts after IHDR.
+     * @param async Must match the one given to `PNG::ReadImageData()`, multi-threaded reads check the CRC of IDATs there.
+     */
+    Result ReadImageHead(IStream& in, ChunkReader& chunkReader, ChunkView& idat, bool async = false);
+    /**
+     * @brief Decodes image data starting from `idat`, the first IDAT chunk, and reads all remaining chunks up to IEND.
+     * Rows are those of the image described by `PNG::ChunkReader::GetDecodedHeader()`, only the ones within `PNG::ImportSettings::Region` are loaded, whole.
+     * Non-interlaced images are not inflated past the last row of the region, interlaced ones past `PNG::ImportSettings::Adam7Passes`.
+     * @param onPass If set, rows of interlaced images are loaded after each Adam7 pass and then it's called, see `PNG::Adam7::DeinterlacePasses()`.
+     */
+    Result ReadImageData(IStream& in, ChunkReader& chunkReader, ChunkView& idat, const RawRowLoader& loadRow, bool async = false,
+        const Adam7::PassCallback& onPass = nullptr);
+
+    /// Writes the png signature and all chunks which come before image data (IDAT), `cfg` should already be valid.
+    Result WriteImageHead(OStream& out, const ImageHeader& ihdr, const ExportSettings& cfg);
+    /// Filters, compresses and writes the raw pixels given by `writeRawPixels` as IDAT chunks, `cfg` should already be valid.
+    Result WriteImageData(OStream& out, const ImageHeader& ihdr, const ExportSettings& cfg, const RawPixelsWriter& writeRawPixels, bool async = false);
+    /// Writes the IEND chunk.
+    Result WriteImageEnd(OStream& out);
+
     enum class WrapMode
     {
         None, Clamp, Repeat,
@@ -163,6 +310,23 @@ namespace PNG
         Result WriteDitheredRawPixels(const Palette_T& palette, size_t bitDepth, DitheringMethod ditheringMethod, OStream& out) const;
         Result LoadRawPixels(uint8_t colorType, size_t bitDepth, const Palette_T* palette, const std::vector<uint8_t>& in);
 
+        /**
+         * @brief Converts `width` colors from `in` into raw pixels, pixels of less than 8 bits are not packed.
+         * Channels are clamped to [0; 1] and rounded to the nearest sample.
+         * Palette color type is not supported, see PNG::Image::DitherRow().
+         */
+        static Result WriteRawRow(uint8_t colorType, size_t bitDepth, const Color* in, size_t width, uint8_t* out);
+        /**
+         * @brief Maps row `y` of `img` to the indices of the closest palette colors.
+         * The quantization error of each pixel is diffused into the pixels of `img` which follow it.
+         */
+        static void DitherRow(Image& img, size_t y, const Palette_T& palette, DitheringMethod ditheringMethod, uint8_t* out);
+        /**
+         * @brief Converts `width` raw pixels from `in` into colors, pixels of less than 8 bits must already be unpacked.
+         * @see PNG::UnpackPixels()
+         */
+        static Result LoadRawRow(uint8_t colorType, size_t bitDepth, const Palette_T* palette, const uint8_t* in, size_t width, Color* out);
+
         Result Write(OStream& out, const ExportSettings& cfg = ExportSettings{}, bool async = false) const;
         Result WriteMT(OStream& out, const ExportSettings& cfg = ExportSettings{}) const
         {
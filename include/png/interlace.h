@@ -7,6 +7,8 @@
 #include "png/compression.h"
 #include "png/stream.h"
 
+#include <functional>
+
 namespace PNG
 {
     namespace InterlaceMethod
@@ -17,15 +19,37 @@ namespace PNG
 
     namespace Adam7
     {
+        /// Called with the index of a pass (from 1) once it was decoded, see PNG::Adam7::DeinterlacePasses().
+        using PassCallback = std::function<Result(size_t pass)>;
+
         Result InterlacePixels(uint8_t filterMethod, size_t width, size_t height,
-            size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out);
+            size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out, bool parallel = false);
 
         Result DeinterlacePixels(uint8_t filterMethod, size_t width, size_t height,
             size_t bitDepth, size_t samples, IStream& in, std::vector<uint8_t>& out);
+
+        /**
+         * @brief Returns the size of the grid of pixels held by the first `passes` passes of a `width`x`height` image.
+         * The first pass holds 1/8 of the image on each side, all 7 hold the whole image.
+         */
+        void GetPassGridSize(size_t passes, size_t width, size_t height, size_t& gridWidth, size_t& gridHeight);
+        /**
+         * @brief Like DeinterlacePixels, but only the first `passes` passes are read from `in`.
+         * @param expand
+         * If true, `out` holds the whole image and each pixel of the grid is repeated over the ones which later passes would fill.
+         * Otherwise, it holds just the grid, see `PNG::Adam7::GetPassGridSize()`.
+         * @param onPass
+         * If set, it's called after each pass, when each pixel of `out` holds the closest one decoded so far (the top-left one of its block).
+         * Returning anything but `PNG::Result::OK` stops decoding.
+         */
+        Result DeinterlacePasses(uint8_t filterMethod, size_t width, size_t height,
+            size_t bitDepth, size_t samples, size_t passes, bool expand, IStream& in, std::vector<uint8_t>& out,
+            const PassCallback& onPass = nullptr);
     }
 
+    // If parallel is true, rows are filtered on multiple threads, see PNG::AdaptiveFiltering::FilterPixels()
     Result InterlacePixels(uint8_t method, uint8_t filterMethod, size_t width, size_t height,
-        size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out);
+        size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out, bool parallel = false);
 
     Result DeinterlacePixels(uint8_t method, uint8_t filterMethod, size_t width, size_t height,
         size_t bitDepth, size_t samples, IStream& in, std::vector<uint8_t>& out);
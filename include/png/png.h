@@ -6,6 +6,7 @@
 #include "png/base.h"
 #include "png/chunk.h"
 #include "png/color.h"
+#include "png/compact.h"
 #include "png/compression.h"
 #include "png/crc.h"
 #include "png/filter.h"
@@ -13,7 +14,10 @@
 #include "png/interlace.h"
 #include "png/kernel.h"
 #include "png/palette.h"
+#include "png/probe.h"
+#include "png/scanline.h"
 #include "png/stream.h"
+#include "png/thumbnail.h"
 #include "png/utils.h"
 
 #endif // _PNG_H
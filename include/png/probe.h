@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef _PNG_PROBE_H
+#define _PNG_PROBE_H
+
+#include "png/base.h"
+#include "png/chunk.h"
+#include "png/color.h"
+#include "png/stream.h"
+
+namespace PNG
+{
+    struct ProbeSettings
+    {
+        // Whether the chunks which come after image data are also read, e.g. text written after the pixels
+        // IDATs are skipped without being decoded, streams which can seek don't read them at all (see PNG::IStream::Skip)
+        bool ReadTrailingChunks = false;
+        // Set to false to skip CRC checks, only for sources which are trusted not to be corrupted
+        bool CheckCRC = true;
+        // See PNG::ImportSettings::MetadataKeywords
+        const std::vector<std::string>* MetadataKeywords = nullptr;
+        // See PNG::ImportSettings::LazyMetadata
+        bool LazyMetadata = false;
+    };
+
+    /// What PNG::Probe() found in the chunks of an image.
+    struct ProbeResult
+    {
+        ImageHeader IHDR;
+        // The palette with the alpha given by tRNS, empty if the image has no PLTE chunk
+        Palette_T Palette;
+        Metadata_T Metadata;
+        PNG::LastModificationTime LastModificationTime;
+        bool HasLastModificationTime = false;
+    };
+
+    /**
+     * @brief Reads the header and metadata of an image without decoding its pixels.
+     * Reading stops at the first IDAT chunk, whose data is not read, unless `PNG::ProbeSettings::ReadTrailingChunks` is set.
+     * Only the chunks themselves are read, so the stream is not wrapped in a PNG::BufferedIStream like `PNG::Image::Read()` does.
+     */
+    Result Probe(IStream& in, ProbeResult& out, const ProbeSettings& cfg = ProbeSettings{});
+}
+
+#endif // _PNG_PROBE_H
@@ -0,0 +1,215 @@
+#pragma once
+
+#ifndef _PNG_SCANLINE_H
+#define _PNG_SCANLINE_H
+
+#include "png/base.h"
+#include "png/chunk.h"
+#include "png/color.h"
+#include "png/compression.h"
+#include "png/image.h"
+#include "png/stream.h"
+
+#include <memory>
+
+namespace PNG
+{
+    /**
+     * Unfilters the scanlines of a non-interlaced image and converts them into colors one at a time.
+     * Each scanline is converted right after being unfiltered, while it's still in cache.
+     */
+    class ScanlineDecoder
+    {
+    public:
+        ScanlineDecoder() = default;
+
+        /**
+         * @brief Prepares the decoder for the scanline at `firstRow` of an image described by `ihdr`.
+         * Decoding can only start after the first row at the start of a segment, see `PNG::RestartIndex`.
+         */
+        void Reset(const ImageHeader& ihdr, size_t firstRow = 0);
+        /**
+         * @brief Reads the next filtered scanline from `in` and decodes it into `row`, which must hold at least `ihdr.Width` colors.
+         * @param palette The palette of the image, only used by `PNG::ColorType::PALETTE`.
+         */
+        Result DecodeRow(IStream& in, const Palette_T& palette, Color* row);
+        /**
+         * @brief Reads the next filtered scanline from `in` and unfilters it, pixels of less than 8 bits are unpacked.
+         * `rawRow` points into the decoder, and is valid until the next row is decoded.
+         */
+        Result DecodeRawRow(IStream& in, const uint8_t*& rawRow);
+
+        /// Returns the index of the row which will be decoded next.
+        size_t GetCurrentRow() const { return m_Row; }
+
+    private:
+        ImageHeader m_IHDR;
+        size_t m_FirstRow = 0;
+        size_t m_Row = 0;
+        size_t m_PixelBits = 0;
+        std::vector<uint8_t> m_PrevRow;
+        std::vector<uint8_t> m_CurRow;
+        std::vector<uint8_t> m_Unpacked;
+    };
+
+    /**
+     * Decodes a non-interlaced png image one row at a time.
+     * Only the current and the previous scanlines are kept in memory, so the whole image is never materialized.
+     */
+    class ScanlineReader
+    {
+    public:
+        ScanlineReader() = default;
+
+        ScanlineReader(const ScanlineReader& other) = delete;
+        ScanlineReader& operator=(const ScanlineReader& other) = delete;
+
+        /**
+         * @brief Reads all chunks up to the first IDAT, `in` must outlive this reader.
+         * `cfg.IHDROut` and `cfg.PaletteOut` are filled here, other chunks are handled as they are found.
+         */
+        Result Open(IStream& in, const ImportSettings& cfg = ImportSettings{});
+        /**
+         * @brief Decodes the next row into `row`, which must hold at least `GetWidth()` colors.
+         * @return PNG::Result::EndOfFile if all rows were already read.
+         * Once reading fails, this and Finish() return the same error until the reader is opened again.
+         */
+        Result ReadRow(Color* row);
+        /// Skips all rows which were not read and reads the remaining chunks up to IEND, see ReadRow() for errors.
+        Result Finish();
+
+        bool IsOpen() const { return (bool)m_Inflater; }
+
+        const ImageHeader& GetHeader() const { return m_ChunkReader.GetHeader(); }
+        const Palette_T& GetPalette() const { return m_ChunkReader.GetPalette(); }
+        size_t GetWidth() const { return GetHeader().Width; }
+        size_t GetHeight() const { return GetHeader().Height; }
+        /// Returns the index of the row which will be read next.
+        size_t GetCurrentRow() const { return m_Decoder.GetCurrentRow(); }
+
+    private:
+        // Reads the data of consecutive IDAT chunks as they are needed
+        class IDATStream : public IStream
+        {
+        public:
+            IDATStream(IStream& in, ChunkReader& reader)
+                : m_In(in), m_Reader(reader) { }
+
+            // Reads chunks up to the first IDAT
+            Result Open();
+
+            /// @see PNG::IStream::ReadBuffer()
+            virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+            /// @see PNG::IStream::ReadView()
+            virtual Result ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed = nullptr) override;
+
+            bool IsFinished() const { return m_Finished; }
+            IStream& GetInput() { return m_In; }
+
+        private:
+            // Makes sure that the current chunk has some data left, unless the last IDAT was read
+            Result NextChunk();
+            // Reads the next chunk into m_Chunk, which is left empty if that fails
+            Result ReadNextChunk();
+
+            IStream& m_In;
+            ChunkReader& m_Reader;
+            ChunkView m_Chunk;
+            size_t m_Offset = 0;
+            bool m_Finished = false;
+            // The first error, which is returned by every later read
+            Result m_Error = Result::OK;
+        };
+
+        // Keeps `res` as m_Error if it's an error
+        Result Latch(Result res);
+        // Inflates the rest of image data and reads the chunks after it
+        Result FinishImageData();
+
+        ChunkReader m_ChunkReader;
+        std::unique_ptr<IDATStream> m_IDAT;
+        std::unique_ptr<ZLib::InflateStream> m_Inflater;
+        ScanlineDecoder m_Decoder;
+        // The first error of ReadRow or Finish
+        Result m_Error = Result::OK;
+    };
+
+    /**
+     * Encodes a non-interlaced png image one row at a time.
+     * Rows are filtered against the previous one and compressed as they are written, IDAT chunks are written as they fill up.
+     */
+    class ScanlineWriter
+    {
+    public:
+        ScanlineWriter() = default;
+
+        ScanlineWriter(const ScanlineWriter& other) = delete;
+        ScanlineWriter& operator=(const ScanlineWriter& other) = delete;
+
+        /**
+         * @brief Writes all chunks which come before image data, `out` and `cfg.Palette` must outlive this writer.
+         * @return PNG::Result::UnsupportedInterlaceMethod if `cfg.InterlaceMethod` is not `PNG::InterlaceMethod::NONE`.
+         */
+        Result Open(OStream& out, size_t width, size_t height, const ExportSettings& cfg = ExportSettings{});
+        /**
+         * @brief Encodes the next row, which must hold at least `GetWidth()` colors.
+         * @return PNG::Result::UpdatingClosedStreamError if all rows were already written.
+         */
+        Result WriteRow(const Color* row);
+        /**
+         * @brief Ends the compressed stream and writes the remaining chunks up to IEND.
+         * @return PNG::Result::InvalidImageSize if not all rows were written.
+         */
+        Result Finish();
+
+        bool IsOpen() const { return (bool)m_Deflater; }
+
+        const ImageHeader& GetHeader() const { return m_IHDR; }
+        size_t GetWidth() const { return m_IHDR.Width; }
+        size_t GetHeight() const { return m_IHDR.Height; }
+        /// Returns the index of the row which will be written next.
+        size_t GetCurrentRow() const { return m_Row; }
+
+    private:
+        // Splits the data written to it into IDAT chunks
+        class IDATStream : public OStream
+        {
+        public:
+            IDATStream(OStream& out, uint32_t idatSize)
+                : m_Out(out), m_IDATSize(idatSize) { m_Chunk.Type = ChunkType::IDAT; }
+
+            /// @see PNG::OStream::WriteBuffer()
+            virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
+            /// Chunks are written as soon as they are full, see Finish()
+            virtual Result Flush() override { return Result::OK; }
+
+            // Writes the last chunk
+            Result Finish();
+
+        private:
+            Result WriteChunk();
+
+            OStream& m_Out;
+            uint32_t m_IDATSize;
+            Chunk m_Chunk;
+        };
+
+        ExportSettings m_Settings;
+        ImageHeader m_IHDR;
+        OStream* m_Out = nullptr;
+        std::unique_ptr<IDATStream> m_IDAT;
+        std::unique_ptr<ZLib::DeflateStream> m_Deflater;
+
+        size_t m_Row = 0;
+        size_t m_PixelBits = 0;
+        std::vector<uint8_t> m_PrevRow;
+        std::vector<uint8_t> m_CurRow;
+        // Holds the filter type followed by the filtered row
+        std::vector<uint8_t> m_Filtered;
+        std::vector<uint8_t> m_FilterScratch;
+        // Holds the current row and the errors diffused into the next ones when dithering
+        Image m_DitherRows;
+    };
+}
+
+#endif // _PNG_SCANLINE_H
@@ -4,9 +4,17 @@
 #define _PNG_STREAM_H
 
 #include "png/base.h"
-
+#include "png/utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <istream>
 #include <mutex>
+#include <string>
 
 namespace PNG
 {
@@ -28,6 +36,31 @@ namespace PNG
         /// @see PNG::IStream::ReadBuffer()
         virtual Result ReadVector(std::vector<uint8_t>& vec, size_t* bytesRead = nullptr) { return ReadBuffer(vec.data(), vec.size(), bytesRead); }
 
+        /**
+         * @brief Gets a pointer to the next `viewLen` bytes of the stream without copying them, the stream is advanced as if they were read.
+         * @param view
+         * Set to point to the data, which is valid until the next read operation on the stream
+         * or for as long as the stream is if `PNG::IStream::HasStableViews()` is true.
+         * @param viewLen The number of bytes to view.
+         * @param bytesViewed Same as `bytesRead` in `PNG::IStream::ReadBuffer()`.
+         * @return
+         * `PNG::Result::UnsupportedStreamOperation` if the stream can't provide the view (the stream is left untouched),
+         * in which case `PNG::IStream::ReadBuffer()` should be used instead.
+         */
+        virtual Result ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed = nullptr)
+        {
+            (void)view;
+            (void)viewLen;
+            (void)bytesViewed;
+            return Result::UnsupportedStreamOperation;
+        }
+
+        /**
+         * @brief Whether views returned by `PNG::IStream::ReadView()` stay valid after further reads, until the stream is closed or destroyed.
+         * Data which is kept while the stream is read further (e.g. the IDAT chunks queued by `PNG::Image::Read()`) is copied otherwise.
+         */
+        virtual bool HasStableViews() const { return false; }
+
         /// Reads a NULL-terminated string.
         virtual Result ReadString(std::string& out)
         {
@@ -42,15 +75,45 @@ namespace PNG
             return Result::OK;
         }
 
+        /**
+         * @brief Advances the stream by `len` bytes without returning them.
+         * Streams which can seek don't read the bytes they skip, others read them into a scratch buffer.
+         * @return `PNG::Result::UnexpectedEOF` if the stream ends before `len` bytes.
+         */
+        virtual Result Skip(size_t len)
+        {
+            uint8_t buf[4096];
+            while (len > 0) {
+                size_t rLen = std::min(len, sizeof(buf));
+                PNG_RETURN_IF_NOT_OK(ReadBuffer, buf, rLen);
+                len -= rLen;
+            }
+            return Result::OK;
+        }
+
+        /**
+         * @brief Moves the stream back by `len` bytes, which must have already been read from it.
+         * Used by PNG::BufferedIStream to give back what it read past the data which was needed.
+         * @return `PNG::Result::UnsupportedStreamOperation` if the stream can't go back, e.g. pipes (the stream is left untouched).
+         */
+        virtual Result Unread(size_t len)
+        {
+            (void)len;
+            return Result::UnsupportedStreamOperation;
+        }
+
+        /**
+         * @brief Whether small reads are cheap, e.g. because the stream is backed by memory.
+         * `PNG::Image::Read()` reads streams which are not through a PNG::BufferedIStream.
+         */
+        virtual bool IsBuffered() const { return false; }
+
         template<typename T>
         Result ReadNumber(T& out)
         {
-            out = 0;
-            uint8_t buf[1];
-            for (size_t i = 0; i < sizeof(T); i++) {
-                PNG_RETURN_IF_NOT_OK(ReadBuffer, buf, 1, nullptr);
-                out = (out << 8) | buf[0];
-            }
+            uint8_t buf[sizeof(T)];
+            PNG_RETURN_IF_NOT_OK(ReadBuffer, buf, sizeof(T), nullptr);
+            out = Utils::LoadBigEndian<T>(buf);
             return Result::OK;
         }
 
@@ -90,15 +153,18 @@ namespace PNG
          */
         virtual Result Flush() = 0;
 
+        /**
+         * @brief Whether small writes are cheap, e.g. because the stream is backed by memory.
+         * `PNG::Image::Write()` writes to streams which are not through a PNG::BufferedOStream.
+         */
+        virtual bool IsBuffered() const { return false; }
+
         template<typename T>
         Result WriteNumber(T in)
         {
-            uint8_t buf[1];
-            for (size_t i = 0; i < sizeof(T); i++) {
-                buf[0] = (uint8_t)(in >> (8 * (sizeof(T) - i - 1)));
-                PNG_RETURN_IF_NOT_OK(WriteBuffer, buf, 1);
-            }
-            return Result::OK;
+            uint8_t buf[sizeof(T)];
+            Utils::StoreBigEndian<T>(in, buf);
+            return WriteBuffer(buf, sizeof(T));
         }
 
         virtual Result WriteU8(uint8_t out) { return WriteBuffer(&out, 1); }
@@ -116,6 +182,8 @@ namespace PNG
         virtual Result WriteBuffer(const void* buf, size_t bufLen) = 0;
         /// @see PNG::OStream::Flush()
         virtual Result Flush() = 0;
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return false; }
     };
 
     class IStreamWrapper : public IStream
@@ -126,6 +194,10 @@ namespace PNG
 
         /// @see PNG::IStream::ReadBuffer()
         virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+        /// Seeks if the stream supports it, e.g. files, otherwise what is skipped is read.
+        virtual Result Skip(size_t len) override;
+        /// Seeks back if the stream supports it, e.g. files and string streams.
+        virtual Result Unread(size_t len) override;
     private:
         std::istream& m_Stream;
 
@@ -146,6 +218,77 @@ namespace PNG
 
     };
 
+    /**
+     * Reads another stream in blocks, so that small reads don't each go through it.
+     * The underlying stream may be read past the data which was read from this one, that part is given back
+     * on destruction if the underlying stream supports it (see `PNG::IStream::Unread()`).
+     * Views are only provided by the underlying stream while the block is empty, since they must outlive the next read.
+     */
+    class BufferedIStream : public IStream
+    {
+    public:
+        /// The block is allocated on the first read. Reads of at least `blockSize` bytes skip it.
+        BufferedIStream(IStream& in, size_t blockSize = 65536)
+            : m_Stream(in), m_BlockSize(std::max<size_t>(blockSize, 1)) { }
+        ~BufferedIStream();
+
+        BufferedIStream(const BufferedIStream& other) = delete;
+        BufferedIStream& operator=(const BufferedIStream& other) = delete;
+
+        /// @see PNG::IStream::ReadBuffer()
+        virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+        /// @see PNG::IStream::ReadView()
+        virtual Result ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed = nullptr) override;
+        /// Views come from the underlying stream, so they are as stable as its own.
+        virtual bool HasStableViews() const override { return m_Stream.HasStableViews(); }
+        /// @see PNG::IStream::ReadString()
+        virtual Result ReadString(std::string& out) override;
+        /// Skips the block first, then the rest of `len` through the underlying stream.
+        virtual Result Skip(size_t len) override;
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
+
+        /// Number of bytes which were read from the underlying stream but not from this one.
+        size_t GetBuffered() const { return m_End - m_Cursor; }
+
+    protected:
+        // Reads at least one byte into the empty block, unless the underlying stream ended
+        Result Fill();
+
+        IStream& m_Stream;
+        size_t m_BlockSize;
+        std::vector<uint8_t> m_Block;
+        size_t m_Cursor = 0;
+        size_t m_End = 0;
+    };
+
+    /**
+     * Writes to another stream in blocks, so that small writes don't each go through it.
+     * `PNG::BufferedOStream::Flush()` writes the block and flushes the underlying stream, data which was not flushed is dropped on destruction.
+     */
+    class BufferedOStream : public OStream
+    {
+    public:
+        /// The block is allocated on the first write. Writes of at least `blockSize` bytes skip it.
+        BufferedOStream(OStream& out, size_t blockSize = 65536)
+            : m_Stream(out), m_BlockSize(std::max<size_t>(blockSize, 1)) { }
+
+        /// @see PNG::OStream::WriteBuffer()
+        virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
+        /// @see PNG::OStream::Flush()
+        virtual Result Flush() override;
+        /// @see PNG::OStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
+
+    protected:
+        // Writes the block to the underlying stream without flushing it
+        Result Drain();
+
+        OStream& m_Stream;
+        size_t m_BlockSize;
+        std::vector<uint8_t> m_Block;
+    };
+
     class ByteStream : public IStream
     {
     public:
@@ -160,6 +303,16 @@ namespace PNG
         /// @see PNG::IStream::ReadString()
         virtual Result ReadString(std::string& out) override;
         // Since ByteStream does not get filled with new data, this method can implemented in a more optimized way.
+        /// @see PNG::IStream::ReadView()
+        virtual Result ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed = nullptr) override;
+        /// @see PNG::IStream::Skip()
+        virtual Result Skip(size_t len) override;
+        /// @see PNG::IStream::Unread()
+        virtual Result Unread(size_t len) override;
+        /// Views of a ByteStream are valid for as long as the underlying buffer is.
+        virtual bool HasStableViews() const override { return true; }
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
 
         size_t GetAvailable()
         {
@@ -174,14 +327,119 @@ namespace PNG
         std::mutex m_Mutex;
     };
 
+    class MappedFileStream : public ByteStream
+    {
+    public:
+        MappedFileStream()
+            : ByteStream(nullptr, 0) { }
+
+        ~MappedFileStream() { Close(); }
+
+        /// Maps the whole file at `filePath` into memory, closing the previously mapped one.
+        Result Open(const std::string& filePath);
+        void Close();
+
+        bool IsOpen() const { return m_IsOpen; }
+
+    private:
+        bool m_IsOpen = false;
+    };
+
+    /**
+     * A thread-safe queue of buffers which are read in order.
+     * Buffers can either be views (which must outlive the stream) or vectors moved into it.
+     * Reading views from this stream does not copy any data.
+     */
+    class BufferQueueStream : public IStream
+    {
+    public:
+        /// Checks the data of a buffer, e.g. its CRC, see `PNG::BufferQueueStream::PushBuffer()`.
+        using BufferCheck = std::function<Result(const uint8_t* data, size_t len)>;
+
+        /**
+         * @param capacity
+         * The max number of unread bytes in the queue, pushing more blocks until they are read. 0 means no limit.
+         * A buffer bigger than the capacity is pushed once the queue is empty.
+         */
+        BufferQueueStream(size_t capacity = 0)
+            : m_Capacity(capacity) { }
+
+        Result PushView(const void* view, size_t viewLen);
+        /**
+         * @brief Moves `buf` into the queue.
+         * @param check
+         * If set, it's run by the reader before the first byte of the buffer is read, so that the writer doesn't have to wait for it.
+         * Once a check fails, reads fail with its result (see `PNG::BufferQueueStream::GetCheckResult()`).
+         */
+        Result PushBuffer(std::vector<uint8_t>&& buf, BufferCheck check = nullptr);
+
+        /// @see PNG::IStream::ReadBuffer()
+        virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+        /// @see PNG::IStream::ReadView()
+        virtual Result ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed = nullptr) override;
+        // Views can't span multiple buffers, if `bytesViewed` is nullptr `viewLen` must fit into the current one.
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
+
+        bool IsClosed() const { return m_Closed.load(std::memory_order_acquire); }
+        Result Close();
+        /// Tells writers that no more data will be read, further pushes are discarded so that they never block.
+        void StopReading();
+        bool IsReadingStopped()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Discarding;
+        }
+        /// The result of the first check which failed, buffers which were never read are not checked.
+        Result GetCheckResult()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_CheckResult;
+        }
+
+    protected:
+        struct Entry
+        {
+            const uint8_t* Data;
+            size_t Length;
+            std::vector<uint8_t> Buffer;
+            BufferCheck Check;
+        };
+
+        // Removes fully read entries, must be called with m_Mutex held
+        void PopConsumed();
+        // Waits until data is available or the stream is closed, returns whether data is available
+        bool WaitAvailable(std::unique_lock<std::mutex>& lock);
+        // Waits until `len` bytes can be pushed, returns false if they should be discarded
+        bool WaitPushable(std::unique_lock<std::mutex>& lock, size_t len);
+        // Marks `len` bytes as read, must be called with m_Mutex held
+        void Consumed(size_t len);
+        // Runs the check of the front entry if it wasn't yet, must be called with m_Mutex held
+        Result CheckFront();
+
+        std::deque<Entry> m_Queue;
+        size_t m_FrontCursor = 0;
+        size_t m_Capacity;
+        size_t m_QueuedBytes = 0;
+        std::mutex m_Mutex;
+        std::condition_variable m_Available;
+        std::condition_variable m_Pushable;
+        // Written under m_Mutex so that waiting readers can't miss it, but also read without it by IsClosed
+        std::atomic<bool> m_Closed = false;
+        bool m_Discarding = false;
+        Result m_CheckResult = Result::OK;
+    };
+
     class DynamicByteStream : public IOStream
     {
     public:
-        DynamicByteStream(std::chrono::milliseconds pollInterval, size_t trimSize = 4194304 /* 4MB */)
-            : m_IPollInterval(pollInterval), m_TrimSize(trimSize) { }
+        explicit DynamicByteStream(size_t trimSize = 4194304 /* 4MB */)
+            : m_TrimSize(trimSize) { }
 
-        DynamicByteStream()
-            : DynamicByteStream(std::chrono::milliseconds(1)) { }
+        /// Readers are woken up by Flush and Close instead of polling, so `pollInterval` is ignored.
+        [[deprecated("DynamicByteStream no longer polls, use DynamicByteStream(size_t trimSize) instead.")]]
+        DynamicByteStream(std::chrono::milliseconds /* pollInterval */, size_t trimSize = 4194304 /* 4MB */)
+            : DynamicByteStream(trimSize) { }
 
         std::vector<uint8_t>& GetBuffer() { return m_IBuffer; }
         const std::vector<uint8_t>& GetBuffer() const { return m_IBuffer; }
@@ -192,6 +450,8 @@ namespace PNG
         virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
         /// @see PNG::OStream::Flush()
         virtual Result Flush() override;
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
 
         size_t GetAvailable()
         {
@@ -199,7 +459,7 @@ namespace PNG
             return m_IBuffer.size() - m_ICursor;
         }
 
-        bool IsClosed() const { return m_Closed; }
+        bool IsClosed() const { return m_Closed.load(std::memory_order_acquire); }
         Result Close();
 
     protected:
@@ -208,14 +468,149 @@ namespace PNG
         std::vector<uint8_t> m_OBuffer;
         std::mutex m_OMutex;
 
-        std::chrono::milliseconds m_IPollInterval;
         size_t m_ICursor = 0;
 
         std::vector<uint8_t> m_IBuffer;
         std::mutex m_IMutex;
+        // Notified on Flush and Close
+        std::condition_variable m_IAvailable;
 
         size_t m_TrimSize;
-        bool m_Closed = false;
+        // Written under m_IMutex so that waiting readers can't miss it, but read without it by writers
+        std::atomic<bool> m_Closed = false;
+    };
+
+    /**
+     * A stream which connects two stages of a pipeline, one of them writes to it and the other reads from it.
+     * The writer closes the stream when it's done, while the reader stops reading from it when it doesn't need more data.
+     */
+    class PipelineStream : public IOStream
+    {
+    public:
+        virtual ~PipelineStream() = default;
+
+        /// @see PNG::IStream::IsBuffered()
+        virtual bool IsBuffered() const override { return true; }
+
+        virtual bool IsClosed() const = 0;
+        /// Tells readers that no more data will be written.
+        virtual Result Close() = 0;
+        /// Tells writers that no more data will be read, further writes are discarded so that they never block.
+        virtual void StopReading() = 0;
+    };
+
+    /**
+     * A thread-safe pipe which blocks readers until data is written and, if bounded, writers until there is free space.
+     * Written data is visible to readers right away, `PNG::PipeStream::Flush()` wakes them up.
+     * Reads which require more bytes than the capacity consume data as it arrives, so they never deadlock.
+     */
+    class PipeStream : public PipelineStream
+    {
+    public:
+        /// A capacity of 0 makes the pipe unbounded, which is required if the writer runs before the reader.
+        PipeStream(size_t capacity = 0)
+            : m_Capacity(capacity) { }
+
+        /// @see PNG::IStream::ReadBuffer()
+        virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+        /// @see PNG::OStream::WriteBuffer()
+        virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
+        /// @see PNG::OStream::Flush()
+        virtual Result Flush() override;
+
+        size_t GetAvailable()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Size;
+        }
+
+        size_t GetCapacity() const { return m_Capacity; }
+
+        /// @see PNG::PipelineStream::IsClosed()
+        virtual bool IsClosed() const override { return m_Closed.load(std::memory_order_acquire); }
+        /// @see PNG::PipelineStream::Close()
+        virtual Result Close() override;
+        /// @see PNG::PipelineStream::StopReading()
+        virtual void StopReading() override;
+
+    protected:
+        // Grows the buffer so that it can hold at least `size` bytes, must be called with m_Mutex held
+        void Grow(size_t size);
+        // Copies up to `bufLen` bytes into `buf`, must be called with m_Mutex held
+        size_t Consume(uint8_t* buf, size_t bufLen);
+
+        size_t m_Capacity;
+        // Ring buffer of m_Buffer.size() bytes, which starts at m_ReadCursor and holds m_Size bytes
+        std::vector<uint8_t> m_Buffer;
+        size_t m_ReadCursor = 0;
+        size_t m_Size = 0;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_CanRead;
+        std::condition_variable m_CanWrite;
+
+        // Written under m_Mutex so that waiting readers can't miss it, but also read without it by Flush and IsClosed
+        std::atomic<bool> m_Closed = false;
+        bool m_Discarding = false;
+    };
+
+    /**
+     * A lock-free fixed-capacity ring buffer, which must have at most one reader and one writer thread at a time.
+     * Data is copied only once from the writer into the ring and once from the ring into the reader.
+     * Written data is published right away, `PNG::RingBufferStream::Flush()` wakes up the reader.
+     */
+    class RingBufferStream : public PipelineStream
+    {
+    public:
+        /// `capacity` is rounded up to the next power of 2.
+        RingBufferStream(size_t capacity);
+
+        /// @see PNG::IStream::ReadBuffer()
+        virtual Result ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead = nullptr) override;
+        /// @see PNG::OStream::WriteBuffer()
+        virtual Result WriteBuffer(const void* buf, size_t bufLen) override;
+        /// @see PNG::OStream::Flush()
+        virtual Result Flush() override;
+
+        size_t GetCapacity() const { return m_Buffer.size(); }
+
+        /// @see PNG::PipelineStream::IsClosed()
+        virtual bool IsClosed() const override { return m_Closed.load(std::memory_order_acquire); }
+        /// @see PNG::PipelineStream::Close()
+        virtual Result Close() override;
+        /// @see PNG::PipelineStream::StopReading()
+        virtual void StopReading() override;
+
+    protected:
+        static constexpr size_t CACHE_LINE_SIZE = 64;
+
+        // Waits for the reader to free some space, returns false if the writes should be discarded
+        bool WaitWritable();
+        // Waits for the writer to publish some data, returns false if the stream is closed and empty
+        bool WaitReadable();
+        // Copies up to `bufLen` bytes into `buf` and publishes the new tail
+        size_t Consume(uint8_t* buf, size_t bufLen);
+
+        void SignalReader();
+        void SignalWriter();
+
+        std::vector<uint8_t> m_Buffer;
+        size_t m_Mask;
+
+        // Writer side, m_Head is the total number of bytes written
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_Head = 0;
+        size_t m_CachedTail = 0;
+
+        // Reader side, m_Tail is the total number of bytes read
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_Tail = 0;
+        size_t m_CachedHead = 0;
+
+        // Bumped to wake up a thread which is waiting on it
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_ReaderSignal = 0;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_WriterSignal = 0;
+
+        std::atomic<bool> m_Closed = false;
+        std::atomic<bool> m_Discarding = false;
     };
 }
 
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef _PNG_THUMBNAIL_H
+#define _PNG_THUMBNAIL_H
+
+#include "png/base.h"
+#include "png/image.h"
+#include "png/stream.h"
+
+namespace PNG
+{
+    enum class ThumbnailMethod
+    {
+        // Each pixel is the average of the area of the image it covers
+        Box,
+        // Samples pixels like `PNG::Image::Resize()` with `PNG::ScalingMethod::Bilinear`
+        Bilinear,
+    };
+
+    /// Returns the size of the thumbnail of a `width`x`height` image which fits into `maxWidth`x`maxHeight`, images are never scaled up.
+    void GetThumbnailSize(size_t width, size_t height, size_t maxWidth, size_t maxHeight, size_t& thumbWidth, size_t& thumbHeight);
+
+    /**
+     * @brief Decodes a thumbnail of the image which fits into `maxWidth`x`maxHeight` and keeps its aspect ratio, see PNG::GetThumbnailSize().
+     * Rows are scaled down as they are unfiltered, so only a few rows of the whole image are held at once.
+     * Interlaced images are decoded up to the first Adam7 pass whose grid is at least as big as the thumbnail,
+     * which is held whole while it is deinterlaced (see `PNG::ImportSettings::Adam7Passes`).
+     * `cfg` is used like `PNG::Image::Read()` does, but the image is always decoded by a single thread and
+     * `PNG::ImportSettings::Adam7PassCallback` is not called. If `PNG::ImportSettings::Region` is set, its thumbnail is decoded.
+     */
+    Result DecodeThumbnail(IStream& in, Image& out, size_t maxWidth, size_t maxHeight,
+        ThumbnailMethod method = ThumbnailMethod::Box, const ImportSettings& cfg = ImportSettings{});
+}
+
+#endif // _PNG_THUMBNAIL_H
@@ -11,6 +11,23 @@ namespace PNG
 {
     namespace Utils
     {
+        /// Decodes a big-endian number, which is how PNG stores them. Compilers turn the loop into a single load and byte swap.
+        template<typename T>
+        inline T LoadBigEndian(const uint8_t* in)
+        {
+            T out = 0;
+            for (size_t i = 0; i < sizeof(T); i++)
+                out = (T)((out << 8) | in[i]);
+            return out;
+        }
+
+        template<typename T>
+        inline void StoreBigEndian(T in, uint8_t* out)
+        {
+            for (size_t i = 0; i < sizeof(T); i++)
+                out[i] = (uint8_t)(in >> (8 * (sizeof(T) - i - 1)));
+        }
+
         template<typename IotaT>
         class Iota
         {
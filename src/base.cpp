@@ -73,6 +73,16 @@ const char* PNG::ResultToString(Result res)
         return "InvalidLMTSecond";
     case Result::UpdatingClosedStreamError:
         return "UpdatingClosedStreamError";
+    case Result::UnsupportedStreamOperation:
+        return "UnsupportedStreamOperation";
+    case Result::FileMappingError:
+        return "FileMappingError";
+    case Result::UnsupportedInterlaceMethod:
+        return "UnsupportedInterlaceMethod";
+    case Result::InvalidRestartIndex:
+        return "InvalidRestartIndex";
+    case Result::InvalidImageRegion:
+        return "InvalidImageRegion";
     case Result::ZLib_NotAvailable:
         return "ZLib_NotAvailable";
     case Result::ZLib_DataError:
@@ -13,15 +13,18 @@
 
 uint32_t PNG::Chunk::CalculateCRC() const
 {
-    uint32_t c = CRC::Update(~0, Type);
-    return ~CRC::Update(c, Data.data(), Length());
+    return ChunkView(*this).CalculateCRC();
 }
 
+// Length and type are read and written together, which takes one stream call instead of two
+static constexpr size_t CHUNK_HEADER_SIZE = 8;
+
 PNG::Result PNG::Chunk::Read(IStream& in, Chunk& chunk)
 {
-    uint32_t len;
-    PNG_RETURN_IF_NOT_OK(in.ReadU32, len);
-    PNG_RETURN_IF_NOT_OK(in.ReadU32, chunk.Type);
+    uint8_t header[CHUNK_HEADER_SIZE];
+    PNG_RETURN_IF_NOT_OK(in.ReadBuffer, header, sizeof(header));
+    uint32_t len = Utils::LoadBigEndian<uint32_t>(header);
+    chunk.Type = Utils::LoadBigEndian<uint32_t>(header + 4);
     chunk.Data.resize(len);
     PNG_RETURN_IF_NOT_OK(in.ReadBuffer, chunk.Data.data(), len);
     PNG_RETURN_IF_NOT_OK(in.ReadU32, chunk.CRC);
@@ -31,13 +34,97 @@ PNG::Result PNG::Chunk::Read(IStream& in, Chunk& chunk)
 
 PNG::Result PNG::Chunk::Write(OStream& out) const
 {
-    PNG_RETURN_IF_NOT_OK(out.WriteU32, Length());
-    PNG_RETURN_IF_NOT_OK(out.WriteU32, Type);
+    uint8_t header[CHUNK_HEADER_SIZE];
+    Utils::StoreBigEndian<uint32_t>(Length(), header);
+    Utils::StoreBigEndian<uint32_t>(Type, header + 4);
+    PNG_RETURN_IF_NOT_OK(out.WriteBuffer, header, sizeof(header));
     PNG_RETURN_IF_NOT_OK(out.WriteVector, Data);
     PNG_RETURN_IF_NOT_OK(out.WriteU32, CRC);
     return Result::OK;
 }
 
+uint32_t PNG::ChunkView::CalculateCRC() const
+{
+    uint32_t c = CRC::Update(~0, Type);
+    return ~CRC::Update(c, Data, Length());
+}
+
+void PNG::ChunkView::Reset()
+{
+    Data = nullptr;
+    m_Length = 0;
+    m_Borrowed = false;
+}
+
+std::vector<uint8_t> PNG::ChunkView::ReleaseBuffer()
+{
+    std::vector<uint8_t> buf;
+    if (!m_Borrowed)
+        buf = std::move(m_Buffer);
+    m_Buffer.clear();
+    Reset();
+    return buf;
+}
+
+PNG::Result PNG::ChunkView::Read(IStream& in, ChunkView& chunk)
+{
+    PNG_RETURN_IF_NOT_OK(ReadHeader, in, chunk);
+    return chunk.ReadData(in);
+}
+
+PNG::Result PNG::ChunkView::ReadHeader(IStream& in, ChunkView& chunk)
+{
+    uint8_t header[CHUNK_HEADER_SIZE];
+    auto res = in.ReadBuffer(header, sizeof(header));
+    if (res != Result::OK) {
+        chunk.Reset();
+        return res;
+    }
+    chunk.m_Length = Utils::LoadBigEndian<uint32_t>(header);
+    chunk.Type = Utils::LoadBigEndian<uint32_t>(header + 4);
+    chunk.Data = nullptr;
+    chunk.CRC = 0;
+    return Result::OK;
+}
+
+PNG::Result PNG::ChunkView::ReadData(IStream& in)
+{
+    // A chunk which failed to be read is left empty, so that its length never disagrees with its data
+    auto res = ReadDataAndCRC(in);
+    if (res != Result::OK)
+        Reset();
+    return res;
+}
+
+PNG::Result PNG::ChunkView::ReadDataAndCRC(IStream& in)
+{
+    // Views which are only valid until the next read would be overwritten while the chunk is still in use
+    auto vres = in.HasStableViews() ? in.ReadView(Data, m_Length) : Result::UnsupportedStreamOperation;
+    if (vres == Result::UnsupportedStreamOperation) {
+        m_Borrowed = false;
+        m_Buffer.resize(m_Length);
+        Data = m_Buffer.data();
+        // Empty chunks, e.g. IEND, have no buffer to read into
+        if (m_Length > 0)
+            PNG_RETURN_IF_NOT_OK(in.ReadBuffer, m_Buffer.data(), m_Length);
+    } else if (vres != Result::OK)
+        return vres;
+    else
+        m_Borrowed = true;
+
+    PNG_RETURN_IF_NOT_OK(in.ReadU32, CRC);
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ChunkView::SkipData(IStream& in)
+{
+    // Data and CRC
+    auto res = in.Skip((size_t)m_Length + 4);
+    Reset();
+    return res;
+}
+
 PNG::Result PNG::ImageHeader::Validate() const
 {
     if (Width == 0 || Height == 0)
@@ -72,12 +159,12 @@ PNG::Result PNG::ImageHeader::Validate() const
     return Result::OK;
 }
 
-PNG::Result PNG::ImageHeader::Parse(const Chunk& chunk, ImageHeader& ihdr)
+PNG::Result PNG::ImageHeader::Parse(const ChunkView& chunk, ImageHeader& ihdr)
 {
     if (chunk.Type != ChunkType::IHDR)
         return Result::UnexpectedChunkType;
     
-    ByteStream inIHDR(chunk.Data);
+    ByteStream inIHDR(chunk.Data, chunk.Length());
 
     PNG_RETURN_IF_NOT_OK(inIHDR.ReadU32, ihdr.Width);
     PNG_RETURN_IF_NOT_OK(inIHDR.ReadU32, ihdr.Height);
@@ -116,7 +203,38 @@ PNG::Result PNG::TextualData::Validate() const
     return Result::OK;
 }
 
-PNG::Result PNG::TextualData::Parse(const Chunk& chunk, TextualData& data)
+// Reads the rest of `in` as the compressed text of `data`, which is only inflated if `inflate` is true
+static PNG::Result ReadCompressedText(PNG::ByteStream& in, uint8_t compressionMethod, PNG::TextualData& data, bool inflate)
+{
+    using namespace PNG;
+
+    // Data which can't be inflated later is inflated right away to report the error
+    if (inflate || in.GetAvailable() == 0 || compressionMethod != CompressionMethod::ZLIB) {
+        DynamicByteStream out;
+        PNG_RETURN_IF_NOT_OK(DecompressData, compressionMethod, in, out);
+        data.Text.append(out.GetBuffer().begin(), out.GetBuffer().end());
+        return Result::OK;
+    }
+
+    data.TextCompressionMethod = compressionMethod;
+    data.CompressedText.resize(in.GetAvailable());
+    return in.ReadBuffer(data.CompressedText.data(), data.CompressedText.size());
+}
+
+PNG::Result PNG::TextualData::InflateText()
+{
+    if (IsTextInflated())
+        return Result::OK;
+
+    ByteStream in(CompressedText);
+    DynamicByteStream out;
+    PNG_RETURN_IF_NOT_OK(DecompressData, TextCompressionMethod, in, out);
+    Text.assign(out.GetBuffer().begin(), out.GetBuffer().end());
+    CompressedText = std::vector<uint8_t>();
+    return Result::OK;
+}
+
+PNG::Result PNG::TextualData::Parse(const ChunkView& chunk, TextualData& data, bool inflate)
 {
     switch (chunk.Type) {
     case ChunkType::tEXt:
@@ -127,7 +245,7 @@ PNG::Result PNG::TextualData::Parse(const Chunk& chunk, TextualData& data)
         return Result::UnexpectedChunkType;
     }
     
-    ByteStream in(chunk.Data);
+    ByteStream in(chunk.Data, chunk.Length());
     
     // Keyword:        1-79 bytes (character string)
     // Null separator: 1 byte
@@ -145,9 +263,7 @@ PNG::Result PNG::TextualData::Parse(const Chunk& chunk, TextualData& data)
         uint8_t compressionMethod;
         PNG_RETURN_IF_NOT_OK(in.ReadU8, compressionMethod);
         // Compressed text:    n bytes
-        DynamicByteStream out;
-        PNG_RETURN_IF_NOT_OK(DecompressData, compressionMethod, in, out);
-        data.Text.append(out.GetBuffer().begin(), out.GetBuffer().end());
+        PNG_RETURN_IF_NOT_OK(ReadCompressedText, in, compressionMethod, data, inflate);
     } else {
         data.IsUTF8 = true;
         // Compression flag:   1 byte
@@ -164,9 +280,7 @@ PNG::Result PNG::TextualData::Parse(const Chunk& chunk, TextualData& data)
         PNG_RETURN_IF_NOT_OK(in.ReadString, data.TranslatedKeyword);
         // Text:               0 or more bytes
         if (compressionFlag) {
-            DynamicByteStream out;
-            PNG_RETURN_IF_NOT_OK(DecompressData, compressionMethod, in, out);
-            data.Text.append(out.GetBuffer().begin(), out.GetBuffer().end());
+            PNG_RETURN_IF_NOT_OK(ReadCompressedText, in, compressionMethod, data, inflate);
         } else {
             data.Text.resize(in.GetAvailable());
             PNG_RETURN_IF_NOT_OK(in.ReadBuffer, data.Text.data(), data.Text.size());
@@ -177,22 +291,45 @@ PNG::Result PNG::TextualData::Parse(const Chunk& chunk, TextualData& data)
     return Result::OK;
 }
 
+PNG::Result PNG::TextualData::ParseKeyword(const ChunkView& chunk, std::string_view& keyword)
+{
+    switch (chunk.Type) {
+    case ChunkType::tEXt:
+    case ChunkType::zTXt:
+    case ChunkType::iTXt:
+        break;
+    default:
+        return Result::UnexpectedChunkType;
+    }
+
+    // Keyword:        1-79 bytes (character string)
+    // Null separator: 1 byte
+    const uint8_t* null = chunk.Length() > 0 ? (const uint8_t*)memchr(chunk.Data, '\0', chunk.Length()) : nullptr;
+    if (!null)
+        return Result::UnexpectedEOF;
+    keyword = std::string_view((const char*)chunk.Data, null - chunk.Data);
+    if (keyword.empty() || keyword.length() >= 80)
+        return Result::InvalidTextualDataKeywordSize;
+    return Result::OK;
+}
+
 PNG::Result PNG::TextualData::Write(Chunk& chunk, CompressionLevel compressionLevel) const
 {
     constexpr size_t DEFLATE_THRESHOLD = 1024;
 
     PNG_RETURN_IF_NOT_OK(Validate);
     
-    bool deflate = false;
+    // Text which was never inflated is written back without being compressed again
+    bool inflated = IsTextInflated();
+    bool deflate = !inflated;
     chunk.Type = ChunkType::tEXt;
     if (IsUTF8 || !LanguageTag.empty() || !TranslatedKeyword.empty())
         chunk.Type = ChunkType::iTXt;
 
-    if (Text.length() >= DEFLATE_THRESHOLD) {
+    if (Text.length() >= DEFLATE_THRESHOLD)
         deflate = true;
-        if (chunk.Type == ChunkType::tEXt)
-            chunk.Type = ChunkType::zTXt;
-    }
+    if (deflate && chunk.Type == ChunkType::tEXt)
+        chunk.Type = ChunkType::zTXt;
 
     // Keyword:        1-79 bytes (character string)
     // Null separator: 1 byte
@@ -206,8 +343,12 @@ PNG::Result PNG::TextualData::Write(Chunk& chunk, CompressionLevel compressionLe
         break;
     case ChunkType::zTXt: {
         // Compression method: 1 byte
-        PNG_RETURN_IF_NOT_OK(out.WriteU8, CompressionMethod::ZLIB);
+        PNG_RETURN_IF_NOT_OK(out.WriteU8, inflated ? CompressionMethod::ZLIB : TextCompressionMethod);
         // Compressed text:    n bytes
+        if (!inflated) {
+            PNG_RETURN_IF_NOT_OK(out.WriteVector, CompressedText);
+            break;
+        }
         ByteStream textStream(Text.data(), Text.length());
         PNG_RETURN_IF_NOT_OK(CompressData, CompressionMethod::ZLIB, textStream, out, compressionLevel);
         break;
@@ -216,7 +357,7 @@ PNG::Result PNG::TextualData::Write(Chunk& chunk, CompressionLevel compressionLe
         // Compression flag:   1 byte
         PNG_RETURN_IF_NOT_OK(out.WriteU8, deflate ? 1 : 0);
         // Compression method: 1 byte
-        PNG_RETURN_IF_NOT_OK(out.WriteU8, CompressionMethod::ZLIB);
+        PNG_RETURN_IF_NOT_OK(out.WriteU8, inflated ? CompressionMethod::ZLIB : TextCompressionMethod);
         // Language tag:       0 or more bytes (character string)
         // Null separator:     1 byte
         PNG_RETURN_IF_NOT_OK(out.WriteString, LanguageTag);
@@ -224,7 +365,9 @@ PNG::Result PNG::TextualData::Write(Chunk& chunk, CompressionLevel compressionLe
         // Null separator:     1 byte
         PNG_RETURN_IF_NOT_OK(out.WriteString, TranslatedKeyword);
         // Text:               0 or more bytes
-        if (deflate) {
+        if (!inflated) {
+            PNG_RETURN_IF_NOT_OK(out.WriteVector, CompressedText);
+        } else if (deflate) {
             ByteStream textStream(Text.data(), Text.length());
             PNG_RETURN_IF_NOT_OK(CompressData, CompressionMethod::ZLIB, textStream, out, compressionLevel);
         } else
@@ -291,12 +434,12 @@ PNG::Result PNG::LastModificationTime::Validate() const
     return Result::OK;
 }
 
-PNG::Result PNG::LastModificationTime::Parse(const Chunk& chunk, LastModificationTime& time)
+PNG::Result PNG::LastModificationTime::Parse(const ChunkView& chunk, LastModificationTime& time)
 {
     if (chunk.Type != ChunkType::tIME)
         return Result::UnexpectedChunkType;
     
-    ByteStream in(chunk.Data);
+    ByteStream in(chunk.Data, chunk.Length());
     PNG_RETURN_IF_NOT_OK(in.ReadU16, time.Year);
     PNG_RETURN_IF_NOT_OK(in.ReadU8, time.Month);
     PNG_RETURN_IF_NOT_OK(in.ReadU8, time.Day);
@@ -323,3 +466,58 @@ PNG::Result PNG::LastModificationTime::Write(Chunk& chunk) const
     chunk.CRC = chunk.CalculateCRC();
     return Result::OK;
 }
+
+PNG::Result PNG::RestartIndex::Validate(const ImageHeader& ihdr) const
+{
+    if (ihdr.InterlaceMethod != InterlaceMethod::NONE)
+        return Result::UnsupportedInterlaceMethod;
+
+    // Segments start after the 2 bytes of zlib header
+    if (Segments.empty() || Segments[0].Row != 0 || Segments[0].Offset != 2)
+        return Result::InvalidRestartIndex;
+
+    for (size_t i = 1; i < Segments.size(); i++) {
+        if (Segments[i].Row <= Segments[i-1].Row ||
+            Segments[i].Row >= ihdr.Height ||
+            Segments[i].Offset <= Segments[i-1].Offset
+        ) {
+            return Result::InvalidRestartIndex;
+        }
+    }
+    return Result::OK;
+}
+
+PNG::Result PNG::RestartIndex::Parse(const ChunkView& chunk, RestartIndex& index)
+{
+    if (chunk.Type != ChunkType::riDX)
+        return Result::UnexpectedChunkType;
+
+    // Each segment is its row (4 bytes) followed by its offset (8 bytes)
+    const size_t SEGMENT_SIZE = 12;
+    if (chunk.Length() % SEGMENT_SIZE != 0)
+        return Result::InvalidRestartIndex;
+
+    ByteStream in(chunk.Data, chunk.Length());
+    index.Segments.resize(chunk.Length() / SEGMENT_SIZE);
+    for (auto& segment : index.Segments) {
+        PNG_RETURN_IF_NOT_OK(in.ReadU32, segment.Row);
+        PNG_RETURN_IF_NOT_OK(in.ReadU64, segment.Offset);
+    }
+    return Result::OK;
+}
+
+PNG::Result PNG::RestartIndex::Write(Chunk& chunk) const
+{
+    DynamicByteStream out;
+    for (const auto& segment : Segments) {
+        PNG_RETURN_IF_NOT_OK(out.WriteU32, segment.Row);
+        PNG_RETURN_IF_NOT_OK(out.WriteU64, segment.Offset);
+    }
+    PNG_RETURN_IF_NOT_OK(out.Flush);
+    PNG_RETURN_IF_NOT_OK(out.Close);
+
+    chunk.Type = ChunkType::riDX;
+    chunk.Data = std::move(out.GetBuffer());
+    chunk.CRC = chunk.CalculateCRC();
+    return Result::OK;
+}
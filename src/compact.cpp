@@ -0,0 +1,1043 @@
+#include "png/compact.h"
+
+#include "png/cpu.h"
+#include "png/utils.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <execution>
+#include <type_traits>
+
+#ifdef PNG_X86_SIMD
+#include <immintrin.h>
+#endif // PNG_X86_SIMD
+
+// https://fgiesen.wordpress.com/2012/03/28/half-to-float-done-quic/
+uint16_t PNG::Half::FromFloat(float value)
+{
+    const uint32_t F32_INFINITY = 255 << 23;
+    // The smallest float which is too big for a half
+    const uint32_t F16_OVERFLOW = (127 + 16) << 23;
+    // Adding it to a float moves the bits of a subnormal half to the bottom of the mantissa, rounding them
+    const uint32_t DENORM_MAGIC = ((127 - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    const uint32_t sign = bits & 0x80000000;
+    bits ^= sign;
+
+    uint16_t half;
+    if (bits >= F16_OVERFLOW) {
+        // NaN stays NaN, everything else becomes infinity
+        half = bits > F32_INFINITY ? 0x7e00 : 0x7c00;
+    } else if (bits < (113 << 23)) {
+        // Subnormal or zero
+        float rounded = std::bit_cast<float>(bits) + std::bit_cast<float>(DENORM_MAGIC);
+        half = (uint16_t)(std::bit_cast<uint32_t>(rounded) - DENORM_MAGIC);
+    } else {
+        // The exponent is rebiased and the mantissa is rounded to nearest even
+        const uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        bits += mantissaOdd;
+        half = (uint16_t)(bits >> 13);
+    }
+    return half | (uint16_t)(sign >> 16);
+}
+
+float PNG::Half::ToFloat(uint16_t half)
+{
+    const uint32_t SHIFTED_EXPONENT = 0x7c00 << 13;
+
+    uint32_t bits = (uint32_t)(half & 0x7fff) << 13;
+    const uint32_t exponent = bits & SHIFTED_EXPONENT;
+    bits += (127 - 15) << 23;
+    if (exponent == SHIFTED_EXPONENT) {
+        // Infinity or NaN
+        bits += (128 - 16) << 23;
+    } else if (exponent == 0) {
+        // Subnormals are normalized by the FPU
+        bits += 1 << 23;
+        bits = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) - std::bit_cast<float>(113 << 23));
+    }
+    bits |= (uint32_t)(half & 0x8000) << 16;
+    return std::bit_cast<float>(bits);
+}
+
+static void FromFloatsScalar(const float* in, uint16_t* out, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = PNG::Half::FromFloat(in[i]);
+}
+
+static void ToFloatsScalar(const uint16_t* in, float* out, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = PNG::Half::ToFloat(in[i]);
+}
+
+#ifdef PNG_X86_SIMD
+PNG_TARGET("avx,f16c") static void FromFloatsF16C(const float* in, uint16_t* out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(out + i), half);
+    }
+    FromFloatsScalar(in + i, out + i, count - i);
+}
+
+PNG_TARGET("avx,f16c") static void ToFloatsF16C(const uint16_t* in, float* out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+    ToFloatsScalar(in + i, out + i, count - i);
+}
+#endif // PNG_X86_SIMD
+
+void PNG::Half::FromFloats(const float* in, uint16_t* out, size_t count)
+{
+#ifdef PNG_X86_SIMD
+    static const auto fromFloats = CPU::GetFeatures().F16C ? FromFloatsF16C : FromFloatsScalar;
+    fromFloats(in, out, count);
+#else // PNG_X86_SIMD
+    FromFloatsScalar(in, out, count);
+#endif // PNG_X86_SIMD
+}
+
+void PNG::Half::ToFloats(const uint16_t* in, float* out, size_t count)
+{
+#ifdef PNG_X86_SIMD
+    static const auto toFloats = CPU::GetFeatures().F16C ? ToFloatsF16C : ToFloatsScalar;
+    toFloats(in, out, count);
+#else // PNG_X86_SIMD
+    ToFloatsScalar(in, out, count);
+#endif // PNG_X86_SIMD
+}
+
+// Samples are rounded like PNG::Image::WriteRawRow does
+template<uint32_t MAX_VALUE>
+static uint32_t QuantizeChannel(double value)
+{
+    return (uint32_t)(std::clamp(value, 0.0, 1.0) * MAX_VALUE + 0.5);
+}
+
+// Integer formats are converted into each other through RGBA16, which holds all of them without losing precision
+template<typename PixelT>
+struct PixelTraits;
+
+template<>
+struct PixelTraits<PNG::Pixel::RGBA8>
+{
+    using Channel = uint8_t;
+    static constexpr size_t CHANNELS = 4;
+    static constexpr uint32_t MAX_VALUE = 255;
+
+    static PNG::Color ToColor(const PNG::Pixel::RGBA8& px)
+    {
+        return PNG::Color(px.R / 255.0f, px.G / 255.0f, px.B / 255.0f, px.A / 255.0f);
+    }
+
+    static PNG::Pixel::RGBA8 FromColor(const PNG::Color& color)
+    {
+        return { (uint8_t)QuantizeChannel<255>(color.R), (uint8_t)QuantizeChannel<255>(color.G),
+            (uint8_t)QuantizeChannel<255>(color.B), (uint8_t)QuantizeChannel<255>(color.A) };
+    }
+
+    static PNG::Pixel::RGBA16 ToWide(const PNG::Pixel::RGBA8& px)
+    {
+        return { (uint16_t)(px.R * 257), (uint16_t)(px.G * 257), (uint16_t)(px.B * 257), (uint16_t)(px.A * 257) };
+    }
+
+    static PNG::Pixel::RGBA8 FromWide(const PNG::Pixel::RGBA16& px)
+    {
+        return { (uint8_t)((px.R + 128) / 257), (uint8_t)((px.G + 128) / 257), (uint8_t)((px.B + 128) / 257), (uint8_t)((px.A + 128) / 257) };
+    }
+};
+
+template<>
+struct PixelTraits<PNG::Pixel::RGBA16>
+{
+    using Channel = uint16_t;
+    static constexpr size_t CHANNELS = 4;
+    static constexpr uint32_t MAX_VALUE = 65535;
+
+    static PNG::Color ToColor(const PNG::Pixel::RGBA16& px)
+    {
+        return PNG::Color(px.R / 65535.0f, px.G / 65535.0f, px.B / 65535.0f, px.A / 65535.0f);
+    }
+
+    static PNG::Pixel::RGBA16 FromColor(const PNG::Color& color)
+    {
+        return { (uint16_t)QuantizeChannel<65535>(color.R), (uint16_t)QuantizeChannel<65535>(color.G),
+            (uint16_t)QuantizeChannel<65535>(color.B), (uint16_t)QuantizeChannel<65535>(color.A) };
+    }
+
+    static PNG::Pixel::RGBA16 ToWide(const PNG::Pixel::RGBA16& px) { return px; }
+    static PNG::Pixel::RGBA16 FromWide(const PNG::Pixel::RGBA16& px) { return px; }
+};
+
+template<>
+struct PixelTraits<PNG::Pixel::GA8>
+{
+    using Channel = uint8_t;
+    static constexpr size_t CHANNELS = 2;
+    static constexpr uint32_t MAX_VALUE = 255;
+
+    static PNG::Color ToColor(const PNG::Pixel::GA8& px)
+    {
+        return PNG::Color(px.Gray / 255.0f, px.A / 255.0f);
+    }
+
+    static PNG::Pixel::GA8 FromColor(const PNG::Color& color)
+    {
+        return { (uint8_t)QuantizeChannel<255>((color.R + color.G + color.B) / 3.0), (uint8_t)QuantizeChannel<255>(color.A) };
+    }
+
+    static PNG::Pixel::RGBA16 ToWide(const PNG::Pixel::GA8& px)
+    {
+        uint16_t gray = (uint16_t)(px.Gray * 257);
+        return { gray, gray, gray, (uint16_t)(px.A * 257) };
+    }
+
+    static PNG::Pixel::GA8 FromWide(const PNG::Pixel::RGBA16& px)
+    {
+        return { (uint8_t)(((uint32_t)px.R + px.G + px.B + 3 * 128) / (3 * 257)), (uint8_t)((px.A + 128) / 257) };
+    }
+};
+
+template<>
+struct PixelTraits<PNG::Color>
+{
+    using Channel = float;
+    static constexpr size_t CHANNELS = 4;
+
+    static PNG::Color ToColor(const PNG::Color& color) { return color; }
+    static PNG::Color FromColor(const PNG::Color& color) { return color; }
+};
+
+template<>
+struct PixelTraits<PNG::Pixel::RGBA16F>
+{
+    using Channel = uint16_t;
+    static constexpr size_t CHANNELS = 4;
+
+    static PNG::Color ToColor(const PNG::Pixel::RGBA16F& px)
+    {
+        return PNG::Color(PNG::Half::ToFloat(px.R), PNG::Half::ToFloat(px.G), PNG::Half::ToFloat(px.B), PNG::Half::ToFloat(px.A));
+    }
+
+    static PNG::Pixel::RGBA16F FromColor(const PNG::Color& color)
+    {
+        return { PNG::Half::FromFloat(color.R), PNG::Half::FromFloat(color.G), PNG::Half::FromFloat(color.B), PNG::Half::FromFloat(color.A) };
+    }
+};
+
+template<typename PixelT>
+constexpr bool IS_FLOAT_PIXEL = std::is_same_v<PixelT, PNG::Color>;
+
+template<typename PixelT>
+constexpr bool IS_HALF_PIXEL = std::is_same_v<PixelT, PNG::Pixel::RGBA16F>;
+
+// Float-like pixels are processed as colors
+template<typename PixelT>
+constexpr bool IS_FLOAT_LIKE_PIXEL = IS_FLOAT_PIXEL<PixelT> || IS_HALF_PIXEL<PixelT>;
+
+template<typename PixelT>
+static typename PixelTraits<PixelT>::Channel* GetChannels(PixelT& px) { return (typename PixelTraits<PixelT>::Channel*)&px; }
+
+template<typename PixelT>
+static const typename PixelTraits<PixelT>::Channel* GetChannels(const PixelT& px) { return (const typename PixelTraits<PixelT>::Channel*)&px; }
+
+template<typename SrcT, typename DstT>
+static DstT ConvertPixel(const SrcT& px)
+{
+    if constexpr (std::is_same_v<SrcT, DstT>)
+        return px;
+    else if constexpr (IS_FLOAT_LIKE_PIXEL<SrcT> || IS_FLOAT_LIKE_PIXEL<DstT>)
+        return PixelTraits<DstT>::FromColor(PixelTraits<SrcT>::ToColor(px));
+    else
+        return PixelTraits<DstT>::FromWide(PixelTraits<SrcT>::ToWide(px));
+}
+
+// Half floats are converted from and to colors a whole row at a time
+template<typename SrcT, typename DstT>
+static void ConvertRow(const SrcT* src, DstT* dst, size_t width)
+{
+    if constexpr (IS_HALF_PIXEL<SrcT> && IS_FLOAT_PIXEL<DstT>)
+        PNG::Half::ToFloats((const uint16_t*)src, (float*)dst, width * 4);
+    else if constexpr (IS_FLOAT_PIXEL<SrcT> && IS_HALF_PIXEL<DstT>)
+        PNG::Half::FromFloats((const float*)src, (uint16_t*)dst, width * 4);
+    else {
+        for (size_t x = 0; x < width; x++)
+            dst[x] = ConvertPixel<SrcT, DstT>(src[x]);
+    }
+}
+
+// Returns a row of float-like pixels as colors, half floats are converted into `buffer`
+template<typename PixelT>
+static const PNG::Color* LoadColors(const PixelT* row, size_t width, std::vector<PNG::Color>& buffer)
+{
+    if constexpr (IS_FLOAT_PIXEL<PixelT>) {
+        return row;
+    } else {
+        buffer.resize(width);
+        ConvertRow(row, buffer.data(), width);
+        return buffer.data();
+    }
+}
+
+// Like LoadColors, changes to the returned colors must be stored back with StoreColors
+template<typename PixelT>
+static PNG::Color* EditColors(PixelT* row, size_t width, std::vector<PNG::Color>& buffer)
+{
+    if constexpr (IS_FLOAT_PIXEL<PixelT>)
+        return row;
+    else
+        return const_cast<PNG::Color*>(LoadColors(row, width, buffer));
+}
+
+// Like EditColors for rows which are entirely overwritten, the returned colors are not initialized
+template<typename PixelT>
+static PNG::Color* OutputColors(PixelT* row, size_t width, std::vector<PNG::Color>& buffer)
+{
+    if constexpr (IS_FLOAT_PIXEL<PixelT>) {
+        return row;
+    } else {
+        buffer.resize(width);
+        return buffer.data();
+    }
+}
+
+template<typename PixelT>
+static void StoreColors(const PNG::Color* colors, PixelT* row, size_t width)
+{
+    if constexpr (!IS_FLOAT_PIXEL<PixelT>)
+        ConvertRow(colors, row, width);
+}
+
+// Calls `fn` with a default constructed pixel of the struct which stores `format`
+template<typename Fn>
+static void VisitPixelFormat(PNG::PixelFormat format, Fn&& fn)
+{
+    switch (format) {
+    case PNG::PixelFormat::RGBA8:
+        fn(PNG::Pixel::RGBA8{});
+        break;
+    case PNG::PixelFormat::RGBA16:
+        fn(PNG::Pixel::RGBA16{});
+        break;
+    case PNG::PixelFormat::GA8:
+        fn(PNG::Pixel::GA8{});
+        break;
+    case PNG::PixelFormat::Float:
+        fn(PNG::Color{});
+        break;
+    case PNG::PixelFormat::RGBA16F:
+        fn(PNG::Pixel::RGBA16F{});
+        break;
+    default:
+        PNG_UNREACHABLEF("VisitPixelFormat case missing ({}).", (int)format);
+    }
+}
+
+// Moves `pos` by `delta`, returns false if it ends up out of [0; size) and can't be wrapped back
+static bool WrapCoordinate(size_t pos, int64_t delta, size_t size, PNG::WrapMode wrapMode, size_t& out)
+{
+    int64_t moved = (int64_t)pos + delta;
+    if (moved >= 0 && (size_t)moved < size) {
+        out = (size_t)moved;
+        return true;
+    }
+
+    switch (wrapMode) {
+    case PNG::WrapMode::None:
+        return false;
+    case PNG::WrapMode::Clamp:
+        out = moved < 0 ? 0 : size - 1;
+        return true;
+    case PNG::WrapMode::Repeat:
+        out = (size_t)(((moved % (int64_t)size) + (int64_t)size) % (int64_t)size);
+        return true;
+    default:
+        PNG_UNREACHABLEF("WrapCoordinate case missing ({}).", (int)wrapMode);
+    }
+}
+
+size_t PNG::GetPixelSize(PixelFormat format)
+{
+    switch (format) {
+    case PixelFormat::RGBA8:
+        return sizeof(Pixel::RGBA8);
+    case PixelFormat::RGBA16:
+        return sizeof(Pixel::RGBA16);
+    case PixelFormat::GA8:
+        return sizeof(Pixel::GA8);
+    case PixelFormat::Float:
+        return sizeof(Color);
+    case PixelFormat::RGBA16F:
+        return sizeof(Pixel::RGBA16F);
+    default:
+        PNG_UNREACHABLEF("PNG::GetPixelSize case missing ({}).", (int)format);
+    }
+}
+
+PNG::PixelFormat PNG::GetNativePixelFormat(uint8_t colorType, size_t bitDepth)
+{
+    if (bitDepth == 16)
+        return PixelFormat::RGBA16;
+    if (colorType == ColorType::GRAYSCALE || colorType == ColorType::GRAYSCALE_ALPHA)
+        return PixelFormat::GA8;
+    return PixelFormat::RGBA8;
+}
+
+PNG::CompactImage& PNG::CompactImage::operator=(CompactImage&& other)
+{
+    m_Width = other.m_Width;
+    m_Height = other.m_Height;
+    m_Format = other.m_Format;
+    m_Pixels = std::move(other.m_Pixels);
+    other.m_Width = 0;
+    other.m_Height = 0;
+    other.m_Pixels.clear();
+    return *this;
+}
+
+PNG::CompactImage PNG::CompactImage::FromImage(const Image& img, PixelFormat format)
+{
+    CompactImage compact(img.GetWidth(), img.GetHeight(), format);
+    VisitPixelFormat(format, [&img, &compact](auto px) {
+        using PixelT = decltype(px);
+        Utils::Iota<size_t> imgHeight(compact.m_Height);
+        std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [&img, &compact](size_t y) {
+            ConvertRow(img[y], compact.GetRow<PixelT>(y), compact.m_Width);
+        });
+    });
+    return compact;
+}
+
+PNG::Image PNG::CompactImage::ToImage() const
+{
+    Image img(m_Width, m_Height);
+    VisitPixelFormat(m_Format, [this, &img](auto px) {
+        using PixelT = decltype(px);
+        Utils::Iota<size_t> imgHeight(m_Height);
+        std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, &img](size_t y) {
+            ConvertRow(GetRow<PixelT>(y), img[y], m_Width);
+        });
+    });
+    return img;
+}
+
+void PNG::CompactImage::Convert(PixelFormat format)
+{
+    if (format == m_Format)
+        return;
+
+    CompactImage converted(m_Width, m_Height, format);
+    VisitPixelFormat(m_Format, [this, &converted](auto srcPx) {
+        using SrcT = decltype(srcPx);
+        VisitPixelFormat(converted.m_Format, [this, &converted](auto dstPx) {
+            using DstT = decltype(dstPx);
+            Utils::Iota<size_t> imgHeight(m_Height);
+            std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, &converted](size_t y) {
+                ConvertRow(GetRow<SrcT>(y), converted.GetRow<DstT>(y), m_Width);
+            });
+        });
+    });
+
+    *this = std::move(converted);
+}
+
+void PNG::CompactImage::Crop(size_t left, size_t top, size_t right, size_t bottom)
+{
+    if (left + right >= m_Width || top + bottom >= m_Height) {
+        SetSize(0, 0);
+        return;
+    }
+
+    CompactImage cropped(m_Width - (left + right), m_Height - (top + bottom), m_Format);
+    const size_t pixelSize = GetPixelSize();
+    Utils::Iota<size_t> cropHeight(cropped.m_Height);
+    std::for_each(std::execution::par_unseq, cropHeight.begin(), cropHeight.end(), [this, &cropped, top, left, pixelSize](size_t y) {
+        memcpy(cropped[y], &(*this)[y+top][left * pixelSize], cropped.GetRowSize());
+    });
+
+    *this = std::move(cropped);
+}
+
+void PNG::CompactImage::Resize(size_t newWidth, size_t newHeight, ScalingMethod scalingMethod)
+{
+    const CompactImage src(std::move(*this));
+    SetSize(newWidth, newHeight, src.m_Format);
+
+    if (!(m_Width && m_Height &&
+        src.m_Width && src.m_Height))
+        return;
+
+    double scaleX = (src.m_Width-1.0) / (m_Width-1.0);
+    double scaleY = (src.m_Height-1.0) / (m_Height-1.0);
+
+    VisitPixelFormat(m_Format, [this, &src, scaleX, scaleY, scalingMethod](auto px) {
+        using PixelT = decltype(px);
+        using Traits = PixelTraits<PixelT>;
+
+        Utils::Iota<size_t> imgHeight(m_Height);
+        switch (scalingMethod) {
+        case ScalingMethod::Nearest:
+            std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, &src, scaleX, scaleY](size_t y) {
+                const PixelT* srcRow = src.GetRow<PixelT>((size_t)std::floor(y * scaleY + 0.5));
+                PixelT* row = GetRow<PixelT>(y);
+                for (size_t x = 0; x < m_Width; x++)
+                    row[x] = srcRow[(size_t)std::floor(x * scaleX + 0.5)];
+            });
+            break;
+        // https://en.wikipedia.org/wiki/Bilinear_interpolation
+        // Integer formats interpolate with 8-bit fixed point weights
+        case ScalingMethod::Bilinear:
+            std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, &src, scaleX, scaleY](size_t y) {
+                double cy = y * scaleY;
+                size_t srcy = (size_t)std::floor(cy);
+                const PixelT* srcPixels1 = src.GetRow<PixelT>(srcy);
+                const PixelT* srcPixels2 = src.GetRow<PixelT>(std::min(srcy + 1, src.m_Height - 1));
+                PixelT* pixels = GetRow<PixelT>(y);
+
+                if constexpr (IS_FLOAT_LIKE_PIXEL<PixelT>) {
+                    std::vector<Color> srcBuffer1, srcBuffer2, buffer;
+                    const Color* srcRow1 = LoadColors(srcPixels1, src.m_Width, srcBuffer1);
+                    const Color* srcRow2 = LoadColors(srcPixels2, src.m_Width, srcBuffer2);
+                    Color* row = OutputColors(pixels, m_Width, buffer);
+                    for (size_t x = 0; x < m_Width; x++) {
+                        double cx = x * scaleX;
+                        size_t srcx1 = (size_t)std::floor(cx);
+                        size_t srcx2 = std::min(srcx1 + 1, src.m_Width - 1);
+
+                        Color colY1 = Math::Lerp(cx-srcx1, srcRow1[srcx1], srcRow1[srcx2]);
+                        Color colY2 = Math::Lerp(cx-srcx1, srcRow2[srcx1], srcRow2[srcx2]);
+                        row[x] = Math::Lerp(cy-srcy, colY1, colY2).Clamp();
+                    }
+                    StoreColors(row, pixels, m_Width);
+                } else {
+                    for (size_t x = 0; x < m_Width; x++) {
+                        double cx = x * scaleX;
+                        size_t srcx1 = (size_t)std::floor(cx);
+                        size_t srcx2 = std::min(srcx1 + 1, src.m_Width - 1);
+
+                        // Interpolating along x keeps 8 more bits, which are rounded away after interpolating along y
+                        const uint32_t wx = (uint32_t)((cx - srcx1) * 256 + 0.5);
+                        const uint32_t wy = (uint32_t)((cy - srcy) * 256 + 0.5);
+                        const auto* c11 = GetChannels(srcPixels1[srcx1]);
+                        const auto* c21 = GetChannels(srcPixels1[srcx2]);
+                        const auto* c12 = GetChannels(srcPixels2[srcx1]);
+                        const auto* c22 = GetChannels(srcPixels2[srcx2]);
+                        auto* out = GetChannels(pixels[x]);
+                        for (size_t c = 0; c < Traits::CHANNELS; c++) {
+                            uint32_t y1 = c11[c] * (256 - wx) + c21[c] * wx;
+                            uint32_t y2 = c12[c] * (256 - wx) + c22[c] * wx;
+                            out[c] = (typename Traits::Channel)((y1 * (256 - wy) + y2 * wy + 32768) >> 16);
+                        }
+                    }
+                }
+            });
+            break;
+        default:
+            PNG_UNREACHABLEF("PNG::CompactImage::Resize case missing ({}).", (int)scalingMethod);
+        }
+    });
+}
+
+void PNG::CompactImage::ApplyKernel(const Kernel& kernel, WrapMode wrapMode)
+{
+    if (!kernel.Data)
+        return;
+
+    const CompactImage src(std::move(*this));
+    SetSize(src.m_Width, src.m_Height, src.m_Format);
+
+    // Integer formats use 16.16 fixed point weights
+    std::vector<int32_t> fixedWeights(kernel.Width * kernel.Height);
+    for (size_t i = 0; i < fixedWeights.size(); i++)
+        fixedWeights[i] = (int32_t)std::lround(kernel.Data[i] * 65536.0);
+
+    VisitPixelFormat(m_Format, [this, &kernel, &src, &fixedWeights, wrapMode](auto px) {
+        using PixelT = decltype(px);
+        using Traits = PixelTraits<PixelT>;
+
+        Utils::Iota<size_t> imgHeight(m_Height);
+        std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, &kernel, &src, &fixedWeights, wrapMode](size_t y) {
+            PixelT* row = GetRow<PixelT>(y);
+
+            if constexpr (IS_FLOAT_LIKE_PIXEL<PixelT>) {
+                // Source rows are converted once for the whole output row, rows out of the image are null
+                std::vector<std::vector<Color>> srcBuffers(kernel.Height);
+                std::vector<const Color*> srcRows(kernel.Height, nullptr);
+                for (size_t kY = 0; kY < kernel.Height; kY++) {
+                    size_t srcy;
+                    if (WrapCoordinate(y, (int64_t)kY - (int64_t)kernel.AnchorY, m_Height, wrapMode, srcy))
+                        srcRows[kY] = LoadColors(src.GetRow<PixelT>(srcy), m_Width, srcBuffers[kY]);
+                }
+
+                std::vector<Color> buffer;
+                Color* colors = OutputColors(row, m_Width, buffer);
+                for (size_t x = 0; x < m_Width; x++) {
+                    Color finalColor(0.0, 0.0);
+                    for (size_t kY = 0; kY < kernel.Height; kY++) {
+                        const Color* srcRow = srcRows[kY];
+                        if (!srcRow)
+                            continue;
+                        for (size_t kX = 0; kX < kernel.Width; kX++) {
+                            double value = kernel[kY][kX];
+                            size_t srcx;
+                            if (value == 0.0 || !WrapCoordinate(x, (int64_t)kX - (int64_t)kernel.AnchorX, m_Width, wrapMode, srcx))
+                                continue;
+                            finalColor += srcRow[srcx] * value;
+                        }
+                    }
+                    colors[x] = finalColor.Clamp();
+                }
+                StoreColors(colors, row, m_Width);
+            } else {
+                for (size_t x = 0; x < m_Width; x++) {
+                    int64_t sums[Traits::CHANNELS]{0};
+                    for (size_t kY = 0; kY < kernel.Height; kY++) {
+                        size_t srcy;
+                        if (!WrapCoordinate(y, (int64_t)kY - (int64_t)kernel.AnchorY, m_Height, wrapMode, srcy))
+                            continue;
+                        const PixelT* srcRow = src.GetRow<PixelT>(srcy);
+                        for (size_t kX = 0; kX < kernel.Width; kX++) {
+                            int32_t weight = fixedWeights[kY * kernel.Width + kX];
+                            size_t srcx;
+                            if (weight == 0 || !WrapCoordinate(x, (int64_t)kX - (int64_t)kernel.AnchorX, m_Width, wrapMode, srcx))
+                                continue;
+                            const auto* channels = GetChannels(srcRow[srcx]);
+                            for (size_t c = 0; c < Traits::CHANNELS; c++)
+                                sums[c] += (int64_t)channels[c] * weight;
+                        }
+                    }
+                    auto* out = GetChannels(row[x]);
+                    for (size_t c = 0; c < Traits::CHANNELS; c++)
+                        out[c] = (typename Traits::Channel)std::clamp<int64_t>((sums[c] + 32768) >> 16, 0, Traits::MAX_VALUE);
+                }
+            }
+        });
+    });
+}
+
+void PNG::CompactImage::ApplyGrayscale()
+{
+    VisitPixelFormat(m_Format, [this](auto px) {
+        using PixelT = decltype(px);
+        // Gray pixels have nothing to do
+        if constexpr (!std::is_same_v<PixelT, Pixel::GA8>) {
+            Utils::Iota<size_t> imgHeight(m_Height);
+            std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this](size_t y) {
+                PixelT* row = GetRow<PixelT>(y);
+                if constexpr (IS_FLOAT_LIKE_PIXEL<PixelT>) {
+                    std::vector<Color> buffer;
+                    Color* colors = EditColors(row, m_Width, buffer);
+                    for (size_t x = 0; x < m_Width; x++) {
+                        Color& color = colors[x];
+                        float grayscale = (float)((color.R + color.G + color.B) / 3.0);
+                        color.R = grayscale;
+                        color.G = grayscale;
+                        color.B = grayscale;
+                    }
+                    StoreColors(colors, row, m_Width);
+                } else {
+                    for (size_t x = 0; x < m_Width; x++) {
+                        PixelT& color = row[x];
+                        auto grayscale = (decltype(color.R))(((uint32_t)color.R + color.G + color.B) / 3);
+                        color.R = grayscale;
+                        color.G = grayscale;
+                        color.B = grayscale;
+                    }
+                }
+            });
+        }
+    });
+}
+
+void PNG::CompactImage::ApplyVerticalFlip()
+{
+    const size_t rowSize = GetRowSize();
+    Utils::Iota<size_t> imgHalfHeight(m_Height/2);
+    std::for_each(std::execution::par_unseq, imgHalfHeight.begin(), imgHalfHeight.end(), [this, rowSize](size_t y) {
+        std::swap_ranges((*this)[y], (*this)[y] + rowSize, (*this)[m_Height-y-1]);
+    });
+}
+
+void PNG::CompactImage::ApplyHorizontalFlip()
+{
+    VisitPixelFormat(m_Format, [this](auto px) {
+        using PixelT = decltype(px);
+        Utils::Iota<size_t> imgHeight(m_Height);
+        std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this](size_t y) {
+            PixelT* row = GetRow<PixelT>(y);
+            std::reverse(row, row + m_Width);
+        });
+    });
+}
+
+void PNG::CompactImage::ApplyRotation90(bool clockwise)
+{
+    CompactImage rotated(m_Height, m_Width, m_Format);
+
+    VisitPixelFormat(m_Format, [this, clockwise, &rotated](auto px) {
+        using PixelT = decltype(px);
+        Utils::Iota<size_t> imgHeight(m_Height);
+        std::for_each(std::execution::par_unseq, imgHeight.begin(), imgHeight.end(), [this, clockwise, &rotated](size_t y) {
+            const PixelT* row = GetRow<PixelT>(y);
+            if (clockwise) {
+                for (size_t x = 0; x < m_Width; x++)
+                    rotated.GetRow<PixelT>(x)[m_Height-y-1] = row[x];
+            } else {
+                for (size_t x = 0; x < m_Width; x++)
+                    rotated.GetRow<PixelT>(m_Width-x-1)[y] = row[x];
+            }
+        });
+    });
+
+    *this = std::move(rotated);
+}
+
+void PNG::CompactImage::ApplyRotation180()
+{
+    VisitPixelFormat(m_Format, [this](auto px) {
+        using PixelT = decltype(px);
+        // Half height is rounded up
+        Utils::Iota<size_t> imgHalfHeight(m_Height/2 + (m_Height & 1));
+        std::for_each(std::execution::par_unseq, imgHalfHeight.begin(), imgHalfHeight.end(), [this](size_t y) {
+            PixelT* topRow = GetRow<PixelT>(y);
+            PixelT* botRow = GetRow<PixelT>(m_Height-y-1);
+            if (topRow == botRow) {
+                // If we're on the mid scanline, it's just flipped
+                std::reverse(topRow, topRow + m_Width);
+                return;
+            }
+            for (size_t x = 0; x < m_Width; x++)
+                std::swap(topRow[x], botRow[m_Width-x-1]);
+        });
+    });
+}
+
+// https://en.wikipedia.org/wiki/Alpha_compositing
+void PNG::CompactImage::Blend(const CompactImage& other, size_t x, size_t y, int64_t dx, int64_t dy, WrapMode wrapMode)
+{
+    const CompactImage* fg = &other;
+    CompactImage converted;
+    if (other.m_Format != m_Format) {
+        converted = other;
+        converted.Convert(m_Format);
+        fg = &converted;
+    }
+
+    VisitPixelFormat(m_Format, [this, fg, x, y, dx, dy, wrapMode](auto px) {
+        using PixelT = decltype(px);
+        using Traits = PixelTraits<PixelT>;
+
+        Utils::Iota<size_t> fgHeight(fg->m_Height);
+        std::for_each(std::execution::par_unseq, fgHeight.begin(), fgHeight.end(), [this, fg, x, y, dx, dy, wrapMode](size_t fgY) {
+            size_t bgY;
+            if (!WrapCoordinate(y + fgY, dy, m_Height, wrapMode, bgY))
+                return;
+            const PixelT* fgPixels = fg->GetRow<PixelT>(fgY);
+            PixelT* bgPixels = GetRow<PixelT>(bgY);
+
+            if constexpr (IS_FLOAT_LIKE_PIXEL<PixelT>) {
+                std::vector<Color> fgBuffer, bgBuffer;
+                const Color* fgRow = LoadColors(fgPixels, fg->m_Width, fgBuffer);
+                Color* bgRow = EditColors(bgPixels, m_Width, bgBuffer);
+                for (size_t fgX = 0; fgX < fg->m_Width; fgX++) {
+                    size_t bgX;
+                    if (WrapCoordinate(x + fgX, dx, m_Width, wrapMode, bgX))
+                        bgRow[bgX].AlphaBlend(fgRow[fgX]);
+                }
+                StoreColors(bgRow, bgPixels, m_Width);
+            } else {
+                for (size_t fgX = 0; fgX < fg->m_Width; fgX++) {
+                    size_t bgX;
+                    if (!WrapCoordinate(x + fgX, dx, m_Width, wrapMode, bgX))
+                        continue;
+
+                    // Alpha is the last channel, the blended one is computed in units of MAX_VALUE^2
+                    const size_t ALPHA = Traits::CHANNELS - 1;
+                    const uint64_t MAX_VALUE = Traits::MAX_VALUE;
+                    const auto* fgChannels = GetChannels(fgPixels[fgX]);
+                    auto* bgChannels = GetChannels(bgPixels[bgX]);
+
+                    const uint64_t fgAlpha = fgChannels[ALPHA];
+                    if (fgAlpha == 0)
+                        continue;
+                    const uint64_t bgWeight = bgChannels[ALPHA] * (MAX_VALUE - fgAlpha);
+                    const uint64_t fgWeight = fgAlpha * MAX_VALUE;
+                    const uint64_t alpha = fgWeight + bgWeight;
+                    for (size_t c = 0; c < ALPHA; c++)
+                        bgChannels[c] = (typename Traits::Channel)((fgChannels[c] * fgWeight + bgChannels[c] * bgWeight + alpha / 2) / alpha);
+                    bgChannels[ALPHA] = (typename Traits::Channel)((alpha + MAX_VALUE / 2) / MAX_VALUE);
+                }
+            }
+        });
+    });
+}
+
+void PNG::CompactImage::SetSize(size_t width, size_t height, PixelFormat format)
+{
+    m_Format = format;
+    if (width == 0 || height == 0) {
+        m_Width = 0;
+        m_Height = 0;
+        m_Pixels.clear();
+        m_Pixels.shrink_to_fit();
+        return;
+    }
+
+    m_Width = width;
+    m_Height = height;
+    // Like PNG::Image, pixels start with an alpha of 0
+    m_Pixels.assign(width * height * PNG::GetPixelSize(format), 0);
+}
+
+PNG::Color PNG::CompactImage::GetColor(size_t x, size_t y) const
+{
+    Color color;
+    VisitPixelFormat(m_Format, [this, x, y, &color](auto px) {
+        using PixelT = decltype(px);
+        color = ConvertPixel<PixelT, Color>(GetRow<PixelT>(y)[x]);
+    });
+    return color;
+}
+
+void PNG::CompactImage::SetColor(size_t x, size_t y, const Color& color)
+{
+    VisitPixelFormat(m_Format, [this, x, y, &color](auto px) {
+        using PixelT = decltype(px);
+        GetRow<PixelT>(y)[x] = ConvertPixel<Color, PixelT>(color);
+    });
+}
+
+PNG::Result PNG::CompactImage::WriteRawRow(uint8_t colorType, size_t bitDepth, size_t y, uint8_t* out) const
+{
+    if (colorType == ColorType::PALETTE)
+        return Result::UnsupportedColorType;
+
+    size_t samples = ColorType::GetSamples(colorType);
+    if (samples == 0)
+        return Result::InvalidColorType;
+
+    if (!ColorType::IsValidBitDepth(colorType, bitDepth))
+        return Result::InvalidBitDepth;
+
+    if (m_Format == PixelFormat::Float)
+        return Image::WriteRawRow(colorType, bitDepth, GetRow<Color>(y), m_Width, out);
+
+    if (m_Format == PixelFormat::RGBA16F) {
+        std::vector<Color> buffer;
+        return Image::WriteRawRow(colorType, bitDepth, LoadColors(GetRow<Pixel::RGBA16F>(y), m_Width, buffer), m_Width, out);
+    }
+
+    // Pixels which are stored like raw ones are copied as they are
+    if (bitDepth == 8 &&
+        ((m_Format == PixelFormat::RGBA8 && colorType == ColorType::RGBA) ||
+         (m_Format == PixelFormat::GA8 && colorType == ColorType::GRAYSCALE_ALPHA))
+    ) {
+        memcpy(out, (*this)[y], GetRowSize());
+        return Result::OK;
+    }
+
+    const size_t sampleSize = ColorType::GetBytesPerSample(bitDepth);
+    const uint32_t MAX_SAMPLE_VALUE = ((uint32_t)1 << bitDepth) - 1;
+    VisitPixelFormat(m_Format, [this, colorType, samples, sampleSize, MAX_SAMPLE_VALUE, y, &out](auto px) {
+        using PixelT = decltype(px);
+        if constexpr (!IS_FLOAT_LIKE_PIXEL<PixelT>) {
+            const PixelT* row = GetRow<PixelT>(y);
+            uint32_t rawColor[ColorType::MAX_SAMPLES]{0};
+            for (size_t x = 0; x < m_Width; x++) {
+                Pixel::RGBA16 color = PixelTraits<PixelT>::ToWide(row[x]);
+                switch (colorType) {
+                case ColorType::GRAYSCALE:
+                    rawColor[0] = ((uint32_t)color.R + color.G + color.B) / 3;
+                    break;
+                case ColorType::RGB:
+                    rawColor[0] = color.R;
+                    rawColor[1] = color.G;
+                    rawColor[2] = color.B;
+                    break;
+                case ColorType::GRAYSCALE_ALPHA:
+                    rawColor[0] = ((uint32_t)color.R + color.G + color.B) / 3;
+                    rawColor[1] = color.A;
+                    break;
+                case ColorType::RGBA:
+                    rawColor[0] = color.R;
+                    rawColor[1] = color.G;
+                    rawColor[2] = color.B;
+                    rawColor[3] = color.A;
+                    break;
+                default:
+                    PNG_UNREACHABLEF("PNG::CompactImage::WriteRawRow case missing ({}).", colorType);
+                }
+
+                for (size_t j = 0; j < samples; j++) {
+                    uint32_t sample = (rawColor[j] * MAX_SAMPLE_VALUE + 32767) / 65535;
+                    for (size_t k = 0; k < sampleSize; k++)
+                        *out++ = (uint8_t)(sample >> ((sampleSize - k - 1) * 8));
+                }
+            }
+        }
+    });
+
+    return Result::OK;
+}
+
+PNG::Result PNG::CompactImage::Write(OStream& _out, const ExportSettings& cfg, bool async) const
+{
+    // Dithering diffuses errors which are smaller than what integer formats can hold
+    if (cfg.ColorType == ColorType::PALETTE)
+        return ToImage().Write(_out, cfg, async);
+
+    PNG_RETURN_IF_NOT_OK(cfg.Validate);
+
+    // WriteImageEnd flushes the buffered stream
+    BufferedOStream bufferedOut(_out, cfg.WriteBufferSize);
+    OStream& out = cfg.WriteBufferSize > 0 && !_out.IsBuffered() ? bufferedOut : _out;
+
+    ImageHeader ihdr {
+        .Width = (uint32_t)m_Width,
+        .Height = (uint32_t)m_Height,
+        .BitDepth = (uint8_t)cfg.BitDepth,
+        .ColorType = cfg.ColorType,
+        .CompressionMethod = CompressionMethod::ZLIB,
+        .FilterMethod = FilterMethod::ADAPTIVE_FILTERING,
+        .InterlaceMethod = cfg.InterlaceMethod,
+    };
+
+    PNG_RETURN_IF_NOT_OK(WriteImageHead, out, ihdr, cfg);
+
+    auto writeRawPixels = [this, &ihdr](OStream& rawImage) {
+        std::vector<uint8_t> line(m_Width * ColorType::GetBytesPerPixel(ihdr.ColorType, ihdr.BitDepth));
+        for (size_t y = 0; y < m_Height; y++) {
+            PNG_RETURN_IF_NOT_OK(WriteRawRow, ihdr.ColorType, ihdr.BitDepth, y, line.data());
+            PNG_RETURN_IF_NOT_OK(rawImage.WriteVector, line);
+            // Flush on each scanline
+            PNG_RETURN_IF_NOT_OK(rawImage.Flush);
+        }
+        return Result::OK;
+    };
+    PNG_RETURN_IF_NOT_OK(WriteImageData, out, ihdr, cfg, writeRawPixels, async);
+
+    return WriteImageEnd(out);
+}
+
+// Loads unpacked raw pixels into row `y` of `img`, which must have the native format of the image
+// Rows of a region are narrower than `in`, only their pixels are loaded
+static PNG::Result LoadNativeRow(const PNG::ImageHeader& ihdr, const std::vector<PNG::Pixel::RGBA8>& palette, const uint8_t* in, PNG::CompactImage& img, size_t y)
+{
+    using namespace PNG;
+
+    switch (img.GetFormat()) {
+    case PixelFormat::GA8: {
+        Pixel::GA8* row = img.GetRow<Pixel::GA8>(y);
+        if (ihdr.ColorType == ColorType::GRAYSCALE_ALPHA) {
+            memcpy(row, in, img.GetRowSize());
+            break;
+        }
+        // Samples of less than 8 bits are scaled up, 255 is a multiple of all of their max values
+        const uint32_t scale = 255 / (((uint32_t)1 << ihdr.BitDepth) - 1);
+        for (size_t x = 0; x < img.GetWidth(); x++)
+            row[x] = { (uint8_t)(in[x] * scale), 255 };
+        break;
+    }
+    case PixelFormat::RGBA8: {
+        Pixel::RGBA8* row = img.GetRow<Pixel::RGBA8>(y);
+        switch (ihdr.ColorType) {
+        case ColorType::RGBA:
+            memcpy(row, in, img.GetRowSize());
+            break;
+        case ColorType::RGB:
+            for (size_t x = 0; x < img.GetWidth(); x++)
+                row[x] = { in[x*3], in[x*3+1], in[x*3+2], 255 };
+            break;
+        case ColorType::PALETTE:
+            for (size_t x = 0; x < img.GetWidth(); x++) {
+                if (in[x] >= palette.size()) {
+                    PNG_LDEBUGF("PNG::CompactImage::Read palette index {} is out of bounds (>= {}).", in[x], palette.size());
+                    return Result::InvalidPaletteIndex;
+                }
+                row[x] = palette[in[x]];
+            }
+            break;
+        default:
+            return Result::InvalidColorType;
+        }
+        break;
+    }
+    case PixelFormat::RGBA16: {
+        Pixel::RGBA16* row = img.GetRow<Pixel::RGBA16>(y);
+        const size_t samples = ColorType::GetSamples(ihdr.ColorType);
+        auto readU16 = [](const uint8_t* sample) { return (uint16_t)(sample[0] << 8 | sample[1]); };
+        for (size_t x = 0; x < img.GetWidth(); x++) {
+            const uint8_t* rawPixel = &in[x * samples * 2];
+            switch (ihdr.ColorType) {
+            case ColorType::GRAYSCALE: {
+                uint16_t gray = readU16(rawPixel);
+                row[x] = { gray, gray, gray, 65535 };
+                break;
+            }
+            case ColorType::GRAYSCALE_ALPHA: {
+                uint16_t gray = readU16(rawPixel);
+                row[x] = { gray, gray, gray, readU16(rawPixel+2) };
+                break;
+            }
+            case ColorType::RGB:
+                row[x] = { readU16(rawPixel), readU16(rawPixel+2), readU16(rawPixel+4), 65535 };
+                break;
+            case ColorType::RGBA:
+                row[x] = { readU16(rawPixel), readU16(rawPixel+2), readU16(rawPixel+4), readU16(rawPixel+6) };
+                break;
+            default:
+                return Result::InvalidColorType;
+            }
+        }
+        break;
+    }
+    default:
+        PNG_UNREACHABLEF("LoadNativeRow Pixel format {} is not native to any image.", (int)img.GetFormat());
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::CompactImage::Read(IStream& _in, CompactImage& out, const ImportSettings& cfg, bool async)
+{
+    BufferedIStream bufferedIn(_in, cfg.ReadBufferSize);
+    IStream& in = cfg.ReadBufferSize > 0 && !_in.IsBuffered() ? bufferedIn : _in;
+
+    ChunkReader chunkReader(cfg);
+    ChunkView idat;
+    PNG_RETURN_IF_NOT_OK(ReadImageHead, in, chunkReader, idat, async);
+    const ImageHeader& ihdr = chunkReader.GetHeader();
+
+    // The palette is complete before the first IDAT, its colors were read from 8-bit samples
+    std::vector<Pixel::RGBA8> palette;
+    for (const Color& color : chunkReader.GetPalette()) {
+        palette.push_back({ (uint8_t)std::lround(color.R * 255), (uint8_t)std::lround(color.G * 255),
+            (uint8_t)std::lround(color.B * 255), (uint8_t)std::lround(color.A * 255) });
+    }
+
+    const ImageRegion region = cfg.Region.Resolve(chunkReader.GetDecodedHeader());
+    // Raw rows are unpacked, so the region starts at the same byte of each one
+    const size_t regionOffset = region.X * ColorType::GetSamples(ihdr.ColorType) * ColorType::GetBytesPerSample(ihdr.BitDepth);
+
+    CompactImage img(region.Width, region.Height, GetNativePixelFormat(ihdr.ColorType, ihdr.BitDepth));
+    auto loadRow = [&ihdr, &palette, &img, &region, regionOffset](size_t y, const uint8_t* rawRow) {
+        return LoadNativeRow(ihdr, palette, rawRow + regionOffset, img, y - region.Y);
+    };
+    PNG_RETURN_IF_NOT_OK(ReadImageData, in, chunkReader, idat, loadRow, async);
+    out = std::move(img);
+
+    if (cfg.IHDROut)
+        *cfg.IHDROut = ihdr;
+    if (cfg.PaletteOut)
+        *cfg.PaletteOut = std::move(chunkReader.GetPalette());
+
+    return Result::OK;
+}
@@ -2,6 +2,12 @@
 
 #ifdef PNG_USE_ZLIB
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <limits>
+#include <thread>
+
 #include <zlib/zlib.h>
 
 int PNG::ZLib::GetLevel(CompressionLevel l)
@@ -25,7 +31,16 @@ PNG::Result PNG::ZLib::DecompressData(IStream& in, OStream& out)
     const size_t IN_CAPACITY = 32768; // 32KiB
     size_t inSize = 0;
     Bytef inBuffer[IN_CAPACITY];
-    PNG_RETURN_IF_NOT_OK(in.ReadBuffer, inBuffer, IN_CAPACITY, &inSize);
+
+    // If `in` supports views, zlib reads directly from its memory and inBuffer is never used
+    const size_t MAX_VIEW_SIZE = std::numeric_limits<uInt>::max();
+    const uint8_t* inView = nullptr;
+    auto vres = in.ReadView(inView, MAX_VIEW_SIZE, &inSize);
+    const bool useViews = vres != Result::UnsupportedStreamOperation;
+    if (!useViews)
+        PNG_RETURN_IF_NOT_OK(in.ReadBuffer, inBuffer, IN_CAPACITY, &inSize);
+    else if (vres != Result::OK)
+        return vres;
 
     const size_t OUT_CAPACITY = 32768; // 32KiB
     Bytef outBuffer[OUT_CAPACITY];
@@ -49,7 +64,7 @@ PNG::Result PNG::ZLib::DecompressData(IStream& in, OStream& out)
     inf.zfree = Z_NULL;
     inf.opaque = Z_NULL;
     inf.avail_in = (uInt)inSize;
-    inf.next_in = inBuffer;
+    inf.next_in = useViews ? (Bytef*)inView : inBuffer;
     inf.avail_out = OUT_CAPACITY;
     inf.next_out = outBuffer;
 
@@ -81,7 +96,17 @@ PNG::Result PNG::ZLib::DecompressData(IStream& in, OStream& out)
             return PNG::Result::OK;
         }
 
-        if (zcode == Z_BUF_ERROR || inf.avail_in == 0) {
+        if (useViews) {
+            // A view must be fully consumed before asking for the next one, since it's invalidated by the read
+            if (inf.avail_in == 0) {
+                pres = in.ReadView(inView, MAX_VIEW_SIZE, &inSize);
+                if (pres != Result::OK)
+                    break;
+
+                inf.avail_in = (uInt)inSize;
+                inf.next_in = (Bytef*)inView;
+            }
+        } else if (zcode == Z_BUF_ERROR || inf.avail_in == 0) {
             if (inf.avail_in != 0)
                 memmove(inBuffer, inf.next_in, inf.avail_in);
 
@@ -183,6 +208,389 @@ PNG::Result PNG::ZLib::CompressData(IStream& in, OStream& out, CompressionLevel
     return Result::ZLib_DataError;
 }
 
+// Fills buf unless the end of in is reached, bytesRead is 0 only at the end of in
+static PNG::Result ReadBlock(PNG::IStream& in, uint8_t* buf, size_t bufLen, size_t& bytesRead)
+{
+    bytesRead = 0;
+    while (bytesRead < bufLen) {
+        size_t readSize = 0;
+        auto res = in.ReadBuffer(buf + bytesRead, bufLen - bytesRead, &readSize);
+        if (res == PNG::Result::EndOfFile)
+            break;
+        else if (res != PNG::Result::OK)
+            return res;
+        bytesRead += readSize;
+    }
+    return PNG::Result::OK;
+}
+
+namespace
+{
+    // A block of data which is deflated on its own, see PNG::ZLib::CompressDataParallel()
+    struct DeflateJob
+    {
+        // The dictionary is followed by the data of the block
+        std::vector<uint8_t> In;
+        size_t DictionarySize = 0;
+        bool Last = false;
+
+        std::vector<uint8_t> Out;
+        uLong Adler = 1;
+    };
+}
+
+// Deflates block.In into a raw deflate stream which ends on a byte boundary
+// The last block also ends the deflate stream, so that blocks can just be concatenated
+static PNG::Result DeflateBlock(DeflateJob& block, int level)
+{
+    const uInt dataSize = (uInt)(block.In.size() - block.DictionarySize);
+    const Bytef* data = block.In.data() + block.DictionarySize;
+    block.Adler = adler32(1, data, dataSize);
+
+    z_stream def;
+    def.zalloc = Z_NULL;
+    def.zfree = Z_NULL;
+    def.opaque = Z_NULL;
+    // Negative window bits make zlib skip the zlib header and trailer
+    if (deflateInit2(&def, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return PNG::Result::ZLib_DataError;
+
+    if (block.DictionarySize > 0)
+        deflateSetDictionary(&def, block.In.data(), (uInt)block.DictionarySize);
+
+    // A sync flush adds an empty stored block of 5 bytes to align the stream to a byte boundary
+    block.Out.resize(deflateBound(&def, dataSize) + 16);
+    def.avail_in = dataSize;
+    def.next_in = (Bytef*)data;
+    def.avail_out = (uInt)block.Out.size();
+    def.next_out = block.Out.data();
+
+    const int flush = block.Last ? Z_FINISH : Z_SYNC_FLUSH;
+    int zcode;
+    while (true) {
+        zcode = deflate(&def, flush);
+        if (zcode == Z_STREAM_END || (zcode == Z_OK && flush == Z_SYNC_FLUSH && def.avail_out > 0))
+            break;
+        if (zcode != Z_OK && zcode != Z_BUF_ERROR) {
+            deflateEnd(&def);
+            PNG_LDEBUGF("PNG::ZLib::CompressDataParallel error code ({}).", zcode);
+            return PNG::Result::ZLib_DataError;
+        }
+
+        // This should never happen since the buffer can hold the worst case
+        size_t outSize = block.Out.size() - def.avail_out;
+        block.Out.resize(block.Out.size() * 2);
+        def.avail_out = (uInt)(block.Out.size() - outSize);
+        def.next_out = block.Out.data() + outSize;
+    }
+
+    block.Out.resize(block.Out.size() - def.avail_out);
+    deflateEnd(&def);
+    return PNG::Result::OK;
+}
+
+// Writes a zlib stream made of blocks of blockSize bytes of in, deflated by up to `threads` workers
+// Each block is primed with the dictionarySize bytes of data before it, the offset of each block is appended to blockOffsets
+static PNG::Result DeflateBlocks(PNG::IStream& in, PNG::OStream& out, int zlevel, size_t threads,
+    size_t blockSize, size_t dictionarySize, std::vector<uint64_t>* blockOffsets)
+{
+    using namespace PNG;
+
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    // A single worker runs on the calling thread when its block is written
+    const auto launchPolicy = threads > 1 ? std::launch::async : std::launch::deferred;
+
+    // http://www.zlib.org/rfc-zlib.html (2.2. Data format)
+    // FLEVEL is only informative, it's set like zlib would
+    const int resolvedLevel = zlevel == Z_DEFAULT_COMPRESSION ? 6 : zlevel;
+    const uint16_t flevel = resolvedLevel < 2 ? 0 : resolvedLevel < 6 ? 1 : resolvedLevel == 6 ? 2 : 3;
+    uint16_t header = (0x78 << 8) | (flevel << 6); // Deflate with a 32KiB window
+    header += 31 - header % 31;
+    PNG_RETURN_IF_NOT_OK(out.WriteU16, header);
+
+    // Blocks are written in order as they're done
+    // The next block is read before queueing one, since the last block must end the deflate stream
+    std::deque<std::future<std::pair<Result, DeflateJob>>> workers;
+    uLong adler = adler32(0, Z_NULL, 0);
+    uint64_t totalIn = 0;
+    uint64_t totalOut = 2;
+
+    auto writeNext = [&out, &workers, &adler, &totalIn, &totalOut, blockOffsets]() {
+        auto [res, block] = workers.front().get();
+        workers.pop_front();
+        if (res != Result::OK)
+            return res;
+
+        size_t dataSize = block.In.size() - block.DictionarySize;
+        adler = adler32_combine(adler, block.Adler, (z_off_t)dataSize);
+        if (blockOffsets)
+            blockOffsets->push_back(totalOut);
+        totalIn += dataSize;
+        totalOut += block.Out.size();
+        PNG_RETURN_IF_NOT_OK(out.WriteVector, block.Out);
+        return out.Flush();
+    };
+
+    DeflateJob next;
+    size_t readSize;
+    next.In.resize(blockSize);
+    PNG_RETURN_IF_NOT_OK(ReadBlock, in, next.In.data(), blockSize, readSize);
+    next.In.resize(readSize);
+
+    bool last = false;
+    while (!last) {
+        DeflateJob block = std::move(next);
+
+        // The window of the next block is the end of this one
+        next = DeflateJob{};
+        next.DictionarySize = std::min(block.In.size() - block.DictionarySize, dictionarySize);
+        next.In.resize(next.DictionarySize + blockSize);
+        memcpy(next.In.data(), block.In.data() + block.In.size() - next.DictionarySize, next.DictionarySize);
+
+        // Workers only use their own blocks, so they can be left to finish when returning early
+        PNG_RETURN_IF_NOT_OK(ReadBlock, in, next.In.data() + next.DictionarySize, blockSize, readSize);
+        next.In.resize(next.DictionarySize + readSize);
+
+        last = readSize == 0;
+        block.Last = last;
+
+        if (workers.size() >= threads)
+            PNG_RETURN_IF_NOT_OK(writeNext);
+        workers.push_back(std::async(launchPolicy, [zlevel, block = std::move(block)]() mutable {
+            auto res = DeflateBlock(block, zlevel);
+            return std::make_pair(res, std::move(block));
+        }));
+    }
+
+    while (!workers.empty())
+        PNG_RETURN_IF_NOT_OK(writeNext);
+
+    // The trailer is the adler32 checksum of the uncompressed data
+    PNG_RETURN_IF_NOT_OK(out.WriteU32, (uint32_t)adler);
+    PNG_RETURN_IF_NOT_OK(out.Flush);
+    PNG_LDEBUGF("PNG::ZLib::DeflateBlocks deflated {}B into {}B using {} threads.", totalIn, totalOut + 4, threads);
+    return Result::OK;
+}
+
+PNG::Result PNG::ZLib::CompressDataParallel(IStream& in, OStream& out, CompressionLevel level, size_t threads)
+{
+    // Same sizes as pigz, each block is primed with the window of data before it
+    const size_t BLOCK_SIZE = 131072; // 128KiB
+    const size_t DICTIONARY_SIZE = 32768; // 32KiB
+    return DeflateBlocks(in, out, GetLevel(level), threads, BLOCK_SIZE, DICTIONARY_SIZE, nullptr);
+}
+
+PNG::Result PNG::ZLib::CompressSegments(IStream& in, OStream& out, CompressionLevel level, size_t segmentSize, size_t threads, std::vector<uint64_t>& segmentOffsets)
+{
+    PNG_ASSERT(segmentSize > 0, "PNG::ZLib::CompressSegments Segments must not be empty.");
+    segmentOffsets.clear();
+    return DeflateBlocks(in, out, GetLevel(level), threads, segmentSize, 0, &segmentOffsets);
+}
+
+uint32_t PNG::ZLib::CombineAdler32(uint32_t adler1, uint32_t adler2, uint64_t len2)
+{
+    return (uint32_t)adler32_combine(adler1, adler2, (z_off_t)len2);
+}
+
+PNG::ZLib::InflateStream::InflateStream(IStream& in, bool rawDeflate)
+    : m_In(in), m_RawDeflate(rawDeflate), m_Stream(std::make_unique<z_stream>())
+{
+    m_Stream->zalloc = Z_NULL;
+    m_Stream->zfree = Z_NULL;
+    m_Stream->opaque = Z_NULL;
+    m_Stream->avail_in = 0;
+    m_Stream->next_in = Z_NULL;
+    // Negative window bits make zlib expect no zlib header and trailer
+    int zcode = inflateInit2(m_Stream.get(), rawDeflate ? -15 : 15);
+    if (zcode != Z_OK) {
+        PNG_LDEBUGF("PNG::ZLib::InflateStream init error code ({}).", zcode);
+        m_InitResult = Result::ZLib_DataError;
+    }
+}
+
+PNG::ZLib::InflateStream::~InflateStream()
+{
+    inflateEnd(m_Stream.get());
+}
+
+PNG::Result PNG::ZLib::InflateStream::FillInput()
+{
+    if (m_Stream->avail_in != 0)
+        return Result::OK;
+
+    size_t inSize = 0;
+    if (m_UseViews) {
+        const size_t MAX_VIEW_SIZE = std::numeric_limits<uInt>::max();
+        const uint8_t* inView = nullptr;
+        auto vres = m_In.ReadView(inView, MAX_VIEW_SIZE, &inSize);
+        if (vres != Result::UnsupportedStreamOperation) {
+            if (vres != Result::OK)
+                return vres;
+            m_Stream->avail_in = (uInt)inSize;
+            m_Stream->next_in = (Bytef*)inView;
+            return Result::OK;
+        }
+        m_UseViews = false;
+    }
+
+    const size_t IN_CAPACITY = 32768; // 32KiB
+    m_InBuffer.resize(IN_CAPACITY);
+    PNG_RETURN_IF_NOT_OK(m_In.ReadBuffer, m_InBuffer.data(), IN_CAPACITY, &inSize);
+    m_Stream->avail_in = (uInt)inSize;
+    m_Stream->next_in = m_InBuffer.data();
+    return Result::OK;
+}
+
+PNG::Result PNG::ZLib::InflateStream::ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead)
+{
+    // zlib must not be used if it failed to initialize the stream
+    if (m_InitResult != Result::OK)
+        return m_InitResult;
+
+    if (m_Finished) {
+        if (!bytesRead)
+            return bufLen == 0 ? Result::OK : Result::UnexpectedEOF;
+        *bytesRead = 0;
+        return Result::EndOfFile;
+    }
+
+    // bufLen is split, since zlib can't output more than uInt bytes at once
+    uint8_t* out = (uint8_t*)buf;
+    size_t totalRead = 0;
+    while (totalRead < bufLen) {
+        // zlib may still have buffered output when the input ends
+        auto fres = FillInput();
+        if (fres != Result::OK && fres != Result::EndOfFile)
+            return fres;
+
+        size_t outSize = std::min<size_t>(bufLen - totalRead, std::numeric_limits<uInt>::max());
+        m_Stream->avail_out = (uInt)outSize;
+        m_Stream->next_out = out + totalRead;
+
+        int zcode = inflate(m_Stream.get(), Z_NO_FLUSH);
+        const size_t inflated = outSize - m_Stream->avail_out;
+        if (m_RawDeflate)
+            m_RawAdler = (uint32_t)adler32(m_RawAdler, out + totalRead, (uInt)inflated);
+        totalRead += inflated;
+
+        if (zcode == Z_STREAM_END) {
+            m_Finished = true;
+            PNG_LDEBUGF("PNG::ZLib::InflateStream inflated {}B into {}B.", m_Stream->total_in, m_Stream->total_out);
+            break;
+        } else if (zcode == Z_BUF_ERROR && fres == Result::EndOfFile) {
+            // The compressed stream ended before zlib did
+            return Result::UnexpectedEOF;
+        } else if (zcode != Z_OK && zcode != Z_BUF_ERROR) {
+            PNG_LDEBUGF("PNG::ZLib::InflateStream error code ({}).", zcode);
+            if (m_Stream->msg)
+                PNG_LDEBUGF("PNG::ZLib::InflateStream error message: {}.", m_Stream->msg);
+            return Result::ZLib_DataError;
+        }
+
+        // The caller only needs at least one byte
+        if (bytesRead && totalRead > 0)
+            break;
+    }
+
+    if (bytesRead) {
+        *bytesRead = totalRead;
+        if (totalRead == 0 && bufLen > 0)
+            return Result::EndOfFile;
+    } else if (totalRead < bufLen)
+        return Result::UnexpectedEOF;
+
+    return Result::OK;
+}
+
+uint64_t PNG::ZLib::InflateStream::GetTotalOut() const
+{
+    return m_Stream->total_out;
+}
+
+uint32_t PNG::ZLib::InflateStream::GetAdler32() const
+{
+    return m_RawDeflate ? m_RawAdler : (uint32_t)m_Stream->adler;
+}
+
+PNG::ZLib::DeflateStream::DeflateStream(OStream& out, CompressionLevel level)
+    : m_Out(out), m_Stream(std::make_unique<z_stream>())
+{
+    const size_t OUT_CAPACITY = 32768; // 32KiB
+    m_OutBuffer.resize(OUT_CAPACITY);
+
+    m_Stream->zalloc = Z_NULL;
+    m_Stream->zfree = Z_NULL;
+    m_Stream->opaque = Z_NULL;
+    m_Stream->avail_in = 0;
+    m_Stream->next_in = Z_NULL;
+    m_Stream->avail_out = OUT_CAPACITY;
+    m_Stream->next_out = m_OutBuffer.data();
+    deflateInit(m_Stream.get(), GetLevel(level));
+}
+
+PNG::ZLib::DeflateStream::~DeflateStream()
+{
+    deflateEnd(m_Stream.get());
+}
+
+PNG::Result PNG::ZLib::DeflateStream::Deflate(int flush)
+{
+    while (true) {
+        int zcode = deflate(m_Stream.get(), flush);
+        if (zcode != Z_OK && zcode != Z_BUF_ERROR && zcode != Z_STREAM_END) {
+            PNG_LDEBUGF("PNG::ZLib::DeflateStream error code ({}).", zcode);
+            if (m_Stream->msg)
+                PNG_LDEBUGF("PNG::ZLib::DeflateStream error message: {}.", m_Stream->msg);
+            return Result::ZLib_DataError;
+        }
+
+        // Write to the underlying stream only when the buffer is full or the stream ended
+        if (m_Stream->avail_out == 0 || zcode == Z_STREAM_END) {
+            PNG_RETURN_IF_NOT_OK(m_Out.WriteBuffer, m_OutBuffer.data(), m_OutBuffer.size() - m_Stream->avail_out);
+            PNG_RETURN_IF_NOT_OK(m_Out.Flush);
+            m_Stream->avail_out = (uInt)m_OutBuffer.size();
+            m_Stream->next_out = m_OutBuffer.data();
+
+            if (zcode == Z_STREAM_END) {
+                m_Finished = true;
+                PNG_LDEBUGF("PNG::ZLib::DeflateStream deflated {}B into {}B.", m_Stream->total_in, m_Stream->total_out);
+                return Result::OK;
+            }
+        } else if (flush == Z_NO_FLUSH) {
+            // There's space left in the output buffer, so all input was consumed
+            return Result::OK;
+        }
+    }
+}
+
+PNG::Result PNG::ZLib::DeflateStream::WriteBuffer(const void* buf, size_t bufLen)
+{
+    if (m_Finished)
+        return Result::UpdatingClosedStreamError;
+
+    // bufLen is split, since zlib can't take more than uInt bytes at once
+    const uint8_t* in = (const uint8_t*)buf;
+    while (bufLen > 0) {
+        size_t inSize = std::min<size_t>(bufLen, std::numeric_limits<uInt>::max());
+        m_Stream->avail_in = (uInt)inSize;
+        m_Stream->next_in = (Bytef*)in;
+        PNG_RETURN_IF_NOT_OK(Deflate, Z_NO_FLUSH);
+        in += inSize;
+        bufLen -= inSize;
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ZLib::DeflateStream::Finish()
+{
+    if (m_Finished)
+        return Result::OK;
+    m_Stream->avail_in = 0;
+    return Deflate(Z_FINISH);
+}
+
 #endif // PNG_USE_ZLIB
 
 PNG::Result PNG::DecompressData(uint8_t method, IStream& in, OStream& out)
@@ -201,16 +609,39 @@ PNG::Result PNG::DecompressData(uint8_t method, IStream& in, OStream& out)
     }
 }
 
-PNG::Result PNG::CompressData(uint8_t method, IStream& in, OStream& out, CompressionLevel level)
+PNG::Result PNG::CompressData(uint8_t method, IStream& in, OStream& out, CompressionLevel level, size_t threads)
 {
     switch (method) {
     case CompressionMethod::ZLIB:
 #ifdef PNG_USE_ZLIB
+        if (threads != 1)
+            return ZLib::CompressDataParallel(in, out, level, threads);
         return ZLib::CompressData(in, out, level);
 #else // PNG_USE_ZLIB
         (void) in;
         (void) out;
         (void) level;
+        (void) threads;
+        return Result::ZLib_NotAvailable;
+#endif // PNG_USE_ZLIB
+    default:
+        return Result::UnknownCompressionMethod;
+    }
+}
+
+PNG::Result PNG::CompressSegments(uint8_t method, IStream& in, OStream& out, CompressionLevel level, size_t segmentSize, size_t threads, std::vector<uint64_t>& segmentOffsets)
+{
+    switch (method) {
+    case CompressionMethod::ZLIB:
+#ifdef PNG_USE_ZLIB
+        return ZLib::CompressSegments(in, out, level, segmentSize, threads, segmentOffsets);
+#else // PNG_USE_ZLIB
+        (void) in;
+        (void) out;
+        (void) level;
+        (void) segmentSize;
+        (void) threads;
+        (void) segmentOffsets;
         return Result::ZLib_NotAvailable;
 #endif // PNG_USE_ZLIB
     default:
@@ -0,0 +1,64 @@
+#include "png/cpu.h"
+
+#ifdef PNG_X86_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#else // _MSC_VER
+#include <cpuid.h>
+#endif // _MSC_VER
+
+static void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else // _MSC_VER
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif // _MSC_VER
+}
+
+// Returns the state components which the OS saves on context switches
+static uint64_t XGETBV()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else // _MSC_VER
+    uint32_t eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif // _MSC_VER
+}
+#endif // PNG_X86_SIMD
+
+static PNG::CPU::Features DetectFeatures()
+{
+    PNG::CPU::Features features;
+#ifdef PNG_X86_SIMD
+    uint32_t regs[4]; // eax, ebx, ecx, edx
+    CPUID(0, 0, regs);
+    const uint32_t maxLeaf = regs[0];
+    if (maxLeaf < 1)
+        return features;
+
+    CPUID(1, 0, regs);
+    features.SSE2   = regs[3] & (1 << 26);
+    features.SSSE3  = regs[2] & (1 << 9);
+    features.SSE41  = regs[2] & (1 << 19);
+    features.PCLMUL = regs[2] & (1 << 1);
+
+    // AVX registers must also be saved by the OS
+    const bool osxsave = regs[2] & (1 << 27);
+    const bool osAVX = osxsave && (XGETBV() & 0x6) == 0x6;
+    features.F16C = osAVX && (regs[2] & (1 << 29));
+    if (osAVX && maxLeaf >= 7) {
+        CPUID(7, 0, regs);
+        features.AVX2 = regs[1] & (1 << 5);
+    }
+#endif // PNG_X86_SIMD
+    return features;
+}
+
+const PNG::CPU::Features& PNG::CPU::GetFeatures()
+{
+    static const Features features = DetectFeatures();
+    return features;
+}
@@ -1,7 +1,17 @@
 #include "png/crc.h"
 
+#include "png/cpu.h"
+
+#ifdef PNG_X86_SIMD
+#include <immintrin.h>
+#endif // PNG_X86_SIMD
+
 // Code taken from http://www.libpng.org/pub/png/spec/1.2/PNG-CRCAppendix.html
 // I am not smart enough to come up with my own solution.
+// Slicing, folding and combining follow zlib and Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+
+// Bits are reflected, so the highest power of x is the lowest bit
+static const uint32_t CRC_POLY = 0xedb88320;
 
 const PNG::CRC PNG::CRC::m_Instance = PNG::CRC();
 
@@ -11,22 +21,129 @@ PNG::CRC::CRC()
         uint32_t c = n;
         for (size_t k = 0; k < 8; k++) {
             if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
+                c = CRC_POLY ^ (c >> 1);
             else
                 c = c >> 1;
         }
-        m_Table[n] = c;
+        m_Table[0][n] = c;
+    }
+
+    // Appending a zero byte to a CRC is a lookup into the first table
+    for (uint32_t n = 0; n < 256; n++) {
+        for (size_t k = 1; k < 8; k++) {
+            uint32_t c = m_Table[k-1][n];
+            m_Table[k][n] = m_Table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+
+    // x^1 is the second highest bit, each entry is the square of the previous one
+    uint32_t p = (uint32_t)1 << 30;
+    for (size_t k = 0; k < 32; k++) {
+        m_X2N[k] = p;
+        p = MultiplyModP(p, p);
     }
 }
 
-uint32_t PNG::CRC::Update(uint32_t crc, const void* _buf, size_t bufLen)
+uint32_t PNG::CRC::UpdateSliced(uint32_t crc, const uint8_t* buf, size_t bufLen)
 {
-    const uint8_t* buf = (uint8_t*)_buf;
+    const auto& table = m_Instance.m_Table;
+    for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+        // Bytes are combined in little-endian order whatever the platform is
+        uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+        uint32_t hi = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 | (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+
     for (size_t n = 0; n < bufLen; n++)
-        crc = m_Instance.m_Table[(crc ^ buf[n]) & 0xff] ^ (crc >> 8);
+        crc = table[0][(crc ^ buf[n]) & 0xff] ^ (crc >> 8);
     return crc;
 }
 
+#ifdef PNG_X86_SIMD
+// Folds 64 bytes at a time into 4 registers, then into 1, and reduces it to 32 bits
+// bufLen must be a multiple of 16 and at least 64
+PNG_TARGET("sse2,pclmul") static uint32_t UpdateCLMUL(uint32_t crc, const uint8_t* buf, size_t bufLen)
+{
+    // x^(4*128+32) mod P, x^(4*128-32) mod P
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    // x^(128+32) mod P, x^(128-32) mod P
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    // x^64 mod P
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    // P and the Barrett reduction constant floor(x^64 / P)
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    bufLen -= 64;
+
+    for (; bufLen >= 64; bufLen -= 64, buf += 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+    }
+
+    // Each register is folded into the next one, then the remaining blocks of 16 bytes are folded in
+    auto fold = [&k3k4](__m128i x, __m128i next) PNG_TARGET("sse2,pclmul") {
+        __m128i lo = _mm_clmulepi64_si128(x, k3k4, 0x00);
+        __m128i hi = _mm_clmulepi64_si128(x, k3k4, 0x11);
+        return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+    };
+    x1 = fold(x1, x2);
+    x1 = fold(x1, x3);
+    x1 = fold(x1, x4);
+    for (; bufLen >= 16; bufLen -= 16, buf += 16)
+        x1 = fold(x1, _mm_loadu_si128((const __m128i*)buf));
+
+    // 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif // PNG_X86_SIMD
+
+uint32_t PNG::CRC::Update(uint32_t crc, const void* _buf, size_t bufLen)
+{
+    const uint8_t* buf = (uint8_t*)_buf;
+#ifdef PNG_X86_SIMD
+    // Folding has a fixed cost, which small buffers like chunk types can't make up for
+    static const bool hasCLMUL = CPU::GetFeatures().SSE2 && CPU::GetFeatures().PCLMUL;
+    if (hasCLMUL && bufLen >= 64) {
+        size_t foldLen = bufLen & ~(size_t)15;
+        crc = UpdateCLMUL(crc, buf, foldLen);
+        buf += foldLen;
+        bufLen -= foldLen;
+    }
+#endif // PNG_X86_SIMD
+    return UpdateSliced(crc, buf, bufLen);
+}
+
 uint32_t PNG::CRC::Update(uint32_t crc, uint32_t value)
 {
     uint8_t buf[4];
@@ -39,3 +156,31 @@ uint32_t PNG::CRC::Calculate(const void* buf, size_t bufLen)
 {
     return ~Update(~0, buf, bufLen);
 }
+
+// Returns a * b modulo the CRC polynomial
+uint32_t PNG::CRC::MultiplyModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+uint32_t PNG::CRC::Combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    // Appending len2 bytes multiplies crc1 by x^(8 * len2), which is made up of the powers of x^(2^k)
+    uint32_t xn = (uint32_t)1 << 31; // x^0
+    for (size_t k = 3; len2 > 0; len2 >>= 1, k++) {
+        if (len2 & 1)
+            xn = MultiplyModP(m_Instance.m_X2N[k & 31], xn);
+    }
+    return MultiplyModP(xn, crc1) ^ crc2;
+}
@@ -1,8 +1,341 @@
 #include "png/filter.h"
 
+#include "png/cpu.h"
+#include "png/utils.h"
+
+#include <algorithm>
+#include <execution>
 #include <iostream>
 #include <memory>
 
+#ifdef PNG_X86_SIMD
+#include <immintrin.h>
+#endif // PNG_X86_SIMD
+
+// Scalar kernels, they're specialized by the compiler when bpp is a constant
+static inline void UnfilterSub(uint8_t* row, size_t rowSize, size_t bpp)
+{
+    for (size_t i = bpp; i < rowSize; i++)
+        row[i] += row[i - bpp];
+}
+
+static inline void UnfilterUp(uint8_t* row, const uint8_t* prevRow, size_t rowSize)
+{
+    for (size_t i = 0; i < rowSize; i++)
+        row[i] += prevRow[i];
+}
+
+static inline void UnfilterAverage(uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp)
+{
+    if (!prevRow) {
+        for (size_t i = bpp; i < rowSize; i++)
+            row[i] += row[i - bpp] / 2;
+        return;
+    }
+
+    // The first pixel has no pixel to its left
+    size_t firstPixel = std::min(bpp, rowSize);
+    for (size_t i = 0; i < firstPixel; i++)
+        row[i] += prevRow[i] / 2;
+    for (size_t i = bpp; i < rowSize; i++) {
+        uint32_t raw = row[i - bpp];
+        uint32_t prior = prevRow[i];
+        row[i] += (raw + prior) / 2;
+    }
+}
+
+static inline void UnfilterPaeth(uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp)
+{
+    // With no previous row PAETH is the same as SUB
+    if (!prevRow) {
+        UnfilterSub(row, rowSize, bpp);
+        return;
+    }
+
+    // With no pixel to the left PAETH is the same as UP
+    UnfilterUp(row, prevRow, std::min(bpp, rowSize));
+    for (size_t i = bpp; i < rowSize; i++) {
+        int32_t a = row[i - bpp];
+        int32_t b = prevRow[i];
+        int32_t c = prevRow[i - bpp];
+
+        int32_t p = a + b - c;
+        int32_t pa = abs(p-a);
+        int32_t pb = abs(p-b);
+        int32_t pc = abs(p-c);
+
+        if (pa <= pb && pa <= pc)
+            row[i] += a;
+        else if (pb <= pc)
+            row[i] += b;
+        else
+            row[i] += c;
+    }
+}
+
+// Kernels for rows which have a previous one, rowSize is always a multiple of bpp
+using UnfilterKernel = void(*)(uint8_t* row, const uint8_t* prevRow, size_t rowSize);
+
+template<size_t BPP>
+static void UnfilterSubScalar(uint8_t* row, const uint8_t*, size_t rowSize) { UnfilterSub(row, rowSize, BPP); }
+static void UnfilterUpScalar(uint8_t* row, const uint8_t* prevRow, size_t rowSize) { UnfilterUp(row, prevRow, rowSize); }
+template<size_t BPP>
+static void UnfilterAverageScalar(uint8_t* row, const uint8_t* prevRow, size_t rowSize) { UnfilterAverage(row, prevRow, rowSize, BPP); }
+template<size_t BPP>
+static void UnfilterPaethScalar(uint8_t* row, const uint8_t* prevRow, size_t rowSize) { UnfilterPaeth(row, prevRow, rowSize, BPP); }
+
+#ifdef PNG_X86_SIMD
+// Pixels of 3 and 6 bytes are loaded in pieces, so that no byte past them is touched
+template<size_t BPP>
+PNG_TARGET("sse2") static inline __m128i LoadPixel(const uint8_t* p)
+{
+    if constexpr (BPP == 8) {
+        return _mm_loadl_epi64((const __m128i*)p);
+    } else if constexpr (BPP == 6) {
+        uint32_t lo; uint16_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 2);
+        return _mm_insert_epi16(_mm_cvtsi32_si128((int)lo), hi, 2);
+    } else if constexpr (BPP == 3) {
+        // Assembling the pixel in a register avoids a store-forwarding stall
+        uint16_t lo;
+        memcpy(&lo, p, 2);
+        return _mm_cvtsi32_si128((int)(lo | (uint32_t)p[2] << 16));
+    } else {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return _mm_cvtsi32_si128((int)v);
+    }
+}
+
+template<size_t BPP>
+PNG_TARGET("sse2") static inline void StorePixel(uint8_t* p, __m128i pixel)
+{
+    if constexpr (BPP == 8) {
+        _mm_storel_epi64((__m128i*)p, pixel);
+    } else if constexpr (BPP == 6) {
+        uint32_t lo = (uint32_t)_mm_cvtsi128_si32(pixel);
+        uint16_t hi = (uint16_t)_mm_extract_epi16(pixel, 2);
+        memcpy(p, &lo, 4);
+        memcpy(p + 4, &hi, 2);
+    } else {
+        uint32_t v = (uint32_t)_mm_cvtsi128_si32(pixel);
+        memcpy(p, &v, BPP);
+    }
+}
+
+template<size_t BPP>
+PNG_TARGET("sse2") static void UnfilterSubSSE2(uint8_t* row, const uint8_t*, size_t rowSize)
+{
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i < rowSize; i += BPP) {
+        a = _mm_add_epi8(a, LoadPixel<BPP>(row + i));
+        StorePixel<BPP>(row + i, a);
+    }
+}
+
+PNG_TARGET("sse2") static void UnfilterUpSSE2(uint8_t* row, const uint8_t* prevRow, size_t rowSize)
+{
+    size_t i = 0;
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prevRow + i));
+        _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+    }
+    UnfilterUp(row + i, prevRow + i, rowSize - i);
+}
+
+PNG_TARGET("avx2") static void UnfilterUpAVX2(uint8_t* row, const uint8_t* prevRow, size_t rowSize)
+{
+    size_t i = 0;
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prevRow + i));
+        _mm256_storeu_si256((__m256i*)(row + i), _mm256_add_epi8(x, b));
+    }
+    UnfilterUp(row + i, prevRow + i, rowSize - i);
+}
+
+template<size_t BPP>
+PNG_TARGET("sse2") static void UnfilterAverageSSE2(uint8_t* row, const uint8_t* prevRow, size_t rowSize)
+{
+    // _mm_avg_epu8 rounds up, so the lowest bit of (a ^ b) is subtracted to round down
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i < rowSize; i += BPP) {
+        __m128i b = LoadPixel<BPP>(prevRow + i);
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(LoadPixel<BPP>(row + i), avg);
+        StorePixel<BPP>(row + i, a);
+    }
+}
+
+// Samples are widened to 16 bits, so that p = a + b - c can't overflow
+//   prevRow: c b
+//   row:     a x
+// pa = |p - a| = |b - c|, pb = |p - b| = |a - c|, pc = |p - c| = |(b - c) + (a - c)|
+PNG_TARGET("ssse3") static inline __m128i PaethPredictorSSSE3(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+
+    // Ties are broken in the order a, b, c
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i useA = _mm_cmpeq_epi16(smallest, pa);
+    __m128i useB = _mm_cmpeq_epi16(smallest, pb);
+    __m128i nearest = _mm_or_si128(_mm_and_si128(useB, b), _mm_andnot_si128(useB, c));
+    return _mm_or_si128(_mm_and_si128(useA, a), _mm_andnot_si128(useA, nearest));
+}
+
+PNG_TARGET("avx2") static inline __m256i PaethPredictorAVX2(__m256i a, __m256i b, __m256i c)
+{
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+
+    __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    __m256i useA = _mm256_cmpeq_epi16(smallest, pa);
+    __m256i useB = _mm256_cmpeq_epi16(smallest, pb);
+    __m256i nearest = _mm256_or_si256(_mm256_and_si256(useB, b), _mm256_andnot_si256(useB, c));
+    return _mm256_or_si256(_mm256_and_si256(useA, a), _mm256_andnot_si256(useA, nearest));
+}
+
+template<size_t BPP>
+PNG_TARGET("ssse3") static void UnfilterPaethSSSE3(uint8_t* row, const uint8_t* prevRow, size_t rowSize)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    for (size_t i = 0; i < rowSize; i += BPP) {
+        __m128i b = _mm_unpacklo_epi8(LoadPixel<BPP>(prevRow + i), zero);
+        __m128i x = _mm_unpacklo_epi8(LoadPixel<BPP>(row + i), zero);
+
+        __m128i nearest = PaethPredictorSSSE3(a, b, c);
+
+        // The high byte of each lane stays 0 since there's no carry between bytes
+        a = _mm_add_epi8(x, nearest);
+        StorePixel<BPP>(row + i, _mm_packus_epi16(a, a));
+        c = b;
+    }
+}
+#endif // PNG_X86_SIMD
+
+struct UnfilterKernels
+{
+    // Indexed by bpp, bpp of 5 and 7 can't be found in a png image
+    UnfilterKernel Sub[9]{};
+    UnfilterKernel Up = UnfilterUpScalar;
+    UnfilterKernel Average[9]{};
+    UnfilterKernel Paeth[9]{};
+
+    template<size_t BPP>
+    void SetScalar()
+    {
+        Sub[BPP] = UnfilterSubScalar<BPP>;
+        Average[BPP] = UnfilterAverageScalar<BPP>;
+        Paeth[BPP] = UnfilterPaethScalar<BPP>;
+    }
+
+#ifdef PNG_X86_SIMD
+    template<size_t BPP>
+    void SetSIMD(const PNG::CPU::Features& features)
+    {
+        if (features.SSE2) {
+            Sub[BPP] = UnfilterSubSSE2<BPP>;
+            Average[BPP] = UnfilterAverageSSE2<BPP>;
+        }
+        if (features.SSSE3)
+            Paeth[BPP] = UnfilterPaethSSSE3<BPP>;
+    }
+#endif // PNG_X86_SIMD
+};
+
+// Picks the fastest kernels supported by the CPU
+// Pixels of 1 and 2 bytes are faster with scalar code, since each one depends on the previous
+static UnfilterKernels SelectUnfilterKernels()
+{
+    UnfilterKernels kernels;
+    kernels.SetScalar<1>();
+    kernels.SetScalar<2>();
+    kernels.SetScalar<3>();
+    kernels.SetScalar<4>();
+    kernels.SetScalar<6>();
+    kernels.SetScalar<8>();
+
+#ifdef PNG_X86_SIMD
+    const auto& features = PNG::CPU::GetFeatures();
+    kernels.SetSIMD<3>(features);
+    kernels.SetSIMD<4>(features);
+    kernels.SetSIMD<6>(features);
+    kernels.SetSIMD<8>(features);
+
+    if (features.AVX2)
+        kernels.Up = UnfilterUpAVX2;
+    else if (features.SSE2)
+        kernels.Up = UnfilterUpSSE2;
+#endif // PNG_X86_SIMD
+
+    return kernels;
+}
+
+PNG::Result PNG::AdaptiveFiltering::UnfilterRow(uint8_t filterType, uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp)
+{
+    static const UnfilterKernels kernels = SelectUnfilterKernels();
+    // Kernels expect whole pixels
+    const bool hasKernel = bpp < 9 && kernels.Sub[bpp] && rowSize % bpp == 0;
+
+    switch (filterType) {
+    case FilterType::NONE:
+        break;
+    case FilterType::SUB:
+        if (hasKernel)
+            kernels.Sub[bpp](row, prevRow, rowSize);
+        else
+            UnfilterSub(row, rowSize, bpp);
+        break;
+    case FilterType::UP:
+        if (prevRow)
+            kernels.Up(row, prevRow, rowSize);
+        break;
+    case FilterType::AVERAGE:
+        if (hasKernel && prevRow)
+            kernels.Average[bpp](row, prevRow, rowSize);
+        else
+            UnfilterAverage(row, prevRow, rowSize, bpp);
+        break;
+    case FilterType::PAETH:
+        // With no previous row PAETH is the same as SUB
+        if (hasKernel)
+            (prevRow ? kernels.Paeth[bpp] : kernels.Sub[bpp])(row, prevRow, rowSize);
+        else
+            UnfilterPaeth(row, prevRow, rowSize, bpp);
+        break;
+    default:
+        return Result::UnknownFilterType;
+    }
+
+    return Result::OK;
+}
+
+void PNG::UnpackPixels(const uint8_t* in, uint8_t* out, size_t width, size_t pixelBits)
+{
+    // This assert should never fail
+    PNG_ASSERT(pixelBits < 8, "Unpacking a pixel which spans more than 1 byte.");
+    const size_t pixelMask = (1 << pixelBits) - 1;
+    for (size_t x = 0; x < width; x++) {
+        size_t pixelStart = pixelBits * x;
+        size_t pIndex = pixelStart >> 3; // pixelStart / 8
+        size_t pShift = 8 - (pixelStart & 7) - pixelBits; // pixelStart % 8
+        size_t byte = (in[pIndex] >> pShift) & pixelMask;
+        out[x] = (uint8_t)byte;
+    }
+}
+
 PNG::Result PNG::AdaptiveFiltering::UnfilterPixels(size_t width, size_t height, size_t pixelBits, IStream& in, std::vector<uint8_t>& _out)
 {
     size_t bpp = BitsToBytes(pixelBits);
@@ -26,61 +359,14 @@ PNG::Result PNG::AdaptiveFiltering::UnfilterPixels(size_t width, size_t height,
         uint8_t filterType;
         PNG_RETURN_IF_NOT_OK(in.ReadU8, filterType);
         PNG_RETURN_IF_NOT_OK(in.ReadBuffer, unf[y], packedRowSize);
-        
-        // for (size_t i = 0; i < line.size(); i++)
-        //     std::cout << (size_t)line[i] << ", ";
-        // std::cout << std::endl;
-
-        switch (filterType) {
-        case FilterType::NONE:
-            // If pixels are not packed unf == out
-            // Otherwise out is filled a the end of this switch
-            // memcpy(unf[y], &line[1], rowSize);
-            break;
-        case FilterType::SUB:
-            for (size_t i = 0; i < packedRowSize; i++) {
-                uint8_t raw = i >= bpp ?
-                    unf[y][i - bpp] : 0;
-                unf[y][i] += raw;
-            }
-            break;
-        case FilterType::UP:
-            for (size_t i = 0; i < packedRowSize; i++) {
-                uint8_t prior = y > 0 ?
-                    unf[y-1][i] : 0;
-                unf[y][i] += prior;
-            }
-            break;
-        case FilterType::AVERAGE:
-            for (size_t i = 0; i < packedRowSize; i++) {
-                uint32_t raw = i >= bpp ? unf[y][i - bpp] : 0;
-                uint32_t prior = y > 0 ? unf[y-1][i] : 0;
-                unf[y][i] += (raw + prior) / 2;
-            }
-            break;
-        case FilterType::PAETH:
-            for (size_t i = 0; i < packedRowSize; i++) {
-                int32_t a = i >= bpp ? unf[y][i - bpp] : 0;
-                int32_t b = y > 0 ? unf[y-1][i] : 0;
-                int32_t c = y > 0 && i >= bpp ? unf[y-1][i - bpp] : 0;
-
-                int32_t p = a + b - c;
-                int32_t pa = abs(p-a);
-                int32_t pb = abs(p-b);
-                int32_t pc = abs(p-c);
-
-                if (pa <= pb && pa <= pc)
-                    unf[y][i] += a;
-                else if (pb <= pc)
-                    unf[y][i] += b;
-                else
-                    unf[y][i] += c;
-            }
-            break;
-        default:
+
+        // If pixels are not packed unf == out
+        // Otherwise out is filled a the end of this loop
+        auto ures = UnfilterRow(filterType, unf[y], y > 0 ? unf[y-1] : nullptr, packedRowSize, bpp);
+        if (ures != Result::OK) {
             PNG_LDEBUGF("PNG::AdaptiveFiltering::UnfilterPixels Unknown filter type {} in image {}x{} (pb={},bpp={},sl={},y={}).",
                 filterType, width, height, pixelBits, bpp, packedRowSize+1, y);
-            return Result::UnknownFilterType;
+            return ures;
         }
 
         // If pixels are packed unpack them
@@ -88,214 +374,429 @@ PNG::Result PNG::AdaptiveFiltering::UnfilterPixels(size_t width, size_t height,
             // This assert should never fail
             PNG_ASSERT(bpp == 1, "Unpacking a pixel which spans more than 1 byte.");
             // Here unf != out
-            const size_t pixelMask = (1 << pixelBits) - 1;
-            for (size_t x = 0; x < width; x++) {
-                size_t pixelStart = pixelBits * x;
-                size_t pIndex = pixelStart >> 3; // pixelStart / 8
-                size_t pShift = 8 - (pixelStart & 7) - pixelBits; // pixelStart % 8
-                size_t byte = (unf[y][pIndex] >> pShift) & pixelMask;
-                out[y][x] = (uint8_t)byte;
-            }
+            UnpackPixels(unf[y], out[y], width, pixelBits);
         }
     }
 
     return Result::OK;
 }
 
-PNG::Result PNG::AdaptiveFiltering::FilterPixels(size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out)
+void PNG::PackPixels(const uint8_t* in, uint8_t* out, size_t width, size_t pixelBits)
+{
+    // This assert should never fail
+    PNG_ASSERT(pixelBits < 8, "Packing a pixel which spans more than 1 byte.");
+    const size_t pixelMask = (1 << pixelBits) - 1;
+    for (size_t x = 0; x < width; x++) {
+        // pIndex <= x, so in[x] is read before being overwritten when packing in place
+        uint8_t sample = in[x] & pixelMask;
+
+        size_t pixelStart = pixelBits * x;
+        size_t pIndex = pixelStart >> 3; // pixelStart / 8
+        size_t pShift = 8 - (pixelStart & 7) - pixelBits; // pixelStart % 8
+        if ((pixelStart & 7) == 0)
+            out[pIndex] = 0;
+        out[pIndex] |= sample << pShift;
+    }
+}
+
+// Scalar filters of the bytes in [start, rowSize), so that vector kernels can hand them both ends of a row
+static inline void FilterNone(const uint8_t* row, size_t start, size_t rowSize, uint8_t* out)
+{
+    memcpy(out + start, row + start, rowSize - start);
+}
+
+static inline void FilterSub(const uint8_t* row, size_t start, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    size_t i = start;
+    for (; i < std::min(bpp, rowSize); i++)
+        out[i] = row[i];
+    for (; i < rowSize; i++)
+        out[i] = row[i] - row[i - bpp];
+}
+
+static inline void FilterUp(const uint8_t* row, const uint8_t* prevRow, size_t start, size_t rowSize, uint8_t* out)
+{
+    if (!prevRow) {
+        FilterNone(row, start, rowSize, out);
+        return;
+    }
+
+    for (size_t i = start; i < rowSize; i++)
+        out[i] = row[i] - prevRow[i];
+}
+
+static inline void FilterAverage(const uint8_t* row, const uint8_t* prevRow, size_t start, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    for (size_t i = start; i < rowSize; i++) {
+        uint32_t raw = i >= bpp ? row[i - bpp] : 0;
+        uint32_t prior = prevRow ? prevRow[i] : 0;
+        out[i] = row[i] - (uint8_t)((raw + prior) / 2);
+    }
+}
+
+static inline void FilterPaeth(const uint8_t* row, const uint8_t* prevRow, size_t start, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    // With no previous row PAETH is the same as SUB
+    if (!prevRow) {
+        FilterSub(row, start, rowSize, bpp, out);
+        return;
+    }
+
+    for (size_t i = start; i < rowSize; i++) {
+        int32_t a = i >= bpp ? row[i - bpp] : 0;
+        int32_t b = prevRow[i];
+        int32_t c = i >= bpp ? prevRow[i - bpp] : 0;
+
+        int32_t p = a + b - c;
+        int32_t pa = abs(p-a);
+        int32_t pb = abs(p-b);
+        int32_t pc = abs(p-c);
+
+        out[i] = row[i];
+        if (pa <= pb && pa <= pc)
+            out[i] -= a;
+        else if (pb <= pc)
+            out[i] -= b;
+        else
+            out[i] -= c;
+    }
+}
+
+// Filtered bytes are taken as signed, so that small negative differences score as low as small positive ones
+static inline size_t ScoreRow(const uint8_t* row, size_t rowSize)
+{
+    size_t score = 0;
+    for (size_t i = 0; i < rowSize; i++)
+        score += row[i] < 128 ? row[i] : 256 - row[i];
+    return score;
+}
+
+using FilterKernel = void(*)(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out);
+using ScoreKernel = size_t(*)(const uint8_t* row, size_t rowSize);
+
+static void FilterNoneScalar(const uint8_t* row, const uint8_t*, size_t rowSize, size_t, uint8_t* out) { FilterNone(row, 0, rowSize, out); }
+static void FilterSubScalar(const uint8_t* row, const uint8_t*, size_t rowSize, size_t bpp, uint8_t* out) { FilterSub(row, 0, rowSize, bpp, out); }
+static void FilterUpScalar(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t, uint8_t* out) { FilterUp(row, prevRow, 0, rowSize, out); }
+static void FilterAverageScalar(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out) { FilterAverage(row, prevRow, 0, rowSize, bpp, out); }
+static void FilterPaethScalar(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out) { FilterPaeth(row, prevRow, 0, rowSize, bpp, out); }
+
+#ifdef PNG_X86_SIMD
+// Filtering only reads unfiltered bytes, so unlike unfiltering whole vectors are filtered at once for any bpp
+// The first pixel and the bytes which don't fill a vector are left to scalar code, prevRow is never null
+PNG_TARGET("sse2") static void FilterSubSSE2(const uint8_t* row, const uint8_t*, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    size_t i = std::min(bpp, rowSize);
+    FilterSub(row, 0, i, bpp, out);
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, a));
+    }
+    FilterSub(row, i, rowSize, bpp, out);
+}
+
+PNG_TARGET("avx2") static void FilterSubAVX2(const uint8_t* row, const uint8_t*, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    size_t i = std::min(bpp, rowSize);
+    FilterSub(row, 0, i, bpp, out);
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, a));
+    }
+    FilterSub(row, i, rowSize, bpp, out);
+}
+
+PNG_TARGET("sse2") static void FilterUpSSE2(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t, uint8_t* out)
+{
+    size_t i = 0;
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prevRow + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, b));
+    }
+    FilterUp(row, prevRow, i, rowSize, out);
+}
+
+PNG_TARGET("avx2") static void FilterUpAVX2(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t, uint8_t* out)
+{
+    size_t i = 0;
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prevRow + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, b));
+    }
+    FilterUp(row, prevRow, i, rowSize, out);
+}
+
+PNG_TARGET("sse2") static void FilterAverageSSE2(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    // See UnfilterAverageSSE2()
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = std::min(bpp, rowSize);
+    FilterAverage(row, prevRow, 0, i, bpp, out);
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prevRow + i));
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, avg));
+    }
+    FilterAverage(row, prevRow, i, rowSize, bpp, out);
+}
+
+PNG_TARGET("avx2") static void FilterAverageAVX2(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = std::min(bpp, rowSize);
+    FilterAverage(row, prevRow, 0, i, bpp, out);
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prevRow + i));
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, avg));
+    }
+    FilterAverage(row, prevRow, i, rowSize, bpp, out);
+}
+
+PNG_TARGET("ssse3") static void FilterPaethSSSE3(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = std::min(bpp, rowSize);
+    FilterPaeth(row, prevRow, 0, i, bpp, out);
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prevRow + i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(prevRow + i - bpp));
+
+        __m128i lo = PaethPredictorSSSE3(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i hi = PaethPredictorSSSE3(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+    }
+    FilterPaeth(row, prevRow, i, rowSize, bpp, out);
+}
+
+PNG_TARGET("avx2") static void FilterPaethAVX2(const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out)
+{
+    // Unpacking and packing both work within 128-bit lanes, so bytes end up in their original order
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = std::min(bpp, rowSize);
+    FilterPaeth(row, prevRow, 0, i, bpp, out);
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prevRow + i));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(prevRow + i - bpp));
+
+        __m256i lo = PaethPredictorAVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+        __m256i hi = PaethPredictorAVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi)));
+    }
+    FilterPaeth(row, prevRow, i, rowSize, bpp, out);
+}
+
+// |v| of a signed byte is min(v, -v) as an unsigned one, psadbw against 0 then sums 8 bytes at a time
+PNG_TARGET("sse2") static size_t ScoreRowSSE2(const uint8_t* row, size_t rowSize)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    size_t i = 0;
+    for (; i + 16 <= rowSize; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i abs = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(abs, zero));
+    }
+
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)sums, sum);
+    return (size_t)(sums[0] + sums[1]) + ScoreRow(row + i, rowSize - i);
+}
+
+PNG_TARGET("avx2") static size_t ScoreRowAVX2(const uint8_t* row, size_t rowSize)
 {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    size_t i = 0;
+    for (; i + 32 <= rowSize; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i abs = _mm256_min_epu8(v, _mm256_sub_epi8(zero, v));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(abs, zero));
+    }
+
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i*)sums, sum);
+    return (size_t)(sums[0] + sums[1] + sums[2] + sums[3]) + ScoreRow(row + i, rowSize - i);
+}
+#endif // PNG_X86_SIMD
+
+struct FilterKernels
+{
+    // Indexed by filter type
+    FilterKernel Filter[5] = {
+        FilterNoneScalar, FilterSubScalar, FilterUpScalar, FilterAverageScalar, FilterPaethScalar
+    };
+    ScoreKernel Score = ScoreRow;
+};
+
+// Picks the fastest kernels supported by the CPU, they're only used for rows which have a previous one
+static FilterKernels SelectFilterKernels()
+{
+    FilterKernels kernels;
+
+#ifdef PNG_X86_SIMD
+    const auto& features = PNG::CPU::GetFeatures();
+    if (features.AVX2) {
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::SUB] = FilterSubAVX2;
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::UP] = FilterUpAVX2;
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::AVERAGE] = FilterAverageAVX2;
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::PAETH] = FilterPaethAVX2;
+        kernels.Score = ScoreRowAVX2;
+    } else if (features.SSE2) {
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::SUB] = FilterSubSSE2;
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::UP] = FilterUpSSE2;
+        kernels.Filter[PNG::AdaptiveFiltering::FilterType::AVERAGE] = FilterAverageSSE2;
+        if (features.SSSE3)
+            kernels.Filter[PNG::AdaptiveFiltering::FilterType::PAETH] = FilterPaethSSSE3;
+        kernels.Score = ScoreRowSSE2;
+    }
+#endif // PNG_X86_SIMD
+
+    return kernels;
+}
+
+uint8_t PNG::AdaptiveFiltering::FilterRow(CompressionLevel clevel, const uint8_t* row, const uint8_t* prevRow, size_t rowSize, size_t bpp, uint8_t* out, uint8_t* fil)
+{
+    // CompressionLevel::NoCompression does not filter
     // CompressionLevel::Default is the same as CompressionLevel::BestSpeed
     // CompressionLevel::BestSpeed uses a fixed filter
     // CompressionLevel::BestSize finds the best filter
     bool fixedFilter; // FilterType::PAETH
-    bool optimize;
     switch (clevel) {
     case CompressionLevel::NoCompression:
-        fixedFilter = false;
-        optimize = false;
-        break;
+        memcpy(out, row, rowSize);
+        return FilterType::NONE;
     case CompressionLevel::Default:
     case CompressionLevel::BestSpeed:
         fixedFilter = true;
-        optimize = true;
         break;
     case CompressionLevel::BestSize:
         fixedFilter = false;
-        optimize = true;
         break;
     default:
-        PNG_UNREACHABLEF("PNG::AdaptiveFiltering::FilterPixels Missing case for CompressionLevel {}.", (int)clevel);
+        PNG_UNREACHABLEF("PNG::AdaptiveFiltering::FilterRow Missing case for CompressionLevel {}.", (int)clevel);
     }
 
-    size_t bpp = BitsToBytes(pixelBits);
-    size_t rowSize = width*bpp;
+    static const FilterKernels simdKernels = SelectFilterKernels();
+    static const FilterKernels scalarKernels;
+    const FilterKernels& kernels = prevRow ? simdKernels : scalarKernels;
+
+    // Rows with no previous one only use filters which don't read it, so that they can also start restart segments
+    // With no previous row PAETH is the same as SUB
+    if (fixedFilter) {
+        kernels.Filter[FilterType::PAETH](row, prevRow, rowSize, bpp, out);
+        return prevRow ? FilterType::PAETH : FilterType::SUB;
+    }
+
+    // Each filter is applied to whichever of out and fil doesn't hold the best-scoring one so far
+    // Scores are calculated following http://www.libpng.org/pub/png/spec/1.2/PNG-Encoders.html#E.Filter-selection
+    uint8_t* best = out;
+    uint8_t* current = fil;
+    uint8_t bestFilter = FilterType::NONE;
+    size_t lowestScore = SIZE_MAX;
+
+    const uint8_t lastFilter = prevRow ? FilterType::PAETH : FilterType::SUB;
+    for (uint8_t filterType = FilterType::NONE; filterType <= lastFilter; filterType++) {
+        kernels.Filter[filterType](row, prevRow, rowSize, bpp, current);
+        size_t currentScore = kernels.Score(current, rowSize);
+        if (currentScore < lowestScore) {
+            std::swap(best, current);
+            bestFilter = filterType;
+            lowestScore = currentScore;
+        }
+    }
+
+    if (best != out)
+        memcpy(out, best, rowSize);
+    return bestFilter;
+}
 
-    std::vector<uint8_t> line(rowSize);
+// Calls fn(i) for each i in [0, count), in parallel if requested
+template<typename Fn>
+static void ForEachRow(bool parallel, size_t count, Fn fn)
+{
+    PNG::Utils::Iota<size_t> rows(count);
+    if (parallel)
+        std::for_each(std::execution::par_unseq, rows.begin(), rows.end(), fn);
+    else
+        std::for_each(rows.begin(), rows.end(), fn);
+}
 
+PNG::Result PNG::AdaptiveFiltering::FilterPixels(size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out, bool parallel, size_t restartInterval)
+{
+    // Parallel filtering works on bands of at least this many bytes of raw pixels or this many rows
+    const size_t PARALLEL_BAND_BYTES = 262144; // 256KiB
+    const size_t PARALLEL_BAND_MIN_ROWS = 16;
+
+    size_t bpp = BitsToBytes(pixelBits);
+    size_t rowSize = width*bpp;
     size_t packedRowSize = BitsToBytes(width*pixelBits);
-    // unf is valid only if optimize is true
-    std::vector<uint8_t> _unf(optimize * packedRowSize * (height+1));
-    ArrayView2D<uint8_t> unf(_unf.data(), 0, packedRowSize);
+    // Filtered rows start with their filter type
+    size_t filteredRowSize = packedRowSize + 1;
 
-    // fil is used to calculate the current filtered line
-    // The best-scoring one will be copied into line and then sent at the end
-    // Scores are calculated following http://www.libpng.org/pub/png/spec/1.2/PNG-Encoders.html#E.Filter-selection
-    uint8_t* fil = optimize ? unf[height] : nullptr;
+    size_t bandRows = parallel ? std::max(PARALLEL_BAND_BYTES / std::max<size_t>(rowSize, 1), PARALLEL_BAND_MIN_ROWS) : 1;
+    bandRows = std::min(bandRows, height);
 
-    for (size_t y = 0; y < height; y++) {
-        PNG_RETURN_IF_NOT_OK(in.ReadVector, line);
+    // Filters only need the previous unfiltered row, so all rows of a band can be filtered at the same time
+    // The first line holds the last row of the previous band
+    std::vector<uint8_t> _lines((bandRows + 1) * rowSize);
+    std::vector<uint8_t> _filtered(bandRows * filteredRowSize);
+    std::vector<uint8_t> _fil(clevel == CompressionLevel::BestSize ? bandRows * packedRowSize : 0);
+    ArrayView2D<uint8_t> lines(_lines.data(), 0, rowSize);
+    ArrayView2D<uint8_t> filtered(_filtered.data(), 0, filteredRowSize);
+    ArrayView2D<uint8_t> fil(_fil.data(), 0, packedRowSize);
+
+    for (size_t bandY = 0; bandY < height; bandY += bandRows) {
+        size_t rows = std::min(bandRows, height - bandY);
+        PNG_RETURN_IF_NOT_OK(in.ReadBuffer, lines[1], rows * rowSize);
 
         // If pixels should be packed, pack them
+        // All rows are packed before filtering, since each one is also the previous row of another
         if (pixelBits < 8) {
             // This assert should never fail
             PNG_ASSERT(bpp == 1, "Packing a pixel which spans more than 1 byte.");
-            const size_t pixelMask = (1 << pixelBits) - 1;
-            for (size_t x = 0; x < width; x++) {
-                uint8_t sample = line[x] & pixelMask;
-                line[x] = 0;
-
-                size_t pixelStart = pixelBits * x;
-                size_t pIndex = pixelStart >> 3; // pixelStart / 8
-                size_t pShift = 8 - (pixelStart & 7) - pixelBits; // pixelStart % 8
-                line[pIndex] |= sample << pShift;
-            }
-
-            if (!optimize) {
-                PNG_RETURN_IF_NOT_OK(out.WriteU8, 0);
-                PNG_RETURN_IF_NOT_OK(out.WriteBuffer, line.data(), packedRowSize);
-            }
-        } else {
+            ForEachRow(parallel, rows, [&lines, width, pixelBits](size_t i) {
+                PackPixels(lines[i+1], lines[i+1], width, pixelBits);
+            });
+        } else
             PNG_ASSERT(packedRowSize == rowSize, "PNG::AdaptiveFiltering::FilterPixels Packed row check failed.");
-            if (!optimize) {
-                PNG_RETURN_IF_NOT_OK(out.WriteU8, 0);
-                PNG_RETURN_IF_NOT_OK(out.WriteVector, line);
-            }
-        }
-
-        if (optimize) {
-            memcpy(unf[y], line.data(), packedRowSize);
-            // line from this point contains the best scoring filter
-            uint32_t bestFilter = FilterType::NONE;
-            
-            if (fixedFilter) {
-                bestFilter = FilterType::PAETH;
-                // FilterType::PAETH
-                for (size_t i = 0; i < packedRowSize; i++) {
-                    int32_t a = i >= bpp ? unf[y][i - bpp] : 0;
-                    int32_t b = y > 0 ? unf[y-1][i] : 0;
-                    int32_t c = y > 0 && i >= bpp ? unf[y-1][i - bpp] : 0;
-
-                    int32_t p = a + b - c;
-                    int32_t pa = abs(p-a);
-                    int32_t pb = abs(p-b);
-                    int32_t pc = abs(p-c);
-
-                    line[i] = unf[y][i];
-                    if (pa <= pb && pa <= pc)
-                        line[i] -= a;
-                    else if (pb <= pc)
-                        line[i] -= b;
-                    else
-                        line[i] -= c;
-                }
-            } else {
-                size_t lowestScore = 0;
-                size_t currentScore;
-
-                // FilterType::NONE
-                for (size_t i = 0; i < packedRowSize; i++)
-                    lowestScore += line[i];
-
-                // FilterType::SUB
-                currentScore = 0;
-                for (size_t i = 0; i < packedRowSize; i++) {
-                    uint8_t raw = i >= bpp ?
-                        unf[y][i - bpp] : 0;
-                    fil[i] = unf[y][i] - raw;
-                    currentScore += fil[i];
-                }
-
-                if (currentScore < lowestScore) {
-                    memcpy(line.data(), fil, packedRowSize);
-                    bestFilter = FilterType::SUB;
-                    lowestScore = currentScore;
-                }
-
-                // FilterType::UP
-                currentScore = 0;
-                for (size_t i = 0; i < packedRowSize; i++) {
-                    uint8_t prior = y > 0 ?
-                        unf[y-1][i] : 0;
-                    fil[i] = unf[y][i] - prior;
-                    currentScore += fil[i];
-                }
-
-                if (currentScore < lowestScore) {
-                    memcpy(line.data(), fil, packedRowSize);
-                    bestFilter = FilterType::UP;
-                    lowestScore = currentScore;
-                }
-
-                // FilterType::AVERAGE
-                currentScore = 0;
-                for (size_t i = 0; i < packedRowSize; i++) {
-                    uint32_t raw = i >= bpp ? unf[y][i - bpp] : 0;
-                    uint32_t prior = y > 0 ? unf[y-1][i] : 0;
-                    fil[i] += unf[y][i] - (raw + prior) / 2;
-                    currentScore += fil[i];
-                }
-
-                if (currentScore < lowestScore) {
-                    memcpy(line.data(), fil, packedRowSize);
-                    bestFilter = FilterType::AVERAGE;
-                    lowestScore = currentScore;
-                }
-
-                // FilterType::PAETH
-                currentScore = 0;
-                for (size_t i = 0; i < packedRowSize; i++) {
-                    int32_t a = i >= bpp ? unf[y][i - bpp] : 0;
-                    int32_t b = y > 0 ? unf[y-1][i] : 0;
-                    int32_t c = y > 0 && i >= bpp ? unf[y-1][i - bpp] : 0;
-
-                    int32_t p = a + b - c;
-                    int32_t pa = abs(p-a);
-                    int32_t pb = abs(p-b);
-                    int32_t pc = abs(p-c);
-
-                    fil[i] = unf[y][i];
-                    if (pa <= pb && pa <= pc)
-                        fil[i] -= a;
-                    else if (pb <= pc)
-                        fil[i] -= b;
-                    else
-                        fil[i] -= c;
-                    currentScore += fil[i];
-                }
-
-                if (currentScore < lowestScore) {
-                    memcpy(line.data(), fil, packedRowSize);
-                    bestFilter = FilterType::PAETH;
-                    lowestScore = currentScore;
-                }
-            }
-
-            // Send filtered line
-            PNG_RETURN_IF_NOT_OK(out.WriteU8, bestFilter);
-            PNG_RETURN_IF_NOT_OK(out.WriteBuffer, line.data(), packedRowSize);
-        }
 
+        // This is safe to do in parallel because threads do not cross scanlines when writing.
+        ForEachRow(parallel, rows, [&lines, &filtered, &fil, bandY, packedRowSize, bpp, clevel, restartInterval](size_t i) {
+            size_t y = bandY + i;
+            bool restarts = y == 0 || (restartInterval > 0 && y % restartInterval == 0);
+            const uint8_t* prevLine = restarts ? nullptr : lines[i];
+            uint8_t* filteredLine = filtered[i];
+            filteredLine[0] = FilterRow(clevel, lines[i+1], prevLine, packedRowSize, bpp,
+                filteredLine + 1, clevel == CompressionLevel::BestSize ? fil[i] : nullptr);
+        });
+
+        // Send filtered lines
+        PNG_RETURN_IF_NOT_OK(out.WriteBuffer, filtered[0], rows * filteredRowSize);
         PNG_RETURN_IF_NOT_OK(out.Flush);
+
+        memcpy(lines[0], lines[rows], rowSize);
     }
 
     return Result::OK;
 }
 
-PNG::Result PNG::FilterPixels(uint8_t method, size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out)
+PNG::Result PNG::FilterPixels(uint8_t method, size_t width, size_t height, size_t pixelBits, CompressionLevel clevel, IStream& in, OStream& out, bool parallel, size_t restartInterval)
 {
     switch (method) {
     case FilterMethod::ADAPTIVE_FILTERING:
-        return AdaptiveFiltering::FilterPixels(width, height, pixelBits, clevel, in, out);
+        return AdaptiveFiltering::FilterPixels(width, height, pixelBits, clevel, in, out, parallel, restartInterval);
     default:
         return Result::UnknownFilterMethod;
     }
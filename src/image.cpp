@@ -1,15 +1,40 @@
 #include "png/image.h"
 
 #include "png/chunk.h"
+#include "png/cpu.h"
+#include "png/crc.h"
 #include "png/filter.h"
+#include "png/scanline.h"
 #include "png/utils.h"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <execution>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <unordered_set>
 
+#ifdef PNG_X86_SIMD
+#include <immintrin.h>
+#endif // PNG_X86_SIMD
+
+// Multi-threaded stages run together, so they can share a lock-free fixed-size ring buffer
+// Single-threaded stages run one after the other, so the pipe must be able to hold the whole output of a stage
+// A capacity of 0 means that the pipe is unbounded
+static std::unique_ptr<PNG::PipelineStream> CreatePipelineStream(size_t capacity)
+{
+    if (capacity > 0)
+        // Ring buffers round their capacity up to a power of 2, rounding down keeps the pipe within its budget
+        return std::make_unique<PNG::RingBufferStream>(std::bit_floor(capacity));
+    return std::make_unique<PNG::PipeStream>();
+}
+
 // This is a macro since both Image::ApplyDithering and Image::WriteDitheredRawPixels need it
 // https://en.wikipedia.org/wiki/Floyd–Steinberg_dithering
 // https://en.wikipedia.org/wiki/Atkinson_dithering
@@ -94,7 +119,7 @@
             default: \
                 PNG_UNREACHABLEF("PNG_IMAGE_VIEW_AT WrapMode case missing ({}) when out of bounds left.", (int)WrapMode); \
             } \
-        } else if (x + dx > Width) { \
+        } else if (x + dx >= Width) { \
             /* Out of bounds right */ \
             switch (WrapMode) { \
             case PNG::WrapMode::None: \
@@ -110,6 +135,22 @@
         return &Data[x+dx]; \
     }
 
+PNG::ImageRegion PNG::ImageRegion::Resolve(const ImageHeader& ihdr) const
+{
+    if (IsEmpty())
+        return { 0, 0, ihdr.Width, ihdr.Height };
+    return *this;
+}
+
+PNG::Result PNG::ImageRegion::Validate(const ImageHeader& ihdr) const
+{
+    if (IsEmpty())
+        return Result::OK;
+    if ((uint64_t)X + Width > ihdr.Width || (uint64_t)Y + Height > ihdr.Height)
+        return Result::InvalidImageRegion;
+    return Result::OK;
+}
+
 PNG::Result PNG::ExportSettings::Validate() const
 {
     if (IDATSize == 0)
@@ -138,6 +179,9 @@ PNG::Result PNG::ExportSettings::Validate() const
         return Result::UnknownInterlaceMethod;
     }
 
+    if (RestartInterval > 0 && InterlaceMethod != InterlaceMethod::NONE)
+        return Result::UnsupportedInterlaceMethod;
+
     return Result::OK;
 }
 
@@ -466,90 +510,340 @@ void PNG::Image::SetSize(size_t width, size_t height)
 PNG::ConstImageRowView PNG::Image::GetRow(size_t y, int64_t dy, WrapMode wrapMode) const { PNG_IMAGE_GET_ROW(ConstImageRowView) }
 PNG::ImageRowView PNG::Image::GetRow(size_t y, int64_t dy, WrapMode wrapMode) { PNG_IMAGE_GET_ROW(ImageRowView) }
 
-PNG::Result PNG::Image::LoadRawPixels(uint8_t colorType, size_t bitDepth, const Palette_T* palette, const std::vector<uint8_t>& in)
+// Maps each value an unpacked sample can take to its color channel
+// Samples of less than 16 bits use a 256-entry table, whose indices are masked like bytes of unpacked pixels
+template<size_t BIT_DEPTH>
+static const float* GetSampleTable()
+{
+    static const std::vector<float> table = [] {
+        const uint32_t MAX_SAMPLE_VALUE = ((uint32_t)1 << BIT_DEPTH) - 1;
+        std::vector<float> values(BIT_DEPTH == 16 ? 65536 : 256);
+        for (size_t i = 0; i < values.size(); i++)
+            values[i] = (i & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
+        return values;
+    }();
+    return table.data();
+}
+
+template<size_t BIT_DEPTH>
+static inline size_t ReadSample(const uint8_t* in)
+{
+    if constexpr (BIT_DEPTH == 16)
+        return ((size_t)in[0] << 8) | in[1];
+    else
+        return in[0];
+}
+
+// Non-palette color types, whose samples are all channels of the color
+template<uint8_t COLOR_TYPE>
+constexpr size_t SAMPLES_OF =
+    COLOR_TYPE == PNG::ColorType::RGBA ? 4 :
+    COLOR_TYPE == PNG::ColorType::RGB ? 3 :
+    COLOR_TYPE == PNG::ColorType::GRAYSCALE_ALPHA ? 2 : 1;
+
+using LoadRawRowFn = void(*)(const uint8_t* in, size_t width, PNG::Color* out);
+
+template<uint8_t COLOR_TYPE, size_t BIT_DEPTH>
+static void LoadRawRowScalar(const uint8_t* in, size_t width, PNG::Color* out)
+{
+    using namespace PNG;
+
+    constexpr size_t SAMPLE_SIZE = BIT_DEPTH == 16 ? 2 : 1;
+    constexpr size_t PIXEL_SIZE = SAMPLES_OF<COLOR_TYPE> * SAMPLE_SIZE;
+
+    const float* table = GetSampleTable<BIT_DEPTH>();
+    for (size_t x = 0; x < width; x++) {
+        const uint8_t* rawPixel = &in[x * PIXEL_SIZE];
+        auto sample = [table, rawPixel](size_t j) { return table[ReadSample<BIT_DEPTH>(&rawPixel[j * SAMPLE_SIZE])]; };
+        if constexpr (COLOR_TYPE == ColorType::GRAYSCALE) {
+            float gray = sample(0);
+            out[x] = Color(gray, gray, gray, 1.0f);
+        } else if constexpr (COLOR_TYPE == ColorType::RGB) {
+            out[x] = Color(sample(0), sample(1), sample(2), 1.0f);
+        } else if constexpr (COLOR_TYPE == ColorType::GRAYSCALE_ALPHA) {
+            float gray = sample(0);
+            out[x] = Color(gray, gray, gray, sample(1));
+        } else {
+            out[x] = Color(sample(0), sample(1), sample(2), sample(3));
+        }
+    }
+}
+
+#ifdef PNG_X86_SIMD
+// Each byte is widened to a float and divided like the scalar code does, so both give the same colors
+PNG_TARGET("sse4.1") static void LoadRawRowRGBA8SSE41(const uint8_t* in, size_t width, PNG::Color* out)
+{
+    static_assert(sizeof(PNG::Color) == 4 * sizeof(float), "Colors must be made of 4 packed floats.");
+
+    const __m128 maxValue = _mm_set1_ps(255.0f);
+    for (size_t x = 0; x < width; x++) {
+        __m128i rawPixel = _mm_cvtsi32_si128(*(const int32_t*)&in[x * 4]);
+        __m128 color = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(rawPixel)), maxValue);
+        _mm_storeu_ps((float*)&out[x], color);
+    }
+}
+
+PNG_TARGET("avx2") static void LoadRawRowRGBA8AVX2(const uint8_t* in, size_t width, PNG::Color* out)
+{
+    const __m256 maxValue = _mm256_set1_ps(255.0f);
+    size_t x = 0;
+    for (; x + 2 <= width; x += 2) {
+        __m128i rawPixels = _mm_loadl_epi64((const __m128i*)&in[x * 4]);
+        __m256 colors = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(rawPixels)), maxValue);
+        _mm256_storeu_ps((float*)&out[x], colors);
+    }
+    LoadRawRowScalar<PNG::ColorType::RGBA, 8>(&in[x * 4], width - x, &out[x]);
+}
+#endif // PNG_X86_SIMD
+
+// Returns the loader which is specialized for the given format, or null if it's not a valid one
+static LoadRawRowFn GetRawRowLoader(uint8_t colorType, size_t bitDepth)
 {
-    if (colorType == ColorType::PALETTE && !palette)
-        return Result::PaletteNotFound;
+    using namespace PNG;
+
+    switch (colorType) {
+    case ColorType::GRAYSCALE:
+        switch (bitDepth) {
+        case 1: return LoadRawRowScalar<ColorType::GRAYSCALE, 1>;
+        case 2: return LoadRawRowScalar<ColorType::GRAYSCALE, 2>;
+        case 4: return LoadRawRowScalar<ColorType::GRAYSCALE, 4>;
+        case 8: return LoadRawRowScalar<ColorType::GRAYSCALE, 8>;
+        case 16: return LoadRawRowScalar<ColorType::GRAYSCALE, 16>;
+        }
+        break;
+    case ColorType::RGB:
+        switch (bitDepth) {
+        case 8: return LoadRawRowScalar<ColorType::RGB, 8>;
+        case 16: return LoadRawRowScalar<ColorType::RGB, 16>;
+        }
+        break;
+    case ColorType::GRAYSCALE_ALPHA:
+        switch (bitDepth) {
+        case 8: return LoadRawRowScalar<ColorType::GRAYSCALE_ALPHA, 8>;
+        case 16: return LoadRawRowScalar<ColorType::GRAYSCALE_ALPHA, 16>;
+        }
+        break;
+    case ColorType::RGBA:
+        switch (bitDepth) {
+        case 8: {
+#ifdef PNG_X86_SIMD
+            static const LoadRawRowFn loadRGBA8 =
+                CPU::GetFeatures().AVX2 ? LoadRawRowRGBA8AVX2 :
+                CPU::GetFeatures().SSE41 ? LoadRawRowRGBA8SSE41 :
+                LoadRawRowScalar<ColorType::RGBA, 8>;
+            return loadRGBA8;
+#else // PNG_X86_SIMD
+            return LoadRawRowScalar<ColorType::RGBA, 8>;
+#endif // PNG_X86_SIMD
+        }
+        case 16: return LoadRawRowScalar<ColorType::RGBA, 16>;
+        }
+        break;
+    }
+    return nullptr;
+}
 
+PNG::Result PNG::Image::LoadRawPixels(uint8_t colorType, size_t bitDepth, const Palette_T* palette, const std::vector<uint8_t>& in)
+{
     size_t samples = ColorType::GetSamples(colorType);
     if (samples == 0)
         return Result::InvalidColorType;
-    PNG_ASSERT(samples <= ColorType::MAX_SAMPLES, "WHY?");
 
     if (!ColorType::IsValidBitDepth(colorType, bitDepth))
         return Result::InvalidBitDepth;
     
-    size_t sampleSize = ColorType::GetBytesPerSample(bitDepth);
-    PNG_ASSERT(sampleSize <= sizeof(size_t), "HOW?");
-    
-    size_t pixelSize = samples * sampleSize;
+    size_t pixelSize = samples * ColorType::GetBytesPerSample(bitDepth);
     if (in.size() % pixelSize != 0)
         return Result::InvalidPixelBuffer;
     
     if (m_Width * m_Height * pixelSize != in.size())
         return Result::InvalidImageSize;
-    
-    const size_t MAX_SAMPLE_VALUE = (1 << bitDepth) - 1;
-
-    size_t rawColor[ColorType::MAX_SAMPLES]{0};
-    size_t pixelI = 0;
-    for (size_t i = 0; i < in.size(); i += pixelSize) {
-        for (size_t j = 0; j < samples; j++) {
-            rawColor[j] = 0;
-            for (size_t k = 0; k < sampleSize; k++) {
-                rawColor[j] <<= sampleSize * 8;
-                rawColor[j] |= in[i+j*sampleSize+k];
-            }
-        }
 
-        Color color;
-        switch (colorType)
-        {
-        case ColorType::GRAYSCALE: {
-            float gray = (rawColor[0] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.R = gray;
-            color.G = gray;
-            color.B = gray;
-            color.A = 1.0;
-            break;
-        }
-        case ColorType::RGB:
-            color.R = (rawColor[0] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.G = (rawColor[1] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.B = (rawColor[2] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.A = 1.0;
-            break;
-        case ColorType::PALETTE: {
-            size_t paletteIndex = rawColor[0];
+    // Rows are contiguous both in `in` and in m_Pixels
+    return LoadRawRow(colorType, bitDepth, palette, in.data(), m_Width * m_Height, m_Pixels);
+}
+
+PNG::Result PNG::Image::LoadRawRow(uint8_t colorType, size_t bitDepth, const Palette_T* palette, const uint8_t* in, size_t width, Color* out)
+{
+    if (colorType == ColorType::PALETTE) {
+        if (!palette)
+            return Result::PaletteNotFound;
+        if (!ColorType::IsValidBitDepth(colorType, bitDepth))
+            return Result::InvalidBitDepth;
+
+        // Indices are unpacked, so each one takes a byte
+        for (size_t x = 0; x < width; x++) {
+            size_t paletteIndex = in[x];
             if (paletteIndex >= palette->size()) {
-                PNG_LDEBUGF("PNG::Image::LoadRawPixels palette index {} is out of bounds (>= {}).", paletteIndex, palette->size());
+                PNG_LDEBUGF("PNG::Image::LoadRawRow palette index {} is out of bounds (>= {}).", paletteIndex, palette->size());
                 return Result::InvalidPaletteIndex;
             }
-            color = (*palette)[paletteIndex];
-            break;
+            out[x] = (*palette)[paletteIndex];
         }
-        case ColorType::GRAYSCALE_ALPHA: {
-            float gray = (rawColor[0] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.R = gray;
-            color.G = gray;
-            color.B = gray;
-            color.A = (rawColor[1] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            break;
+        return Result::OK;
+    }
+
+    size_t samples = ColorType::GetSamples(colorType);
+    if (samples == 0)
+        return Result::InvalidColorType;
+
+    if (!ColorType::IsValidBitDepth(colorType, bitDepth))
+        return Result::InvalidBitDepth;
+
+    LoadRawRowFn loadRawRow = GetRawRowLoader(colorType, bitDepth);
+    PNG_ASSERT(loadRawRow, "PNG::Image::LoadRawRow missing loader for a valid format.");
+    loadRawRow(in, width, out);
+    return Result::OK;
+}
+
+// Channels are clamped to [0; 1] and rounded to the nearest sample, NaNs become 0
+// The SIMD writers do the same float operations in the same order, so all writers give the same samples
+template<uint32_t MAX_SAMPLE_VALUE>
+static inline uint32_t QuantizeSample(float value)
+{
+    value = value > 0.0f ? (value < 1.0f ? value : 1.0f) : 0.0f;
+    return (uint32_t)(value * (float)MAX_SAMPLE_VALUE + 0.5f);
+}
+
+template<size_t BIT_DEPTH>
+static inline uint8_t* WriteSample(uint32_t sample, uint8_t* out)
+{
+    if constexpr (BIT_DEPTH == 16)
+        *out++ = (uint8_t)(sample >> 8);
+    *out++ = (uint8_t)sample;
+    return out;
+}
+
+using WriteRawRowFn = void(*)(const PNG::Color* in, size_t width, uint8_t* out);
+
+template<uint8_t COLOR_TYPE, size_t BIT_DEPTH>
+static void WriteRawRowScalar(const PNG::Color* in, size_t width, uint8_t* out)
+{
+    using namespace PNG;
+
+    constexpr uint32_t MAX_SAMPLE_VALUE = ((uint32_t)1 << BIT_DEPTH) - 1;
+    for (size_t x = 0; x < width; x++) {
+        const Color& color = in[x];
+        if constexpr (COLOR_TYPE == ColorType::GRAYSCALE || COLOR_TYPE == ColorType::GRAYSCALE_ALPHA) {
+            out = WriteSample<BIT_DEPTH>(QuantizeSample<MAX_SAMPLE_VALUE>((color.R + color.G + color.B) / 3.0f), out);
+        } else {
+            out = WriteSample<BIT_DEPTH>(QuantizeSample<MAX_SAMPLE_VALUE>(color.R), out);
+            out = WriteSample<BIT_DEPTH>(QuantizeSample<MAX_SAMPLE_VALUE>(color.G), out);
+            out = WriteSample<BIT_DEPTH>(QuantizeSample<MAX_SAMPLE_VALUE>(color.B), out);
         }
-        case ColorType::RGBA:
-            color.R = (rawColor[0] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.G = (rawColor[1] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.B = (rawColor[2] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            color.A = (rawColor[3] & MAX_SAMPLE_VALUE) / (float)MAX_SAMPLE_VALUE;
-            break;
-        default:
-            return Result::InvalidColorType;
+        if constexpr (COLOR_TYPE == ColorType::GRAYSCALE_ALPHA || COLOR_TYPE == ColorType::RGBA)
+            out = WriteSample<BIT_DEPTH>(QuantizeSample<MAX_SAMPLE_VALUE>(color.A), out);
+    }
+}
+
+#ifdef PNG_X86_SIMD
+// Same as QuantizeSample on all 4 channels of `color`
+PNG_TARGET("sse2") static inline __m128i QuantizeColorSSE2(const PNG::Color& color, __m128 maxValue)
+{
+    __m128 channels = _mm_loadu_ps((const float*)&color);
+    channels = _mm_min_ps(_mm_max_ps(channels, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(channels, maxValue), _mm_set1_ps(0.5f)));
+}
+
+// Converts 4 pixels at a time into 16 bytes of samples, SSSE3 drops alpha for RGB
+template<uint8_t COLOR_TYPE>
+PNG_TARGET("ssse3") static void WriteRawRow8SSSE3(const PNG::Color* in, size_t width, uint8_t* out)
+{
+    constexpr size_t PIXEL_SIZE = SAMPLES_OF<COLOR_TYPE>;
+    const __m128 maxValue = _mm_set1_ps(255.0f);
+    const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i lo = _mm_packs_epi32(QuantizeColorSSE2(in[x], maxValue), QuantizeColorSSE2(in[x+1], maxValue));
+        __m128i hi = _mm_packs_epi32(QuantizeColorSSE2(in[x+2], maxValue), QuantizeColorSSE2(in[x+3], maxValue));
+        __m128i samples = _mm_packus_epi16(lo, hi);
+        if constexpr (COLOR_TYPE == PNG::ColorType::RGBA) {
+            _mm_storeu_si128((__m128i*)&out[x * PIXEL_SIZE], samples);
+        } else {
+            samples = _mm_shuffle_epi8(samples, dropAlpha);
+            _mm_storel_epi64((__m128i*)&out[x * PIXEL_SIZE], samples);
+            uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(samples, 8));
+            memcpy(&out[x * PIXEL_SIZE + 8], &last, sizeof(last));
         }
+    }
+    WriteRawRowScalar<COLOR_TYPE, 8>(&in[x], width - x, &out[x * PIXEL_SIZE]);
+}
 
-        m_Pixels[pixelI++] = color;
+// Converts 2 pixels at a time into big-endian 16-bit samples, SSE4.1 is needed for unsigned saturation
+template<uint8_t COLOR_TYPE>
+PNG_TARGET("sse4.1") static void WriteRawRow16SSE41(const PNG::Color* in, size_t width, uint8_t* out)
+{
+    constexpr size_t PIXEL_SIZE = SAMPLES_OF<COLOR_TYPE> * 2;
+    const __m128 maxValue = _mm_set1_ps(65535.0f);
+    const __m128i toBigEndian = COLOR_TYPE == PNG::ColorType::RGBA ?
+        _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+        _mm_setr_epi8(1, 0, 3, 2, 5, 4, 9, 8, 11, 10, 13, 12, -1, -1, -1, -1);
+
+    size_t x = 0;
+    for (; x + 2 <= width; x += 2) {
+        __m128i samples = _mm_packus_epi32(QuantizeColorSSE2(in[x], maxValue), QuantizeColorSSE2(in[x+1], maxValue));
+        samples = _mm_shuffle_epi8(samples, toBigEndian);
+        if constexpr (COLOR_TYPE == PNG::ColorType::RGBA) {
+            _mm_storeu_si128((__m128i*)&out[x * PIXEL_SIZE], samples);
+        } else {
+            _mm_storel_epi64((__m128i*)&out[x * PIXEL_SIZE], samples);
+            uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(samples, 8));
+            memcpy(&out[x * PIXEL_SIZE + 8], &last, sizeof(last));
+        }
     }
+    WriteRawRowScalar<COLOR_TYPE, 16>(&in[x], width - x, &out[x * PIXEL_SIZE]);
+}
+#endif // PNG_X86_SIMD
 
-    return Result::OK;
+// Returns the writer which is specialized for the given format, or null if it's not a valid one
+static WriteRawRowFn GetRawRowWriter(uint8_t colorType, size_t bitDepth)
+{
+    using namespace PNG;
+
+#ifdef PNG_X86_SIMD
+    const auto& features = CPU::GetFeatures();
+    static const WriteRawRowFn writeRGB8 = features.SSSE3 ? WriteRawRow8SSSE3<ColorType::RGB> : WriteRawRowScalar<ColorType::RGB, 8>;
+    static const WriteRawRowFn writeRGBA8 = features.SSSE3 ? WriteRawRow8SSSE3<ColorType::RGBA> : WriteRawRowScalar<ColorType::RGBA, 8>;
+    static const WriteRawRowFn writeRGB16 = features.SSE41 ? WriteRawRow16SSE41<ColorType::RGB> : WriteRawRowScalar<ColorType::RGB, 16>;
+    static const WriteRawRowFn writeRGBA16 = features.SSE41 ? WriteRawRow16SSE41<ColorType::RGBA> : WriteRawRowScalar<ColorType::RGBA, 16>;
+#else // PNG_X86_SIMD
+    const WriteRawRowFn writeRGB8 = WriteRawRowScalar<ColorType::RGB, 8>;
+    const WriteRawRowFn writeRGBA8 = WriteRawRowScalar<ColorType::RGBA, 8>;
+    const WriteRawRowFn writeRGB16 = WriteRawRowScalar<ColorType::RGB, 16>;
+    const WriteRawRowFn writeRGBA16 = WriteRawRowScalar<ColorType::RGBA, 16>;
+#endif // PNG_X86_SIMD
+
+    switch (colorType) {
+    case ColorType::GRAYSCALE:
+        switch (bitDepth) {
+        case 1: return WriteRawRowScalar<ColorType::GRAYSCALE, 1>;
+        case 2: return WriteRawRowScalar<ColorType::GRAYSCALE, 2>;
+        case 4: return WriteRawRowScalar<ColorType::GRAYSCALE, 4>;
+        case 8: return WriteRawRowScalar<ColorType::GRAYSCALE, 8>;
+        case 16: return WriteRawRowScalar<ColorType::GRAYSCALE, 16>;
+        }
+        break;
+    case ColorType::RGB:
+        switch (bitDepth) {
+        case 8: return writeRGB8;
+        case 16: return writeRGB16;
+        }
+        break;
+    case ColorType::GRAYSCALE_ALPHA:
+        switch (bitDepth) {
+        case 8: return WriteRawRowScalar<ColorType::GRAYSCALE_ALPHA, 8>;
+        case 16: return WriteRawRowScalar<ColorType::GRAYSCALE_ALPHA, 16>;
+        }
+        break;
+    case ColorType::RGBA:
+        switch (bitDepth) {
+        case 8: return writeRGBA8;
+        case 16: return writeRGBA16;
+        }
+        break;
+    }
+    return nullptr;
 }
 
 PNG::Result PNG::Image::WriteRawPixels(uint8_t colorType, size_t bitDepth, OStream& out) const
@@ -560,52 +854,14 @@ PNG::Result PNG::Image::WriteRawPixels(uint8_t colorType, size_t bitDepth, OStre
     size_t samples = ColorType::GetSamples(colorType);
     if (samples == 0)
         return Result::InvalidColorType;
-    PNG_ASSERT(samples <= ColorType::MAX_SAMPLES, "WHY?");
 
     if (!ColorType::IsValidBitDepth(colorType, bitDepth))
         return Result::InvalidBitDepth;
-    
-    size_t sampleSize = ColorType::GetBytesPerSample(bitDepth);
-    PNG_ASSERT(sampleSize <= sizeof(size_t), "HOW?");
-    
-    const size_t MAX_SAMPLE_VALUE = (1 << bitDepth) - 1;
-    size_t rawColor[ColorType::MAX_SAMPLES]{0};
 
+    std::vector<uint8_t> line(m_Width * samples * ColorType::GetBytesPerSample(bitDepth));
     for (size_t y = 0; y < m_Height; y++) {
-        for (size_t x = 0; x < m_Width; x++) {
-            const Color& color = (*this)[y][x];
-            switch (colorType)
-            {
-            case ColorType::GRAYSCALE:
-                rawColor[0] = (size_t)((color.R + color.G + color.B) / 3.0 * MAX_SAMPLE_VALUE);
-                break;
-            case ColorType::RGB:
-                rawColor[0] = (size_t)(color.R * MAX_SAMPLE_VALUE);
-                rawColor[1] = (size_t)(color.G * MAX_SAMPLE_VALUE);
-                rawColor[2] = (size_t)(color.B * MAX_SAMPLE_VALUE);
-                break;
-            case ColorType::GRAYSCALE_ALPHA:
-                rawColor[0] = (size_t)((color.R + color.G + color.B) / 3.0 * MAX_SAMPLE_VALUE);
-                rawColor[1] = (size_t)(color.A * MAX_SAMPLE_VALUE);
-                break;
-            case ColorType::RGBA:
-                rawColor[0] = (size_t)(color.R * MAX_SAMPLE_VALUE);
-                rawColor[1] = (size_t)(color.G * MAX_SAMPLE_VALUE);
-                rawColor[2] = (size_t)(color.B * MAX_SAMPLE_VALUE);
-                rawColor[3] = (size_t)(color.A * MAX_SAMPLE_VALUE);
-                break;
-            case ColorType::PALETTE:
-                PNG_UNREACHABLE("PNG::Image::WriteRawPixels Early return failed for Palette color type.");
-            default:
-                return Result::InvalidColorType;
-            }
-
-            for (size_t j = 0; j < samples; j++) {
-                size_t sample = rawColor[j];
-                for (size_t k = 0; k < sampleSize; k++)
-                    PNG_RETURN_IF_NOT_OK(out.WriteU8, (uint8_t)(sample >> ((sampleSize - k - 1) * 8)));
-            }
-        }
+        PNG_RETURN_IF_NOT_OK(WriteRawRow, colorType, bitDepth, (*this)[y], m_Width, line.data());
+        PNG_RETURN_IF_NOT_OK(out.WriteVector, line);
         // Flush on each scanline
         PNG_RETURN_IF_NOT_OK(out.Flush);
     }
@@ -613,6 +869,24 @@ PNG::Result PNG::Image::WriteRawPixels(uint8_t colorType, size_t bitDepth, OStre
     return Result::OK;
 }
 
+PNG::Result PNG::Image::WriteRawRow(uint8_t colorType, size_t bitDepth, const Color* in, size_t width, uint8_t* out)
+{
+    if (colorType == ColorType::PALETTE)
+        return Result::UnsupportedColorType;
+
+    size_t samples = ColorType::GetSamples(colorType);
+    if (samples == 0)
+        return Result::InvalidColorType;
+
+    if (!ColorType::IsValidBitDepth(colorType, bitDepth))
+        return Result::InvalidBitDepth;
+
+    WriteRawRowFn writeRawRow = GetRawRowWriter(colorType, bitDepth);
+    PNG_ASSERT(writeRawRow, "PNG::Image::WriteRawRow missing writer for a valid format.");
+    writeRawRow(in, width, out);
+    return Result::OK;
+}
+
 PNG::Result PNG::Image::WriteDitheredRawPixels(const Palette_T& palette, size_t bitDepth, DitheringMethod ditheringMethod, OStream& out) const
 {
     if (!ColorType::IsValidBitDepth(ColorType::PALETTE, bitDepth))
@@ -628,32 +902,12 @@ PNG::Result PNG::Image::WriteDitheredRawPixels(const Palette_T& palette, size_t
 
     std::vector<uint8_t> line(m_Width);
     for (size_t y = 0; y < m_Height; y++) {
-        for (size_t x = 0; x < m_Width; x++) {
-            // Clamping Color to remove error diffusion artifacts
-            const Color& color = ditheringMethod == DitheringMethod::None ?
-                (*this)[y][x] : errImg[y][x].Clamp();
-
-            // Find closest palette color
-            size_t bestPaletteI = FindClosestPaletteColor(color, palette);
-
-            line[x] = (uint8_t)bestPaletteI;
+        if (ditheringMethod == DitheringMethod::None) {
             // No need to apply error diffusion
-            if (ditheringMethod == DitheringMethod::None)
-                continue;
-
-            // Apply error diffusion
-            const Color& newColor = palette[bestPaletteI];
-            Color quantError = color - newColor;
-
-            switch (ditheringMethod) {
-            // We do a little more bits of macro magic.
-            PNG_FILL_DITHERING_CASES(errImg, quantError);
-            case DitheringMethod::None:
-                PNG_UNREACHABLE("PNG::Image::WriteDitheredRawPixels Early continue failed for None dithering method.");
-            default:
-                PNG_UNREACHABLEF("PNG::Image::WriteDitheredRawPixels case missing ({}).", (int)ditheringMethod);
-            }
-        }
+            for (size_t x = 0; x < m_Width; x++)
+                line[x] = (uint8_t)FindClosestPaletteColor((*this)[y][x], palette);
+        } else
+            DitherRow(errImg, y, palette, ditheringMethod, line.data());
 
         PNG_RETURN_IF_NOT_OK(out.WriteVector, line);
         PNG_RETURN_IF_NOT_OK(out.Flush);
@@ -662,331 +916,879 @@ PNG::Result PNG::Image::WriteDitheredRawPixels(const Palette_T& palette, size_t
     return Result::OK;
 }
 
-PNG::Result PNG::Image::Read(IStream& in, PNG::Image& out, const ImportSettings& cfg, bool async)
+void PNG::Image::DitherRow(Image& img, size_t y, const Palette_T& palette, DitheringMethod ditheringMethod, uint8_t* out)
 {
-    auto launchPolicy = async ? std::launch::async : std::launch::deferred;
+    for (size_t x = 0; x < img.GetWidth(); x++) {
+        // Clamping Color to remove error diffusion artifacts
+        const Color& color = ditheringMethod == DitheringMethod::None ?
+            img[y][x] : img[y][x].Clamp();
+
+        // Find closest palette color
+        size_t bestPaletteI = FindClosestPaletteColor(color, palette);
+
+        out[x] = (uint8_t)bestPaletteI;
+        // No need to apply error diffusion
+        if (ditheringMethod == DitheringMethod::None)
+            continue;
+
+        // Apply error diffusion
+        const Color& newColor = palette[bestPaletteI];
+        Color quantError = color - newColor;
+
+        switch (ditheringMethod) {
+        // We do a little more bits of macro magic.
+        PNG_FILL_DITHERING_CASES(img, quantError);
+        case DitheringMethod::None:
+            PNG_UNREACHABLE("PNG::Image::DitherRow Early continue failed for None dithering method.");
+        default:
+            PNG_UNREACHABLEF("PNG::Image::DitherRow case missing ({}).", (int)ditheringMethod);
+        }
+    }
+}
+
+// Returns the number of Adam7 passes which are decoded, see PNG::ImportSettings::Adam7Passes
+static size_t GetAdam7Passes(const PNG::ImportSettings& cfg)
+{
+    return std::clamp<size_t>(cfg.Adam7Passes, 1, 7);
+}
 
+PNG::ImageHeader PNG::ChunkReader::GetDecodedHeader() const
+{
+    ImageHeader decoded = m_IHDR;
+    if (m_IHDR.InterlaceMethod == InterlaceMethod::ADAM7 && !m_Settings.ExpandAdam7Passes) {
+        size_t width, height;
+        Adam7::GetPassGridSize(GetAdam7Passes(m_Settings), m_IHDR.Width, m_IHDR.Height, width, height);
+        decoded.Width = (uint32_t)width;
+        decoded.Height = (uint32_t)height;
+    }
+    return decoded;
+}
+
+PNG::Result PNG::ChunkReader::ReadHeader(IStream& in)
+{
     uint8_t sig[PNG_SIGNATURE_LEN];
     PNG_RETURN_IF_NOT_OK(in.ReadBuffer, sig, PNG_SIGNATURE_LEN);
     if (memcmp(sig, PNG_SIGNATURE, PNG_SIGNATURE_LEN) != 0)
         return Result::InvalidSignature;
 
     // Reading IHDR
-    PNG::Chunk chunk;
-    PNG::ImageHeader ihdr;
-    PNG_RETURN_IF_NOT_OK(Chunk::Read, in, chunk);
+    ChunkView chunk;
+    PNG_RETURN_IF_NOT_OK(ChunkView::Read, in, chunk);
     // ImageHeader::Parse also Validates what was read
-    PNG_RETURN_IF_NOT_OK(ImageHeader::Parse, chunk, ihdr);
+    PNG_RETURN_IF_NOT_OK(ImageHeader::Parse, chunk, m_IHDR);
 
-    PNG_LDEBUGF("PNG::Image::Read Reading image {}x{} (bd={},ct={},cm={},fm={},im={}).",
-        ihdr.Width, ihdr.Height, ihdr.BitDepth, ihdr.ColorType,
-        ihdr.CompressionMethod, ihdr.FilterMethod, ihdr.InterlaceMethod);
+    PNG_LDEBUGF("PNG::ChunkReader::ReadHeader Reading image {}x{} (bd={},ct={},cm={},fm={},im={}).",
+        m_IHDR.Width, m_IHDR.Height, m_IHDR.BitDepth, m_IHDR.ColorType,
+        m_IHDR.CompressionMethod, m_IHDR.FilterMethod, m_IHDR.InterlaceMethod);
 
-    // If color has 0 samples per component then it is not valid
-    size_t samples = ColorType::GetSamples(ihdr.ColorType);
-    PNG_ASSERT(samples != 0, "PNG::Image::Read ImageHeader::Validate failed to catch Invalid Color Type.");
+    m_LastChunkType = ChunkType::IHDR;
+    return Result::OK;
+}
 
-    Palette_T palette;
+PNG::Result PNG::ChunkReader::ReadNext(IStream& in, ChunkView& chunk, bool checkIDATCRC)
+{
+    PNG_RETURN_IF_NOT_OK(ChunkView::Read, in, chunk);
+    return HandleChunk(chunk, checkIDATCRC || chunk.Type != ChunkType::IDAT);
+}
 
-    // Deflated Image Data
-    DynamicByteStream idat;
-    auto reader = std::async(launchPolicy, [&in, &cfg, &ihdr, &palette, &idat]() {
-        std::unordered_set<uint32_t> chunkTypesRead;
-        uint32_t lastChunkType = ChunkType::IHDR;
-
-        Chunk chunk;
-        do {
-            PNG_RETURN_IF_NOT_OK(Chunk::Read, in, chunk);
-            if (chunk.CRC != chunk.CalculateCRC())
-                return Result::CorruptedChunk;
-            
-            bool isAux = ChunkType::IsAncillary(chunk.Type);
-
-            switch (chunk.Type) {
-            case ChunkType::IHDR:
-                return Result::IllegalIHDRChunk;
-            case ChunkType::PLTE: {
-                if (chunkTypesRead.contains(ChunkType::PLTE) ||
-                    chunkTypesRead.contains(ChunkType::IDAT) ||
-                    ihdr.ColorType == ColorType::GRAYSCALE ||
-                    ihdr.ColorType == ColorType::GRAYSCALE_ALPHA
-                ) {
-                    return Result::IllegalPaletteChunk;
-                } else if (palette.size() > 0)
-                    return Result::DuplicatePalette;
-                
-                size_t paletteEntries = chunk.Length() / 3;
-                if (ihdr.ColorType == ColorType::PALETTE &&
-                    (paletteEntries == 0 ||
-                    paletteEntries > (size_t)1 << ihdr.BitDepth)
-                ) {
-                    return Result::InvalidPaletteSize;
-                }
+PNG::Result PNG::ChunkReader::ReadNextSkippingIDAT(IStream& in, ChunkView& chunk)
+{
+    PNG_RETURN_IF_NOT_OK(ChunkView::ReadHeader, in, chunk);
+    if (chunk.Type == ChunkType::IDAT) {
+        PNG_RETURN_IF_NOT_OK(chunk.SkipData, in);
+        return HandleChunk(chunk, false);
+    }
+    PNG_RETURN_IF_NOT_OK(chunk.ReadData, in);
+    return HandleChunk(chunk, true);
+}
 
-                for (size_t i = 0; i < chunk.Length(); i += 3) {
-                    palette.emplace_back(chunk.Data[i]/255.0,
-                        chunk.Data[i+1]/255.0,
-                        chunk.Data[i+2]/255.0);
-                }
-                break;
-            }
-            case ChunkType::IDAT:
-                if (chunkTypesRead.contains(ChunkType::IDAT) &&
-                    lastChunkType != ChunkType::IDAT
-                ) {
-                    return Result::IllegalIDATChunk;
-                } else if (ihdr.ColorType == ColorType::PALETTE &&
-                    !chunkTypesRead.contains(ChunkType::PLTE)
-                ) {
-                    return Result::PaletteNotFound;
-                }
+PNG::Result PNG::ChunkReader::HandleChunk(const ChunkView& chunk, bool checkCRC)
+{
+    if (m_Settings.CheckCRC && checkCRC && chunk.CRC != chunk.CalculateCRC())
+        return Result::CorruptedChunk;
+
+    bool isAux = ChunkType::IsAncillary(chunk.Type);
+
+    switch (chunk.Type) {
+    case ChunkType::IHDR:
+        return Result::IllegalIHDRChunk;
+    case ChunkType::PLTE: {
+        if (m_ChunkTypesRead.contains(ChunkType::PLTE) ||
+            m_ChunkTypesRead.contains(ChunkType::IDAT) ||
+            m_IHDR.ColorType == ColorType::GRAYSCALE ||
+            m_IHDR.ColorType == ColorType::GRAYSCALE_ALPHA
+        ) {
+            return Result::IllegalPaletteChunk;
+        } else if (m_Palette.size() > 0)
+            return Result::DuplicatePalette;
+        
+        size_t paletteEntries = chunk.Length() / 3;
+        if (m_IHDR.ColorType == ColorType::PALETTE &&
+            (paletteEntries == 0 ||
+            paletteEntries > (size_t)1 << m_IHDR.BitDepth)
+        ) {
+            return Result::InvalidPaletteSize;
+        }
 
-                PNG_RETURN_IF_NOT_OK(idat.WriteVector, chunk.Data);
-                PNG_RETURN_IF_NOT_OK(idat.Flush);
-            case ChunkType::IEND:
-                break;
-            case ChunkType::tRNS:
-                if (chunkTypesRead.contains(ChunkType::tRNS) ||
-                    chunkTypesRead.contains(ChunkType::IDAT) ||
-                    ihdr.ColorType == ColorType::GRAYSCALE_ALPHA ||
-                    ihdr.ColorType == ColorType::RGBA
-                ) {
-                    return Result::IllegaltRNSChunk;
-                } else if (ihdr.ColorType != ColorType::PALETTE) {
-                    PNG_LDEBUGF("PNG::Image::Read tRNS chunk is only supported for Palette color type, got {}.", (size_t)ihdr.ColorType);
-                    break;
-                } else if (!chunkTypesRead.contains(ChunkType::PLTE)) {
-                    return Result::IllegaltRNSChunk;
-                } else if (chunk.Length() > palette.size())
-                    return Result::InvalidtRNSSize;
-
-                for (size_t i = 0; i < chunk.Length(); i++)
-                    palette[i].A = (float)(chunk.Data[i] / 255.0);
-                break;
-            case ChunkType::tEXt:
-            case ChunkType::zTXt:
-            case ChunkType::iTXt: {
-                if (!cfg.MetadataOut)
-                    break;
-                TextualData data;
-                PNG_RETURN_IF_NOT_OK(TextualData::Parse, chunk, data);
-                cfg.MetadataOut->push_back(std::move(data));
-                break;
-            }
-            case ChunkType::tIME: {
-                if (!cfg.LastModificationTimeOut)
-                    break;
-                if (chunkTypesRead.contains(ChunkType::tIME))
-                    return Result::IllegaltIMEChunk;
-                LastModificationTime lmt;
-                PNG_RETURN_IF_NOT_OK(LastModificationTime::Parse, chunk, lmt);
-                *cfg.LastModificationTimeOut = lmt;
+        for (size_t i = 0; i < chunk.Length(); i += 3) {
+            m_Palette.emplace_back(chunk.Data[i]/255.0,
+                chunk.Data[i+1]/255.0,
+                chunk.Data[i+2]/255.0);
+        }
+        break;
+    }
+    case ChunkType::IDAT:
+        if (m_ChunkTypesRead.contains(ChunkType::IDAT) &&
+            m_LastChunkType != ChunkType::IDAT
+        ) {
+            return Result::IllegalIDATChunk;
+        } else if (m_IHDR.ColorType == ColorType::PALETTE &&
+            !m_ChunkTypesRead.contains(ChunkType::PLTE)
+        ) {
+            return Result::PaletteNotFound;
+        }
+        // Image data is handled by the caller
+        break;
+    case ChunkType::IEND:
+        break;
+    case ChunkType::tRNS:
+        if (m_ChunkTypesRead.contains(ChunkType::tRNS) ||
+            m_ChunkTypesRead.contains(ChunkType::IDAT) ||
+            m_IHDR.ColorType == ColorType::GRAYSCALE_ALPHA ||
+            m_IHDR.ColorType == ColorType::RGBA
+        ) {
+            return Result::IllegaltRNSChunk;
+        } else if (m_IHDR.ColorType != ColorType::PALETTE) {
+            PNG_LDEBUGF("PNG::ChunkReader::HandleChunk tRNS chunk is only supported for Palette color type, got {}.", (size_t)m_IHDR.ColorType);
+            break;
+        } else if (!m_ChunkTypesRead.contains(ChunkType::PLTE)) {
+            return Result::IllegaltRNSChunk;
+        } else if (chunk.Length() > m_Palette.size())
+            return Result::InvalidtRNSSize;
+
+        for (size_t i = 0; i < chunk.Length(); i++)
+            m_Palette[i].A = (float)(chunk.Data[i] / 255.0);
+        break;
+    case ChunkType::tEXt:
+    case ChunkType::zTXt:
+    case ChunkType::iTXt: {
+        if (!m_Settings.MetadataOut)
+            break;
+        if (m_Settings.MetadataKeywords) {
+            std::string_view keyword;
+            PNG_RETURN_IF_NOT_OK(TextualData::ParseKeyword, chunk, keyword);
+            const auto& keywords = *m_Settings.MetadataKeywords;
+            if (std::find(keywords.begin(), keywords.end(), keyword) == keywords.end())
                 break;
-            }
-            default:
-                PNG_LDEBUGF("PNG::Image::Read Reading unknown chunk {:.4} (0x{:x}).", (char*)&chunk.Type, chunk.Type);
-                if (!isAux)
-                    return Result::UnknownNecessaryChunk;
-            }
+        }
+        TextualData data;
+        PNG_RETURN_IF_NOT_OK(TextualData::Parse, chunk, data, !m_Settings.LazyMetadata);
+        m_Settings.MetadataOut->push_back(std::move(data));
+        break;
+    }
+    case ChunkType::tIME: {
+        if (!m_Settings.LastModificationTimeOut)
+            break;
+        if (m_ChunkTypesRead.contains(ChunkType::tIME))
+            return Result::IllegaltIMEChunk;
+        LastModificationTime lmt;
+        PNG_RETURN_IF_NOT_OK(LastModificationTime::Parse, chunk, lmt);
+        *m_Settings.LastModificationTimeOut = lmt;
+        break;
+    }
+    case ChunkType::riDX: {
+        // Like any ancillary chunk, an index which can't be used is ignored
+        RestartIndex index;
+        if (m_ChunkTypesRead.contains(ChunkType::IDAT) || m_ChunkTypesRead.contains(ChunkType::riDX)) {
+            PNG_LDEBUG("PNG::ChunkReader::HandleChunk Ignoring riDX chunk which is not the first one before IDAT.");
+            break;
+        }
+        auto ires = RestartIndex::Parse(chunk, index);
+        if (ires == Result::OK)
+            ires = index.Validate(m_IHDR);
+        if (ires != Result::OK) {
+            PNG_LDEBUGF("PNG::ChunkReader::HandleChunk Ignoring invalid riDX chunk ({}).", ResultToString(ires));
+            break;
+        }
+        m_RestartIndex = std::move(index);
+        break;
+    }
+    default:
+        PNG_LDEBUGF("PNG::ChunkReader::HandleChunk Reading unknown chunk {:.4} (0x{:x}).", (char*)&chunk.Type, chunk.Type);
+        if (!isAux)
+            return Result::UnknownNecessaryChunk;
+    }
 #ifdef PNG_DEBUG
-            // Write IDAT only once
-            if (chunk.Type != ChunkType::IDAT || !chunkTypesRead.contains(chunk.Type))
-                PNG_LDEBUGF("PNG::Image::Read Read chunk {:.4} (0x{:x}).", (char*)&chunk.Type, chunk.Type);
+    // Write IDAT only once
+    if (chunk.Type != ChunkType::IDAT || !m_ChunkTypesRead.contains(chunk.Type))
+        PNG_LDEBUGF("PNG::ChunkReader::HandleChunk Read chunk {:.4} (0x{:x}).", (char*)&chunk.Type, chunk.Type);
 #endif // PNG_DEBUG
-            chunkTypesRead.insert(chunk.Type);
-            lastChunkType = chunk.Type;
-        } while (chunk.Type != ChunkType::IEND);
+    m_ChunkTypesRead.insert(chunk.Type);
+    m_LastChunkType = chunk.Type;
+    return Result::OK;
+}
+
+// An IDAT chunk whose data stays valid after it is read, its CRC is checked while the reader moves on
+struct DeferredCRC
+{
+    const uint8_t* Data;
+    uint32_t Length;
+    uint32_t CRC;
+};
+
+static PNG::Result CheckIDATCRC(const uint8_t* data, size_t len, uint32_t crc)
+{
+    using namespace PNG;
+
+    const uint32_t typeCRC = CRC::Update(~0, ChunkType::IDAT);
+    return crc == ~CRC::Update(typeCRC, data, len) ? Result::OK : Result::CorruptedChunk;
+}
+
+// Checks the CRC of deferred IDATs on its own thread as they are pushed
+// IDATs pushed while a batch is being checked make up the next one, whose CRCs are checked in parallel
+class IDATCRCChecker
+{
+public:
+    IDATCRCChecker()
+        : m_Worker(std::async(std::launch::async, [this]() { return Run(); })) { }
+    ~IDATCRCChecker() { Close(); }
+
+    IDATCRCChecker(const IDATCRCChecker& other) = delete;
+    IDATCRCChecker& operator=(const IDATCRCChecker& other) = delete;
+
+    void Push(const DeferredCRC& idat)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Pending.push_back(idat);
+        m_Available.notify_one();
+    }
+
+    // Waits until all pushed IDATs are checked
+    PNG::Result Finish()
+    {
+        Close();
+        return m_Worker.get();
+    }
+
+private:
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Closed = true;
+        m_Available.notify_one();
+    }
+
+    PNG::Result Run()
+    {
+        using namespace PNG;
+
+        auto res = Result::OK;
+        std::vector<DeferredCRC> batch;
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (true) {
+            m_Available.wait(lock, [this]() { return m_Closed || !m_Pending.empty(); });
+            if (m_Pending.empty())
+                return res;
+            batch.swap(m_Pending);
+            lock.unlock();
+            // Once a corrupted IDAT is found, the rest is only drained
+            if (res == Result::OK) {
+                bool intact = std::all_of(std::execution::par, batch.begin(), batch.end(), [](const DeferredCRC& idat) {
+                    return CheckIDATCRC(idat.Data, idat.Length, idat.CRC) == Result::OK;
+                });
+                res = intact ? Result::OK : Result::CorruptedChunk;
+            }
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Available;
+    std::vector<DeferredCRC> m_Pending;
+    bool m_Closed = false;
+    // Declared last, so that the worker is started after the rest is initialized and waited for before it's destroyed
+    std::future<PNG::Result> m_Worker;
+};
+
+// Decodes image data through a pipeline of a reader, an inflater and a decoder, `idat` is the first IDAT chunk
+// Multi-threaded reads check IDAT CRCs away from the reader: views of the input by an IDATCRCChecker while reading,
+//  buffered IDATs by whoever inflates them, right before they are inflated (see PNG::BufferQueueStream::PushBuffer)
+static PNG::Result ReadPipelined(PNG::IStream& in, PNG::ChunkReader& chunkReader, PNG::ChunkView& idat, const PNG::RawRowLoader& loadRow, bool async,
+    const PNG::Adam7::PassCallback& onPass)
+{
+    using namespace PNG;
+
+    auto launchPolicy = async ? std::launch::async : std::launch::deferred;
+    const ImageHeader& ihdr = chunkReader.GetHeader();
+    const ImportSettings& cfg = chunkReader.GetSettings();
+    size_t samples = ColorType::GetSamples(ihdr.ColorType);
+    const ImageHeader decoded = chunkReader.GetDecodedHeader();
+    const ImageRegion region = cfg.Region.Resolve(decoded);
+    const size_t endRow = (size_t)region.Y + region.Height;
+    const size_t passes = GetAdam7Passes(cfg);
+    // Deinterlaced pixels are unpacked
+    const size_t rawRowSize = decoded.Width * samples * ColorType::GetBytesPerSample(ihdr.BitDepth);
+    // Images are inflated by the decoder if it stops before the end, so that inflating stops with it
+    // Pass callbacks also need it, otherwise single-threaded reads would inflate the whole image before the first pass
+    const bool stopsEarly = ihdr.InterlaceMethod == InterlaceMethod::NONE ? endRow < ihdr.Height : passes < 7;
+    const bool decoderInflates = stopsEarly || (ihdr.InterlaceMethod != InterlaceMethod::NONE && onPass);
+
+    // The pipeline has 2 pipes, each one gets half of the budget
+    // Unbounded pipes are needed by single-threaded reads, see CreatePipelineStream
+    const size_t pipeCapacity = async && cfg.MaxPipelineBytes > 0 ? std::max<size_t>(cfg.MaxPipelineBytes / 2, 1) : 0;
+
+    // Deflated Image Data
+    // If `in` has stable views (see `PNG::IStream::HasStableViews()`), IDATs are never copied before being inflated
+    BufferQueueStream deflated(pipeCapacity);
+    // Single-threaded reads check CRCs as chunks are read
+    std::optional<IDATCRCChecker> crcChecker;
+    if (async && cfg.CheckCRC)
+        crcChecker.emplace();
+    auto reader = std::async(launchPolicy, [&in, &chunkReader, &idat, &deflated, async, &crcChecker]() {
+        ChunkView& chunk = idat;
+        while (chunk.Type != ChunkType::IEND) {
+            // Once the decoder has all the rows it needs, the remaining IDATs are skipped
+            bool skipIDAT = deflated.IsReadingStopped();
+            if (chunk.Type == ChunkType::IDAT && !skipIDAT) {
+                // Empty buffers are never queued, so their CRC is left to the checker too
+                if (chunk.IsBorrowed() || chunk.Length() == 0) {
+                    if (crcChecker)
+                        crcChecker->Push({ chunk.Data, chunk.Length(), chunk.CRC });
+                    PNG_RETURN_IF_NOT_OK(deflated.PushView, chunk.Data, chunk.Length());
+                } else {
+                    BufferQueueStream::BufferCheck checkCRC;
+                    if (crcChecker) {
+                        checkCRC = [crc = chunk.CRC](const uint8_t* data, size_t len) {
+                            return CheckIDATCRC(data, len, crc);
+                        };
+                    }
+                    PNG_RETURN_IF_NOT_OK(deflated.PushBuffer, chunk.ReleaseBuffer(), std::move(checkCRC));
+                }
+            }
+            if (skipIDAT)
+                PNG_RETURN_IF_NOT_OK(chunkReader.ReadNextSkippingIDAT, in, chunk);
+            else
+                PNG_RETURN_IF_NOT_OK(chunkReader.ReadNext, in, chunk, !async);
+        }
         // While reading IDATs, PNG::DecompressData can read the buffer in another thread
         return Result::OK;
     });
 
-    DynamicByteStream intPixels; // Interlaced Pixels
+    auto intPixelsPipe = CreatePipelineStream(pipeCapacity);
+    PipelineStream& intPixels = *intPixelsPipe; // Interlaced Pixels
     // Inflating IDAT
-    auto inflater = std::async(launchPolicy, DecompressData, ihdr.CompressionMethod, std::ref(idat), std::ref(intPixels));
-    // While inflating IDATs, PNG::DeinterlacePixels can execute and
-    //  PNG::Image::LoadRawPixels could read the vector as it gets filled
-    
+    auto inflater = std::async(launchPolicy, [&ihdr, &deflated, &intPixels, decoderInflates]() {
+        if (decoderInflates)
+            return Result::OK;
+        auto res = DecompressData(ihdr.CompressionMethod, deflated, intPixels);
+        // The reader must not wait for the inflater if it stopped early
+        deflated.StopReading();
+        return res;
+    });
+    // While inflating IDATs, non-interlaced scanlines are unfiltered and loaded right away,
+    //  interlaced ones are deinterlaced into rawPixels and then loaded once all of them are read
+    // The palette is complete before the first IDAT is read, so it can be used while the reader is still running
     std::vector<uint8_t> rawPixels;
-    auto deinterlacer = std::async(launchPolicy, DeinterlacePixels, ihdr.InterlaceMethod, ihdr.FilterMethod,
-        ihdr.Width, ihdr.Height, ihdr.BitDepth, samples, std::ref(intPixels), std::ref(rawPixels));
+    auto decoder = std::async(launchPolicy, [&ihdr, &cfg, samples, &loadRow, &onPass, &deflated, &intPixels, &rawPixels, &region, endRow, rawRowSize, passes, decoderInflates]() {
+        auto res = Result::OK;
+        std::optional<ZLib::InflateStream> decoderInflater;
+        if (decoderInflates)
+            decoderInflater.emplace(deflated);
+        IStream& scanlines = decoderInflater ? (IStream&)*decoderInflater : intPixels;
+        if (ihdr.InterlaceMethod == InterlaceMethod::NONE) {
+            // Rows above the region are still unfiltered, since the ones below may depend on them
+            ScanlineDecoder scanlineDecoder;
+            scanlineDecoder.Reset(ihdr);
+            for (size_t y = 0; y < endRow && res == Result::OK; y++) {
+                const uint8_t* rawRow;
+                res = scanlineDecoder.DecodeRawRow(scanlines, rawRow);
+                if (res == Result::OK && y >= region.Y)
+                    res = loadRow(y, rawRow);
+            }
+        } else if (ihdr.InterlaceMethod == InterlaceMethod::ADAM7) {
+            Adam7::PassCallback loadPass;
+            if (onPass) {
+                loadPass = [&loadRow, &onPass, &rawPixels, &region, endRow, rawRowSize](size_t pass) {
+                    for (size_t y = region.Y; y < endRow; y++)
+                        PNG_RETURN_IF_NOT_OK(loadRow, y, &rawPixels[y * rawRowSize]);
+                    return onPass(pass);
+                };
+            }
+            res = Adam7::DeinterlacePasses(ihdr.FilterMethod, ihdr.Width, ihdr.Height, ihdr.BitDepth, samples,
+                passes, cfg.ExpandAdam7Passes, scanlines, rawPixels, loadPass);
+        } else {
+            res = DeinterlacePixels(ihdr.InterlaceMethod, ihdr.FilterMethod,
+                ihdr.Width, ihdr.Height, ihdr.BitDepth, samples, scanlines, rawPixels);
+        }
+        // The reader must not wait for data which won't be inflated
+        if (decoderInflates)
+            deflated.StopReading();
+        // Whatever is left in the pipe won't be read, the inflater must not wait for it
+        intPixels.StopReading();
+        return res;
+    });
 
-    PNG_LDEBUG("PNG::Image::Read Waiting for IDAT Reader.");
+    PNG_LDEBUG("PNG::ReadImageData Waiting for IDAT Reader.");
     reader.wait();
-    idat.Close();
+    deflated.Close();
 
-    PNG_LDEBUG("PNG::Image::Read Waiting for IDAT Inflater.");
+    PNG_LDEBUG("PNG::ReadImageData Waiting for IDAT Inflater.");
     inflater.wait();
     intPixels.Close();
 
-    PNG_LDEBUG("PNG::Image::Read Waiting for Deinterlacer.");
-    deinterlacer.wait();
+    PNG_LDEBUG("PNG::ReadImageData Waiting for Decoder.");
+    decoder.wait();
 
-    PNG_LDEBUG("PNG::Image::Read Checking IDAT Reader result.");
+    PNG_LDEBUG("PNG::ReadImageData Checking IDAT Reader result.");
     PNG_RETURN_IF_NOT_OK(reader.get);
-    PNG_LDEBUG("PNG::Image::Read Checking IDAT Inflater result.");
+    // Corrupted IDATs are most likely the reason why the inflater or decoder failed
+    PNG_LDEBUG("PNG::ReadImageData Checking IDAT CRCs.");
+    if (crcChecker)
+        PNG_RETURN_IF_NOT_OK(crcChecker->Finish);
+    PNG_RETURN_IF_NOT_OK(deflated.GetCheckResult);
+    PNG_LDEBUG("PNG::ReadImageData Checking IDAT Inflater result.");
     PNG_RETURN_IF_NOT_OK(inflater.get);
-    PNG_LDEBUG("PNG::Image::Read Checking Deinterlacer result.");
-    PNG_RETURN_IF_NOT_OK(deinterlacer.get);
+    PNG_LDEBUG("PNG::ReadImageData Checking Decoder result.");
+    PNG_RETURN_IF_NOT_OK(decoder.get);
+
+    // With a pass callback, rows were already loaded after the last pass
+    if (ihdr.InterlaceMethod != InterlaceMethod::NONE && !onPass) {
+        PNG_LDEBUG("PNG::ReadImageData Loading raw pixels.");
+        if (rawPixels.size() != rawRowSize * decoded.Height)
+            return Result::InvalidImageSize;
+        for (size_t y = region.Y; y < endRow; y++)
+            PNG_RETURN_IF_NOT_OK(loadRow, y, &rawPixels[y * rawRowSize]);
+    }
+    return Result::OK;
+}
+
+// A piece of the zlib stream, which points either into the input or into a copy of a buffered IDAT
+struct DeflatedSpan
+{
+    const uint8_t* Data;
+    size_t Length;
+};
+
+// Pushes views of the bytes in [begin, end) of the zlib stream made by joining `spans`, `spanOffsets` holds where each span starts
+static PNG::Result PushDeflatedRange(PNG::BufferQueueStream& out, const std::vector<DeflatedSpan>& spans, const std::vector<size_t>& spanOffsets,
+    size_t begin, size_t end)
+{
+    using namespace PNG;
+
+    size_t i = std::upper_bound(spanOffsets.begin(), spanOffsets.end(), begin) - spanOffsets.begin() - 1;
+    for (; i < spans.size() && spanOffsets[i] < end; i++) {
+        const size_t first = std::max(begin, spanOffsets[i]) - spanOffsets[i];
+        const size_t last = std::min(end, spanOffsets[i] + spans[i].Length) - spanOffsets[i];
+        PNG_RETURN_IF_NOT_OK(out.PushView, spans[i].Data + first, last - first);
+    }
+    return out.Close();
+}
+
+// Decodes the rows of the region from the whole zlib stream, like single-threaded reads do
+static PNG::Result DecodeDeflatedSpans(const std::vector<DeflatedSpan>& spans, const std::vector<size_t>& spanOffsets, size_t deflatedSize,
+    const PNG::ImageHeader& ihdr, const PNG::ImageRegion& region, const PNG::RawRowLoader& loadRow)
+{
+    using namespace PNG;
+
+    BufferQueueStream deflated;
+    PNG_RETURN_IF_NOT_OK(PushDeflatedRange, deflated, spans, spanOffsets, 0, deflatedSize);
+    ZLib::InflateStream inflater(deflated);
+    ScanlineDecoder scanlineDecoder;
+    scanlineDecoder.Reset(ihdr);
+    const size_t endRow = (size_t)region.Y + region.Height;
+    for (size_t y = 0; y < endRow; y++) {
+        const uint8_t* rawRow;
+        PNG_RETURN_IF_NOT_OK(scanlineDecoder.DecodeRawRow, inflater, rawRow);
+        if (y >= region.Y)
+            PNG_RETURN_IF_NOT_OK(loadRow, y, rawRow);
+    }
+    return Result::OK;
+}
+
+// Decodes each segment listed by the restart index on its own thread, `idat` is the first IDAT chunk
+// Segments may span IDATs, so all of them are gathered before decoding. IDATs which are views of the input are not copied
+// The index is only a hint: if it doesn't match the image data, the image is decoded from the start like single-threaded reads do
+static PNG::Result ReadRestartSegments(PNG::IStream& in, PNG::ChunkReader& chunkReader, PNG::ChunkView& idat, const PNG::RawRowLoader& loadRow)
+{
+    using namespace PNG;
+
+    const ImageHeader& ihdr = chunkReader.GetHeader();
+    const auto& segments = chunkReader.GetRestartIndex().Segments;
+    const ImageRegion region = chunkReader.GetSettings().Region.Resolve(ihdr);
+    const size_t endRow = (size_t)region.Y + region.Height;
+
+    std::vector<DeflatedSpan> spans;
+    std::vector<size_t> spanOffsets;
+    size_t deflatedSize = 0;
+    // A deque never moves its elements, so spans can point into the buffers it holds
+    std::deque<std::vector<uint8_t>> buffers;
+    // Every IDAT is kept until decoding ends, so all of their CRCs are checked while gathering and decoding
+    std::optional<IDATCRCChecker> crcChecker;
+    if (chunkReader.GetSettings().CheckCRC)
+        crcChecker.emplace();
+    ChunkView& chunk = idat;
+    while (chunk.Type != ChunkType::IEND) {
+        if (chunk.Type == ChunkType::IDAT) {
+            const uint32_t length = chunk.Length();
+            const uint8_t* data = chunk.Data;
+            if (!chunk.IsBorrowed()) {
+                buffers.push_back(chunk.ReleaseBuffer());
+                data = buffers.back().data();
+            }
+            if (crcChecker)
+                crcChecker->Push({ data, length, chunk.CRC });
+            if (length > 0) {
+                spans.push_back({ data, length });
+                spanOffsets.push_back(deflatedSize);
+                deflatedSize += length;
+            }
+        }
+        PNG_RETURN_IF_NOT_OK(chunkReader.ReadNext, in, chunk, false);
+    }
+
+    // The last segment is followed by the adler32 checksum of the whole image data
+    const size_t ADLER32_SIZE = 4;
+    bool indexMatches = deflatedSize >= segments.back().Offset + ADLER32_SIZE;
+    if (indexMatches) {
+        PNG_LDEBUGF("PNG::ReadImageData Decoding {} restart segments in parallel.", segments.size());
+        std::vector<Result> results(segments.size(), Result::OK);
+        std::vector<uint32_t> adlers(segments.size(), 1);
+        std::vector<uint64_t> inflatedSizes(segments.size(), 0);
+        std::atomic<bool> decodedAll = true;
+        Utils::Iota<size_t> segmentIndices(segments.size());
+        std::for_each(std::execution::par, segmentIndices.begin(), segmentIndices.end(),
+            [&segments, &spans, &spanOffsets, deflatedSize, &ihdr, &loadRow, &results, &adlers, &inflatedSizes, &decodedAll, &region, endRow](size_t i) {
+                size_t begin = segments[i].Offset;
+                size_t end = i + 1 < segments.size() ? segments[i+1].Offset : deflatedSize - ADLER32_SIZE;
+                size_t lastRow = i + 1 < segments.size() ? segments[i+1].Row : ihdr.Height;
+                // Segments outside of the region are not decoded at all
+                if (lastRow <= region.Y || segments[i].Row >= endRow) {
+                    decodedAll = false;
+                    return;
+                }
+                if (lastRow > endRow)
+                    decodedAll = false;
+                lastRow = std::min(lastRow, endRow);
+
+                BufferQueueStream segment;
+                auto res = PushDeflatedRange(segment, spans, spanOffsets, begin, end);
+                ZLib::InflateStream inflater(segment, true);
+                ScanlineDecoder scanlineDecoder;
+                scanlineDecoder.Reset(ihdr, segments[i].Row);
+                for (size_t y = segments[i].Row; y < lastRow && res == Result::OK; y++) {
+                    const uint8_t* rawRow;
+                    res = scanlineDecoder.DecodeRawRow(inflater, rawRow);
+                    if (res == Result::OK && y >= region.Y)
+                        res = loadRow(y, rawRow);
+                }
+                results[i] = res;
+                adlers[i] = inflater.GetAdler32();
+                inflatedSizes[i] = inflater.GetTotalOut();
+            });
+
+        indexMatches = std::all_of(results.begin(), results.end(), [](Result res) { return res == Result::OK; });
+        // Segments which decode fine may still hold the wrong data, which only the checksum of the whole image can tell
+        // Regions don't decode every segment, like single-threaded reads they then don't check it either
+        if (indexMatches && decodedAll) {
+            uint32_t adler = 1;
+            for (size_t i = 0; i < segments.size(); i++)
+                adler = ZLib::CombineAdler32(adler, adlers[i], inflatedSizes[i]);
+
+            BufferQueueStream trailer;
+            PNG_RETURN_IF_NOT_OK(PushDeflatedRange, trailer, spans, spanOffsets, deflatedSize - ADLER32_SIZE, deflatedSize);
+            uint32_t expectedAdler;
+            PNG_RETURN_IF_NOT_OK(trailer.ReadU32, expectedAdler);
+            indexMatches = adler == expectedAdler;
+        }
+    }
 
-    PNG_LDEBUG("PNG::Image::Read Loading raw pixels into Image.");
-    out.SetSize(ihdr.Width, ihdr.Height);
-    PNG_RETURN_IF_NOT_OK(out.LoadRawPixels, ihdr.ColorType, ihdr.BitDepth, &palette, rawPixels);
+    auto res = Result::OK;
+    if (!indexMatches) {
+        PNG_LDEBUG("PNG::ReadImageData The restart index doesn't match the image data, decoding it from the start.");
+        res = DecodeDeflatedSpans(spans, spanOffsets, deflatedSize, ihdr, region, loadRow);
+    }
+
+    // Corrupted IDATs are most likely the reason why decoding failed
+    if (crcChecker)
+        PNG_RETURN_IF_NOT_OK(crcChecker->Finish);
+    return res;
+}
+
+PNG::Result PNG::ReadImageHead(IStream& in, ChunkReader& chunkReader, ChunkView& idat, bool async)
+{
+    if (!chunkReader.HasReadHeader())
+        PNG_RETURN_IF_NOT_OK(chunkReader.ReadHeader, in);
+    // If color has 0 samples per component then it is not valid
+    PNG_ASSERT(ColorType::GetSamples(chunkReader.GetHeader().ColorType) != 0, "PNG::ReadImageHead ImageHeader::Validate failed to catch Invalid Color Type.");
+    PNG_RETURN_IF_NOT_OK(chunkReader.GetSettings().Region.Validate, chunkReader.GetDecodedHeader());
+
+    // Chunks before image data are read right away, since they tell how it can be decoded
+    // Multi-threaded reads check the CRC of IDATs while decoding, starting from the first one
+    do {
+        PNG_RETURN_IF_NOT_OK(chunkReader.ReadNext, in, idat, !async);
+        if (idat.Type == ChunkType::IEND)
+            return Result::UnexpectedChunkType;
+    } while (idat.Type != ChunkType::IDAT);
+    return Result::OK;
+}
+
+PNG::Result PNG::ReadImageData(IStream& in, ChunkReader& chunkReader, ChunkView& idat, const RawRowLoader& loadRow, bool async,
+    const Adam7::PassCallback& onPass)
+{
+    // Restart indices are only worth using if segments can be decoded at the same time
+    if (async && !chunkReader.GetRestartIndex().Segments.empty())
+        return ReadRestartSegments(in, chunkReader, idat, loadRow);
+    return ReadPipelined(in, chunkReader, idat, loadRow, async, onPass);
+}
+
+PNG::Result PNG::Image::Read(IStream& _in, PNG::Image& out, const ImportSettings& cfg, bool async)
+{
+    BufferedIStream bufferedIn(_in, cfg.ReadBufferSize);
+    IStream& in = cfg.ReadBufferSize > 0 && !_in.IsBuffered() ? bufferedIn : _in;
+
+    ChunkReader chunkReader(cfg);
+    ChunkView idat;
+    PNG_RETURN_IF_NOT_OK(ReadImageHead, in, chunkReader, idat, async);
+    const ImageHeader& ihdr = chunkReader.GetHeader();
+    const ImageRegion region = cfg.Region.Resolve(chunkReader.GetDecodedHeader());
+    // Raw rows are unpacked, so the region starts at the same byte of each one
+    const size_t regionOffset = region.X * ColorType::GetSamples(ihdr.ColorType) * ColorType::GetBytesPerSample(ihdr.BitDepth);
+
+    Image img(region.Width, region.Height);
+    auto loadRow = [&ihdr, &chunkReader, &img, &region, regionOffset](size_t y, const uint8_t* rawRow) {
+        return LoadRawRow(ihdr.ColorType, ihdr.BitDepth, &chunkReader.GetPalette(), rawRow + regionOffset, region.Width, img[y - region.Y]);
+    };
+    Adam7::PassCallback onPass;
+    if (cfg.Adam7PassCallback) {
+        onPass = [&cfg, &img](size_t pass) {
+            return cfg.Adam7PassCallback(pass, img);
+        };
+    }
+    PNG_RETURN_IF_NOT_OK(ReadImageData, in, chunkReader, idat, loadRow, async, onPass);
+    out = std::move(img);
 
     if (cfg.IHDROut)
         *cfg.IHDROut = ihdr;
     if (cfg.PaletteOut)
-        *cfg.PaletteOut = std::move(palette);
+        *cfg.PaletteOut = std::move(chunkReader.GetPalette());
 
     return Result::OK;
 }
 
-PNG::Result PNG::Image::Write(OStream& out, const ExportSettings& cfg, bool async) const
+// Splits `in` into IDAT chunks of at most `idatSize` bytes
+static PNG::Result WriteIDATChunks(PNG::IStream& in, PNG::OStream& out, uint32_t idatSize)
 {
-    auto launchPolicy = async ? std::launch::async : std::launch::deferred;
+    using namespace PNG;
 
-    PNG_RETURN_IF_NOT_OK(cfg.Validate);
-    PNG_RETURN_IF_NOT_OK(out.WriteBuffer, PNG_SIGNATURE, PNG_SIGNATURE_LEN);
-    PNG_RETURN_IF_NOT_OK(out.Flush);
+    Chunk chunk;
+    chunk.Type = ChunkType::IDAT;
 
-    ImageHeader ihdr {
-        .Width = (uint32_t)m_Width,
-        .Height = (uint32_t)m_Height,
-        .BitDepth = (uint8_t)cfg.BitDepth,
-        .ColorType = cfg.ColorType,
-        .CompressionMethod = CompressionMethod::ZLIB,
-        .FilterMethod = FilterMethod::ADAPTIVE_FILTERING,
-        .InterlaceMethod = cfg.InterlaceMethod,
-    };
+    while (true) {
+        chunk.Data.resize(idatSize);
+
+        size_t bRead;
+        auto rres = in.ReadVector(chunk.Data, &bRead);
+        if (rres == Result::EndOfFile)
+            break;
+        else if (rres != Result::OK)
+            return rres;
+
+        chunk.Data.resize(bRead);
+        chunk.CRC = chunk.CalculateCRC();
 
-    { // Writing PNG Head
-        Chunk chunk;
-        // ImageHeader::Write also calls ImageHeader::Validate and, therefore checks if Width and Height are valid
-        PNG_RETURN_IF_NOT_OK(ihdr.Write, chunk);
         PNG_RETURN_IF_NOT_OK(chunk.Write, out);
+        PNG_RETURN_IF_NOT_OK(out.Flush);
+    }
 
-        if (cfg.Metadata) {
-            for (size_t i = 0; i < cfg.Metadata->size(); i++) {
-                const TextualData& textualData = (*cfg.Metadata)[i];
-                PNG_RETURN_IF_NOT_OK(textualData.Write, chunk, cfg.CompressionLevel);
-                PNG_RETURN_IF_NOT_OK(chunk.Write, out);
-            }
-        }
+    return Result::OK;
+}
+
+PNG::Result PNG::WriteImageHead(OStream& out, const ImageHeader& ihdr, const ExportSettings& cfg)
+{
+    PNG_RETURN_IF_NOT_OK(out.WriteBuffer, PNG_SIGNATURE, PNG_SIGNATURE_LEN);
+    PNG_RETURN_IF_NOT_OK(out.Flush);
 
-        if (cfg.LastModificationTime) {
-            PNG_RETURN_IF_NOT_OK(cfg.LastModificationTime->Write, chunk);
+    Chunk chunk;
+    // ImageHeader::Write also calls ImageHeader::Validate and, therefore checks if Width and Height are valid
+    PNG_RETURN_IF_NOT_OK(ihdr.Write, chunk);
+    PNG_RETURN_IF_NOT_OK(chunk.Write, out);
+
+    if (cfg.Metadata) {
+        for (size_t i = 0; i < cfg.Metadata->size(); i++) {
+            const TextualData& textualData = (*cfg.Metadata)[i];
+            PNG_RETURN_IF_NOT_OK(textualData.Write, chunk, cfg.CompressionLevel);
             PNG_RETURN_IF_NOT_OK(chunk.Write, out);
         }
+    }
 
-        if (ihdr.ColorType == ColorType::PALETTE) {
-            std::vector<uint8_t> tRNS(cfg.Palette->size(), 255);
-            size_t lastAlpha = tRNS.size();
+    if (cfg.LastModificationTime) {
+        PNG_RETURN_IF_NOT_OK(cfg.LastModificationTime->Write, chunk);
+        PNG_RETURN_IF_NOT_OK(chunk.Write, out);
+    }
 
-            PNG_ASSERT(cfg.Palette, "PNG::Image::Write Early palette check failed.");
-            chunk.Type = ChunkType::PLTE;
-            chunk.Data.resize(cfg.Palette->size() * 3);
-            for (size_t i = 0; i < cfg.Palette->size(); i++) {
-                const Color& color = (*cfg.Palette)[i];
-                chunk.Data[i*3  ] = (uint8_t)(color.R * 255);
-                chunk.Data[i*3+1] = (uint8_t)(color.G * 255);
-                chunk.Data[i*3+2] = (uint8_t)(color.B * 255);
-                if (cfg.PaletteAlpha && color.A < 1.0) {
-                    lastAlpha = i;
-                    tRNS[i] = (uint8_t)(color.A * 255);
-                }
+    if (ihdr.ColorType == ColorType::PALETTE) {
+        std::vector<uint8_t> tRNS(cfg.Palette->size(), 255);
+        size_t lastAlpha = tRNS.size();
+
+        PNG_ASSERT(cfg.Palette, "PNG::WriteImageHead Early palette check failed.");
+        chunk.Type = ChunkType::PLTE;
+        chunk.Data.resize(cfg.Palette->size() * 3);
+        for (size_t i = 0; i < cfg.Palette->size(); i++) {
+            const Color& color = (*cfg.Palette)[i];
+            chunk.Data[i*3  ] = (uint8_t)(color.R * 255);
+            chunk.Data[i*3+1] = (uint8_t)(color.G * 255);
+            chunk.Data[i*3+2] = (uint8_t)(color.B * 255);
+            if (cfg.PaletteAlpha && color.A < 1.0) {
+                lastAlpha = i;
+                tRNS[i] = (uint8_t)(color.A * 255);
             }
+        }
+        chunk.CRC = chunk.CalculateCRC();
+        PNG_RETURN_IF_NOT_OK(chunk.Write, out);
+
+        // lastAlpha is changed only if cfg.PaletteAlpha is true, so we do not need to check that option
+        if (lastAlpha < tRNS.size()) {
+            tRNS.resize(lastAlpha+1);
+            chunk.Type = ChunkType::tRNS;
+            chunk.Data = std::move(tRNS);
             chunk.CRC = chunk.CalculateCRC();
             PNG_RETURN_IF_NOT_OK(chunk.Write, out);
-
-            // lastAlpha is changed only if cfg.PaletteAlpha is true, so we do not need to check that option
-            if (lastAlpha < tRNS.size()) {
-                tRNS.resize(lastAlpha+1);
-                chunk.Type = ChunkType::tRNS;
-                chunk.Data = std::move(tRNS);
-                chunk.CRC = chunk.CalculateCRC();
-                PNG_RETURN_IF_NOT_OK(chunk.Write, out);
-            }
         }
-
-        // Flushing everything at the end should be more efficient, since it reallocates memory only once
-        PNG_RETURN_IF_NOT_OK(out.Flush);
     }
 
-    DynamicByteStream rawImage;
-    std::future<Result> rawWriter;
-    if (ihdr.ColorType == ColorType::PALETTE) {
-        PNG_ASSERT(cfg.Palette, "PNG::Image::Write Early palette check failed.");
-        rawWriter = std::async(launchPolicy, &Image::WriteDitheredRawPixels, this, std::ref(*cfg.Palette),
-            (size_t)ihdr.BitDepth, cfg.DitheringMethod, std::ref(rawImage));
-    } else
-        rawWriter = std::async(launchPolicy, &Image::WriteRawPixels, this, ihdr.ColorType, ihdr.BitDepth, std::ref(rawImage));
-
-    size_t samples = ColorType::GetSamples(cfg.ColorType);
-    PNG_ASSERT(samples, "PNG::Image::Write Early color type check failed.");
+    // Flushing everything at the end should be more efficient, since it reallocates memory only once
+    return out.Flush();
+}
 
-    DynamicByteStream inf;
-    auto interlacer = std::async(launchPolicy, InterlacePixels, ihdr.InterlaceMethod, ihdr.FilterMethod,
-            ihdr.Width, ihdr.Height, ihdr.BitDepth, samples, cfg.CompressionLevel, std::ref(rawImage), std::ref(inf));
+PNG::Result PNG::WriteImageEnd(OStream& out)
+{
+    Chunk chunk;
+    chunk.Type = ChunkType::IEND;
+    chunk.Data.resize(0);
+    chunk.CRC = chunk.CalculateCRC();
+    PNG_RETURN_IF_NOT_OK(chunk.Write, out);
+    return out.Flush();
+}
 
-    DynamicByteStream def;
-    auto deflater = std::async(launchPolicy, CompressData, ihdr.CompressionMethod, std::ref(inf), std::ref(def), cfg.CompressionLevel);
+PNG::Result PNG::WriteImageData(OStream& out, const ImageHeader& ihdr, const ExportSettings& cfg, const RawPixelsWriter& writeRawPixels, bool async)
+{
+    auto launchPolicy = async ? std::launch::async : std::launch::deferred;
 
-    auto idatWriter = std::async(launchPolicy, [&cfg, &out, &def]() {
-        // Split IDAT chunks
-        Chunk chunk;
-        chunk.Type = ChunkType::IDAT;
+    // The pipeline has 3 pipes, each one gets a third of the budget
+    // Unbounded pipes are needed by single-threaded writes, see CreatePipelineStream
+    const size_t pipeCapacity = async && cfg.MaxPipelineBytes > 0 ? std::max<size_t>(cfg.MaxPipelineBytes / 3, 1) : 0;
 
-        while (true) {
-            chunk.Data.resize(cfg.IDATSize);
+    auto rawImagePipe = CreatePipelineStream(pipeCapacity);
+    PipelineStream& rawImage = *rawImagePipe;
+    auto rawWriter = std::async(launchPolicy, writeRawPixels, std::ref(rawImage));
 
-            size_t bRead;
-            auto rres = def.ReadVector(chunk.Data, &bRead);
-            if (rres == Result::EndOfFile)
-                break;
-            else if (rres != Result::OK)
-                return rres;
+    size_t samples = ColorType::GetSamples(ihdr.ColorType);
+    PNG_ASSERT(samples, "PNG::WriteImageData Early color type check failed.");
+
+    // Each stage stops reading its input pipe when it returns, so that the previous one never waits on a full pipe
+    auto infPipe = CreatePipelineStream(pipeCapacity);
+    PipelineStream& inf = *infPipe;
+    // Multi-threaded writes also filter bands of rows in parallel, since filtering is often slower than deflating
+    // Images with restart segments are validated to be non-interlaced
+    const bool hasRestartIndex = cfg.RestartInterval > 0;
+    auto interlacer = std::async(launchPolicy, [&ihdr, samples, &cfg, &rawImage, &inf, async, hasRestartIndex]() {
+        auto res = hasRestartIndex ?
+            FilterPixels(ihdr.FilterMethod, ihdr.Width, ihdr.Height, ihdr.BitDepth * samples, cfg.CompressionLevel, rawImage, inf, async, cfg.RestartInterval) :
+            InterlacePixels(ihdr.InterlaceMethod, ihdr.FilterMethod,
+                ihdr.Width, ihdr.Height, ihdr.BitDepth, samples, cfg.CompressionLevel, rawImage, inf, async);
+        rawImage.StopReading();
+        return res;
+    });
 
-            chunk.Data.resize(bRead);
-            chunk.CRC = chunk.CalculateCRC();
+    // The restart index comes before image data, so image data must be fully deflated before it's written
+    // In that case the deflated data can't be read while being written, so its pipe is unbounded
+    auto defPipe = CreatePipelineStream(hasRestartIndex ? 0 : pipeCapacity);
+    PipelineStream& def = *defPipe;
+    RestartIndex restartIndex;
+    auto deflater = std::async(launchPolicy, [&ihdr, &cfg, &inf, &def, async, hasRestartIndex, samples, &restartIndex]() {
+        const size_t threads = async ? cfg.CompressionThreads : 1;
+        auto res = Result::OK;
+        if (hasRestartIndex) {
+            // Each filtered row starts with its filter type
+            const size_t filteredRowSize = BitsToBytes(ihdr.Width * ihdr.BitDepth * samples) + 1;
+            std::vector<uint64_t> offsets;
+            res = CompressSegments(ihdr.CompressionMethod, inf, def, cfg.CompressionLevel,
+                filteredRowSize * cfg.RestartInterval, threads, offsets);
+            for (size_t i = 0; i < offsets.size(); i++)
+                restartIndex.Segments.push_back({ .Row = (uint32_t)(i * cfg.RestartInterval), .Offset = offsets[i] });
+        } else
+            res = CompressData(ihdr.CompressionMethod, inf, def, cfg.CompressionLevel, threads);
+        inf.StopReading();
+        return res;
+    });
 
+    auto idatWriter = std::async(hasRestartIndex ? std::launch::deferred : launchPolicy, [&cfg, &out, &def, hasRestartIndex, &restartIndex]() {
+        if (hasRestartIndex) {
+            Chunk chunk;
+            PNG_RETURN_IF_NOT_OK(restartIndex.Write, chunk);
             PNG_RETURN_IF_NOT_OK(chunk.Write, out);
-            PNG_RETURN_IF_NOT_OK(out.Flush);
         }
-
-        return Result::OK;
+        auto res = WriteIDATChunks(def, out, cfg.IDATSize);
+        def.StopReading();
+        return res;
     });
 
-    PNG_LDEBUG("PNG::Image::Write Waiting for Raw Writer.");
+    PNG_LDEBUG("PNG::WriteImageData Waiting for Raw Writer.");
     rawWriter.wait();
     rawImage.Close();
 
-    PNG_LDEBUG("PNG::Image::Write Waiting for Interlacer.");
+    PNG_LDEBUG("PNG::WriteImageData Waiting for Interlacer.");
     interlacer.wait();
     inf.Close();
 
-    PNG_LDEBUG("PNG::Image::Write Waiting for IDAT Deflater.");
+    PNG_LDEBUG("PNG::WriteImageData Waiting for IDAT Deflater.");
     deflater.wait();
     def.Close();
 
-    PNG_LDEBUG("PNG::Image::Write Waiting for IDAT Writer.");
+    PNG_LDEBUG("PNG::WriteImageData Waiting for IDAT Writer.");
     idatWriter.wait();
 
-    PNG_LDEBUG("PNG::Image::Write Checking Raw Writer result.");
+    PNG_LDEBUG("PNG::WriteImageData Checking Raw Writer result.");
     PNG_RETURN_IF_NOT_OK(rawWriter.get);
-    PNG_LDEBUG("PNG::Image::Write Checking Interlacer result.");
+    PNG_LDEBUG("PNG::WriteImageData Checking Interlacer result.");
     PNG_RETURN_IF_NOT_OK(interlacer.get);
-    PNG_LDEBUG("PNG::Image::Write Checking IDAT Deflater result.");
+    PNG_LDEBUG("PNG::WriteImageData Checking IDAT Deflater result.");
     PNG_RETURN_IF_NOT_OK(deflater.get);
-    PNG_LDEBUG("PNG::Image::Write Checking IDAT Writer result.");
+    PNG_LDEBUG("PNG::WriteImageData Checking IDAT Writer result.");
     PNG_RETURN_IF_NOT_OK(idatWriter.get);
 
-    {
-        Chunk chunk;
-        chunk.Type = ChunkType::IEND;
-        chunk.Data.resize(0);
-        chunk.CRC = chunk.CalculateCRC();
-        PNG_RETURN_IF_NOT_OK(chunk.Write, out);
-        PNG_RETURN_IF_NOT_OK(out.Flush);
-    }
-
     return Result::OK;
 }
+
+PNG::Result PNG::Image::Write(OStream& _out, const ExportSettings& cfg, bool async) const
+{
+    PNG_RETURN_IF_NOT_OK(cfg.Validate);
+
+    // WriteImageEnd flushes the buffered stream
+    BufferedOStream bufferedOut(_out, cfg.WriteBufferSize);
+    OStream& out = cfg.WriteBufferSize > 0 && !_out.IsBuffered() ? bufferedOut : _out;
+
+    ImageHeader ihdr {
+        .Width = (uint32_t)m_Width,
+        .Height = (uint32_t)m_Height,
+        .BitDepth = (uint8_t)cfg.BitDepth,
+        .ColorType = cfg.ColorType,
+        .CompressionMethod = CompressionMethod::ZLIB,
+        .FilterMethod = FilterMethod::ADAPTIVE_FILTERING,
+        .InterlaceMethod = cfg.InterlaceMethod,
+    };
+
+    PNG_RETURN_IF_NOT_OK(WriteImageHead, out, ihdr, cfg);
+
+    auto writeRawPixels = [this, &ihdr, &cfg](OStream& rawImage) {
+        if (ihdr.ColorType == ColorType::PALETTE) {
+            PNG_ASSERT(cfg.Palette, "PNG::Image::Write Early palette check failed.");
+            return WriteDitheredRawPixels(*cfg.Palette, ihdr.BitDepth, cfg.DitheringMethod, rawImage);
+        }
+        return WriteRawPixels(ihdr.ColorType, ihdr.BitDepth, rawImage);
+    };
+    PNG_RETURN_IF_NOT_OK(WriteImageData, out, ihdr, cfg, writeRawPixels, async);
+
+    return WriteImageEnd(out);
+}
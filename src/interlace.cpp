@@ -3,7 +3,7 @@
 #include "png/filter.h"
 
 PNG::Result PNG::Adam7::InterlacePixels(uint8_t filterMethod, size_t width, size_t height,
-    size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out)
+    size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out, bool parallel)
 {
     // http://www.libpng.org/pub/png/spec/1.2/PNG-Decoders.html#D.Progressive-display
     const size_t STARTING_COL[7] { 0, 4, 0, 2, 0, 1, 0 };
@@ -51,14 +51,53 @@ PNG::Result PNG::Adam7::InterlacePixels(uint8_t filterMethod, size_t width, size
         size_t passWidth = passImage.size() / (pixelSize * passHeight);
 
         ByteStream passIn(passImage);
-        PNG_RETURN_IF_NOT_OK(FilterPixels, filterMethod, passWidth, passHeight, bitDepth*samples, clevel, passIn, out);
+        PNG_RETURN_IF_NOT_OK(FilterPixels, filterMethod, passWidth, passHeight, bitDepth*samples, clevel, passIn, out, parallel);
     }
 
     return Result::OK;
 }
 
+// The size of the area each pixel of the grid held by the first N passes stands for, see PNG::Adam7::GetPassGridSize()
+static const size_t PASS_CELL_WIDTH[7]  { 8, 4, 4, 2, 2, 1, 1 };
+static const size_t PASS_CELL_HEIGHT[7] { 8, 8, 4, 4, 2, 2, 1 };
+
 PNG::Result PNG::Adam7::DeinterlacePixels(uint8_t filterMethod, size_t width, size_t height,
-    size_t bitDepth, size_t samples, IStream& in, std::vector<uint8_t>& _out)
+    size_t bitDepth, size_t samples, IStream& in, std::vector<uint8_t>& out)
+{
+    return DeinterlacePasses(filterMethod, width, height, bitDepth, samples, 7, true, in, out);
+}
+
+void PNG::Adam7::GetPassGridSize(size_t passes, size_t width, size_t height, size_t& gridWidth, size_t& gridHeight)
+{
+    PNG_ASSERT(passes >= 1 && passes <= 7, "PNG::Adam7::GetPassGridSize Adam7 has passes from 1 to 7.");
+    size_t cellWidth = PASS_CELL_WIDTH[passes-1];
+    size_t cellHeight = PASS_CELL_HEIGHT[passes-1];
+    gridWidth = (width + cellWidth - 1) / cellWidth;
+    gridHeight = (height + cellHeight - 1) / cellHeight;
+}
+
+// Fills each `cellWidth`x`cellHeight` block of `out` with its top-left pixel
+static void ReplicateBlocks(PNG::ArrayView2D<uint8_t>& out, size_t width, size_t height, size_t pixelSize, size_t cellWidth, size_t cellHeight)
+{
+    if (cellWidth == 1 && cellHeight == 1)
+        return;
+
+    // Rows which hold the top-left pixels are filled first, the others are copies of the last one of those
+    for (size_t y = 0; y < height; y++) {
+        if (y % cellHeight != 0) {
+            memcpy(out[y], out[y - y % cellHeight], width*pixelSize);
+            continue;
+        }
+        for (size_t x = 0; x < width; x++) {
+            if (x % cellWidth != 0)
+                memcpy(&out[y][x*pixelSize], &out[y][(x - x % cellWidth)*pixelSize], pixelSize);
+        }
+    }
+}
+
+PNG::Result PNG::Adam7::DeinterlacePasses(uint8_t filterMethod, size_t width, size_t height,
+    size_t bitDepth, size_t samples, size_t passes, bool expand, IStream& in, std::vector<uint8_t>& _out,
+    const PassCallback& onPass)
 {
     // http://www.libpng.org/pub/png/spec/1.2/PNG-Decoders.html#D.Progressive-display
     const size_t STARTING_COL[7] { 0, 4, 0, 2, 0, 1, 0 };
@@ -66,52 +105,65 @@ PNG::Result PNG::Adam7::DeinterlacePixels(uint8_t filterMethod, size_t width, si
     const size_t COL_OFFSET[7]   { 8, 8, 4, 4, 2, 2, 1 };
     const size_t ROW_OFFSET[7]   { 8, 8, 8, 4, 4, 2, 2 };
 
+    PNG_ASSERT(passes >= 1 && passes <= 7, "PNG::Adam7::DeinterlacePasses Adam7 has passes from 1 to 7.");
+    // The pixels of the first N passes lie on a grid, each one is at the top-left corner of its cell
+    size_t outWidth = width, outHeight = height;
+    if (!expand)
+        GetPassGridSize(passes, width, height, outWidth, outHeight);
+    const size_t colScale = expand ? 1 : PASS_CELL_WIDTH[passes-1];
+    const size_t rowScale = expand ? 1 : PASS_CELL_HEIGHT[passes-1];
+
     // PNG::UnfilterPixels also unpacks pixels
     size_t pixelSize = BitsToBytes(bitDepth) * samples;
-    _out.resize(width*height*pixelSize);
-    ArrayView2D<uint8_t> out(_out.data(), 0, width*pixelSize);
+    _out.resize(outWidth*outHeight*pixelSize);
+    ArrayView2D<uint8_t> out(_out.data(), 0, outWidth*pixelSize);
 
     std::vector<uint8_t> passImage;
-    for (size_t pass = 0; pass < 7; pass++) {
+    for (size_t pass = 0; pass < passes; pass++) {
         size_t passWidth = width / COL_OFFSET[pass];
         size_t lastRowSize = width % COL_OFFSET[pass];
         if (lastRowSize != 0 && lastRowSize > STARTING_COL[pass])
             passWidth++;
 
-        if (passWidth == 0)
-            continue;
-
         size_t passHeight = height / ROW_OFFSET[pass];
         size_t lastColSize = height % ROW_OFFSET[pass];
         if (lastColSize != 0 && lastColSize > STARTING_ROW[pass])
             passHeight++;
 
-        if (passHeight == 0)
-            continue;
-
-        PNG_RETURN_IF_NOT_OK(UnfilterPixels, filterMethod, passWidth, passHeight, bitDepth*samples, in, passImage);
-
-        for (size_t py = 0; py < passHeight; py++) {
-            for (size_t px = 0; px < passWidth; px++) {
-                size_t outY = STARTING_ROW[pass] + py * ROW_OFFSET[pass];
-                size_t outI = (STARTING_COL[pass] + px * COL_OFFSET[pass]) * pixelSize;
-                size_t passI = (py*passWidth+px) * pixelSize;
-                memcpy(&out[outY][outI], &passImage[passI], pixelSize);
+        // Small images may have empty passes
+        if (passWidth > 0 && passHeight > 0) {
+            PNG_RETURN_IF_NOT_OK(UnfilterPixels, filterMethod, passWidth, passHeight, bitDepth*samples, in, passImage);
+
+            for (size_t py = 0; py < passHeight; py++) {
+                for (size_t px = 0; px < passWidth; px++) {
+                    size_t outY = (STARTING_ROW[pass] + py * ROW_OFFSET[pass]) / rowScale;
+                    size_t outI = (STARTING_COL[pass] + px * COL_OFFSET[pass]) / colScale * pixelSize;
+                    size_t passI = (py*passWidth+px) * pixelSize;
+                    memcpy(&out[outY][outI], &passImage[passI], pixelSize);
+                }
             }
         }
+
+        // Blocks are overwritten by the pixels of later passes, so they only need filling when someone looks at them
+        if (onPass || (expand && pass + 1 == passes)) {
+            ReplicateBlocks(out, outWidth, outHeight, pixelSize,
+                PASS_CELL_WIDTH[pass] / colScale, PASS_CELL_HEIGHT[pass] / rowScale);
+        }
+        if (onPass)
+            PNG_RETURN_IF_NOT_OK(onPass, pass + 1);
     }
 
     return Result::OK;
 }
 
 PNG::Result PNG::InterlacePixels(uint8_t method, uint8_t filterMethod, size_t width, size_t height,
-    size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out)
+    size_t bitDepth, size_t samples, CompressionLevel clevel, IStream& in, OStream& out, bool parallel)
 {
     switch (method) {
     case InterlaceMethod::NONE:
-        return FilterPixels(filterMethod, width, height, bitDepth * samples, clevel, in, out);
+        return FilterPixels(filterMethod, width, height, bitDepth * samples, clevel, in, out, parallel);
     case InterlaceMethod::ADAM7:
-        return Adam7::InterlacePixels(filterMethod, width, height, bitDepth, samples, clevel, in, out);
+        return Adam7::InterlacePixels(filterMethod, width, height, bitDepth, samples, clevel, in, out, parallel);
     default:
         return Result::UnknownInterlaceMethod;
     }
@@ -51,6 +51,13 @@ int main(int argc, char** argv)
         ASSERT_OK(PNG::Image::Read, inFile, img);
     });
 
+    bench("Memory Mapped Image Reading", [&filePath]() {
+        PNG::MappedFileStream inFile;
+        ASSERT_OK(inFile.Open, filePath);
+        PNG::Image img;
+        ASSERT_OK(PNG::Image::ReadMT, inFile, img);
+    });
+
     PNG::Image img;
     bench("Multi Threaded Image Reading", [&filePath, &img]() {
         std::ifstream file(filePath, std::ios::binary);
@@ -0,0 +1,35 @@
+#include "png/probe.h"
+
+#include "png/image.h"
+
+PNG::Result PNG::Probe(IStream& in, ProbeResult& out, const ProbeSettings& cfg)
+{
+    out = ProbeResult{};
+
+    ImportSettings importCfg;
+    importCfg.MetadataOut = &out.Metadata;
+    importCfg.LastModificationTimeOut = &out.LastModificationTime;
+    importCfg.CheckCRC = cfg.CheckCRC;
+    importCfg.MetadataKeywords = cfg.MetadataKeywords;
+    importCfg.LazyMetadata = cfg.LazyMetadata;
+
+    ChunkReader chunkReader(importCfg);
+    PNG_RETURN_IF_NOT_OK(chunkReader.ReadHeader, in);
+
+    ChunkView chunk;
+    while (true) {
+        PNG_RETURN_IF_NOT_OK(chunkReader.ReadNextSkippingIDAT, in, chunk);
+        if (chunk.Type == ChunkType::IEND)
+            break;
+        if (chunk.Type == ChunkType::IDAT && !cfg.ReadTrailingChunks)
+            break;
+    }
+
+    if (!chunkReader.HasRead(ChunkType::IDAT))
+        return Result::UnexpectedChunkType;
+
+    out.IHDR = chunkReader.GetHeader();
+    out.Palette = std::move(chunkReader.GetPalette());
+    out.HasLastModificationTime = chunkReader.HasRead(ChunkType::tIME);
+    return Result::OK;
+}
@@ -0,0 +1,370 @@
+#include "png/scanline.h"
+
+#include "png/filter.h"
+#include "png/interlace.h"
+
+#include <algorithm>
+#include <cstring>
+
+void PNG::ScanlineDecoder::Reset(const ImageHeader& ihdr, size_t firstRow)
+{
+    m_IHDR = ihdr;
+    m_FirstRow = firstRow;
+    m_Row = firstRow;
+
+    m_PixelBits = ColorType::GetSamples(ihdr.ColorType) * ihdr.BitDepth;
+    size_t rowSize = BitsToBytes(ihdr.Width * m_PixelBits);
+    m_PrevRow.assign(rowSize, 0);
+    m_CurRow.assign(rowSize, 0);
+    // Packed pixels are unpacked before being converted
+    m_Unpacked.resize(m_PixelBits < 8 ? ihdr.Width : 0);
+}
+
+PNG::Result PNG::ScanlineDecoder::DecodeRow(IStream& in, const Palette_T& palette, Color* row)
+{
+    const uint8_t* rawRow;
+    PNG_RETURN_IF_NOT_OK(DecodeRawRow, in, rawRow);
+    return Image::LoadRawRow(m_IHDR.ColorType, m_IHDR.BitDepth, &palette, rawRow, m_IHDR.Width, row);
+}
+
+PNG::Result PNG::ScanlineDecoder::DecodeRawRow(IStream& in, const uint8_t*& rawRow)
+{
+    uint8_t filterType;
+    PNG_RETURN_IF_NOT_OK(in.ReadU8, filterType);
+    // Other decoders would unfilter the first row using the one before it
+    if (m_Row == m_FirstRow && m_Row > 0 &&
+        filterType != AdaptiveFiltering::FilterType::NONE &&
+        filterType != AdaptiveFiltering::FilterType::SUB
+    ) {
+        return Result::InvalidRestartIndex;
+    }
+
+    // The current row becomes the previous one
+    std::swap(m_PrevRow, m_CurRow);
+    PNG_RETURN_IF_NOT_OK(in.ReadBuffer, m_CurRow.data(), m_CurRow.size());
+
+    auto ures = AdaptiveFiltering::UnfilterRow(filterType, m_CurRow.data(),
+        m_Row > m_FirstRow ? m_PrevRow.data() : nullptr, m_CurRow.size(), BitsToBytes(m_PixelBits));
+    if (ures != Result::OK) {
+        PNG_LDEBUGF("PNG::ScanlineDecoder::DecodeRow Unknown filter type {} in image {}x{} (pb={},y={}).",
+            filterType, m_IHDR.Width, m_IHDR.Height, m_PixelBits, m_Row);
+        return ures;
+    }
+
+    rawRow = m_CurRow.data();
+    if (m_PixelBits < 8) {
+        UnpackPixels(m_CurRow.data(), m_Unpacked.data(), m_IHDR.Width, m_PixelBits);
+        rawRow = m_Unpacked.data();
+    }
+
+    m_Row++;
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::IDATStream::Open()
+{
+    do {
+        PNG_RETURN_IF_NOT_OK(ReadNextChunk);
+        if (m_Chunk.Type == ChunkType::IEND)
+            return Result::UnexpectedChunkType;
+    } while (m_Chunk.Type != ChunkType::IDAT);
+    m_Finished = false;
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::IDATStream::ReadNextChunk()
+{
+    m_Offset = 0;
+    auto res = m_Reader.ReadNext(m_In, m_Chunk);
+    if (res != Result::OK) {
+        // The chunk may hold a length but no data, it must never be read from
+        m_Chunk.ReleaseBuffer();
+        m_Error = res;
+    }
+    return res;
+}
+
+PNG::Result PNG::ScanlineReader::IDATStream::NextChunk()
+{
+    if (m_Error != Result::OK)
+        return m_Error;
+    if (m_Finished)
+        return Result::EndOfFile;
+
+    // IDATs may be empty
+    while (m_Offset >= m_Chunk.Length()) {
+        PNG_RETURN_IF_NOT_OK(ReadNextChunk);
+        if (m_Chunk.Type != ChunkType::IDAT) {
+            // The chunk was already handled by the ChunkReader
+            m_Finished = true;
+            return Result::EndOfFile;
+        }
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::IDATStream::ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead)
+{
+    uint8_t* out = (uint8_t*)buf;
+    size_t totalRead = 0;
+    while (totalRead < bufLen) {
+        auto res = NextChunk();
+        if (res == Result::EndOfFile)
+            break;
+        else if (res != Result::OK)
+            return res;
+
+        size_t readSize = std::min(bufLen - totalRead, m_Chunk.Length() - m_Offset);
+        memcpy(out + totalRead, m_Chunk.Data + m_Offset, readSize);
+        m_Offset += readSize;
+        totalRead += readSize;
+    }
+
+    if (bytesRead) {
+        *bytesRead = totalRead;
+        if (totalRead == 0 && bufLen > 0)
+            return Result::EndOfFile;
+    } else if (totalRead < bufLen)
+        return Result::UnexpectedEOF;
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::IDATStream::ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed)
+{
+    auto res = NextChunk();
+    if (res == Result::EndOfFile) {
+        if (!bytesViewed)
+            return viewLen == 0 ? Result::OK : Result::UnexpectedEOF;
+        *bytesViewed = 0;
+        return Result::EndOfFile;
+    } else if (res != Result::OK)
+        return res;
+
+    // Views can't span multiple chunks
+    size_t avail = m_Chunk.Length() - m_Offset;
+    if (avail < viewLen) {
+        if (!bytesViewed)
+            return Result::UnsupportedStreamOperation;
+        viewLen = avail;
+    }
+
+    view = m_Chunk.Data + m_Offset;
+    m_Offset += viewLen;
+    if (bytesViewed)
+        *bytesViewed = viewLen;
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::Open(IStream& in, const ImportSettings& cfg)
+{
+    m_Inflater.reset();
+    m_IDAT.reset();
+    m_ChunkReader = ChunkReader(cfg);
+    m_Error = Result::OK;
+
+    PNG_RETURN_IF_NOT_OK(m_ChunkReader.ReadHeader, in);
+    const ImageHeader& ihdr = GetHeader();
+    if (ihdr.InterlaceMethod != InterlaceMethod::NONE)
+        return Result::UnsupportedInterlaceMethod;
+    else if (ihdr.CompressionMethod != CompressionMethod::ZLIB)
+        return Result::UnknownCompressionMethod;
+    else if (ihdr.FilterMethod != FilterMethod::ADAPTIVE_FILTERING)
+        return Result::UnknownFilterMethod;
+
+    // Reading up to the first IDAT makes sure that the palette is complete
+    auto idat = std::make_unique<IDATStream>(in, m_ChunkReader);
+    PNG_RETURN_IF_NOT_OK(idat->Open);
+
+    m_Decoder.Reset(ihdr);
+    m_IDAT = std::move(idat);
+    m_Inflater = std::make_unique<ZLib::InflateStream>(*m_IDAT);
+
+    if (cfg.IHDROut)
+        *cfg.IHDROut = ihdr;
+    if (cfg.PaletteOut)
+        *cfg.PaletteOut = GetPalette();
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineReader::ReadRow(Color* row)
+{
+    if (m_Error != Result::OK)
+        return m_Error;
+    if (!m_Inflater || GetCurrentRow() >= GetHeight())
+        return Result::EndOfFile;
+    return Latch(m_Decoder.DecodeRow(*m_Inflater, GetPalette(), row));
+}
+
+PNG::Result PNG::ScanlineReader::Finish()
+{
+    if (m_Error != Result::OK)
+        return m_Error;
+    if (!m_Inflater)
+        return Result::OK;
+    return Latch(FinishImageData());
+}
+
+PNG::Result PNG::ScanlineReader::Latch(Result res)
+{
+    if (res != Result::OK)
+        m_Error = res;
+    return res;
+}
+
+PNG::Result PNG::ScanlineReader::FinishImageData()
+{
+    // Rows which were not read are still inflated to check the integrity of the image data
+    uint8_t discard[4096];
+    size_t bytesRead;
+    Result res;
+    while ((res = m_Inflater->ReadBuffer(discard, sizeof(discard), &bytesRead)) == Result::OK);
+    if (res != Result::EndOfFile)
+        return res;
+
+    // Anything after the end of the zlib stream is ignored
+    while ((res = m_IDAT->ReadBuffer(discard, sizeof(discard), &bytesRead)) == Result::OK);
+    if (res != Result::EndOfFile)
+        return res;
+
+    // m_IDAT already read the chunk after the last IDAT
+    ChunkView chunk;
+    while (!m_ChunkReader.IsFinished())
+        PNG_RETURN_IF_NOT_OK(m_ChunkReader.ReadNext, m_IDAT->GetInput(), chunk);
+
+    m_Inflater.reset();
+    m_IDAT.reset();
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineWriter::IDATStream::WriteChunk()
+{
+    m_Chunk.CRC = m_Chunk.CalculateCRC();
+    PNG_RETURN_IF_NOT_OK(m_Chunk.Write, m_Out);
+    PNG_RETURN_IF_NOT_OK(m_Out.Flush);
+    m_Chunk.Data.clear();
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineWriter::IDATStream::WriteBuffer(const void* buf, size_t bufLen)
+{
+    const uint8_t* in = (const uint8_t*)buf;
+    while (bufLen > 0) {
+        size_t writeSize = std::min<size_t>(bufLen, m_IDATSize - m_Chunk.Data.size());
+        m_Chunk.Data.insert(m_Chunk.Data.end(), in, in + writeSize);
+        in += writeSize;
+        bufLen -= writeSize;
+
+        if (m_Chunk.Data.size() >= m_IDATSize)
+            PNG_RETURN_IF_NOT_OK(WriteChunk);
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineWriter::IDATStream::Finish()
+{
+    if (m_Chunk.Data.empty())
+        return Result::OK;
+    return WriteChunk();
+}
+
+PNG::Result PNG::ScanlineWriter::Open(OStream& out, size_t width, size_t height, const ExportSettings& cfg)
+{
+    m_Deflater.reset();
+    m_IDAT.reset();
+    m_Out = nullptr;
+    m_Row = 0;
+
+    PNG_RETURN_IF_NOT_OK(cfg.Validate);
+    if (cfg.InterlaceMethod != InterlaceMethod::NONE)
+        return Result::UnsupportedInterlaceMethod;
+    else if (cfg.ColorType == ColorType::PALETTE && cfg.Palette->size() == 0)
+        return Result::InvalidPaletteSize;
+
+    m_Settings = cfg;
+    m_IHDR = ImageHeader {
+        .Width = (uint32_t)width,
+        .Height = (uint32_t)height,
+        .BitDepth = (uint8_t)cfg.BitDepth,
+        .ColorType = cfg.ColorType,
+        .CompressionMethod = CompressionMethod::ZLIB,
+        .FilterMethod = FilterMethod::ADAPTIVE_FILTERING,
+        .InterlaceMethod = InterlaceMethod::NONE,
+    };
+
+    PNG_RETURN_IF_NOT_OK(WriteImageHead, out, m_IHDR, cfg);
+
+    m_PixelBits = ColorType::GetSamples(cfg.ColorType) * cfg.BitDepth;
+    // Rows are converted unpacked and then packed in place
+    size_t rowSize = width * BitsToBytes(m_PixelBits);
+    size_t packedRowSize = BitsToBytes(width * m_PixelBits);
+    m_PrevRow.assign(rowSize, 0);
+    m_CurRow.assign(rowSize, 0);
+    m_Filtered.resize(1 + packedRowSize);
+    m_FilterScratch.resize(cfg.CompressionLevel == CompressionLevel::BestSize ? packedRowSize : 0);
+
+    // Floyd and Atkinson diffuse errors at most 2 rows down
+    if (cfg.ColorType == ColorType::PALETTE)
+        m_DitherRows.SetSize(width, 3);
+    else
+        m_DitherRows.Clear();
+
+    m_Out = &out;
+    m_IDAT = std::make_unique<IDATStream>(out, cfg.IDATSize);
+    m_Deflater = std::make_unique<ZLib::DeflateStream>(*m_IDAT, cfg.CompressionLevel);
+
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineWriter::WriteRow(const Color* row)
+{
+    if (!m_Deflater || m_Row >= GetHeight())
+        return Result::UpdatingClosedStreamError;
+
+    if (m_IHDR.ColorType == ColorType::PALETTE) {
+        // The first row holds the errors diffused into the current one
+        Color* ditherRow = m_DitherRows[0];
+        for (size_t x = 0; x < GetWidth(); x++)
+            ditherRow[x] += row[x];
+        Image::DitherRow(m_DitherRows, 0, *m_Settings.Palette, m_Settings.DitheringMethod, m_CurRow.data());
+
+        // Shifting errors up by one row
+        memmove(m_DitherRows[0], m_DitherRows[1], 2 * GetWidth() * sizeof(Color));
+        memset((void*)m_DitherRows[2], 0, GetWidth() * sizeof(Color));
+    } else
+        PNG_RETURN_IF_NOT_OK(Image::WriteRawRow, m_IHDR.ColorType, m_IHDR.BitDepth, row, GetWidth(), m_CurRow.data());
+
+    if (m_PixelBits < 8)
+        PackPixels(m_CurRow.data(), m_CurRow.data(), GetWidth(), m_PixelBits);
+
+    m_Filtered[0] = AdaptiveFiltering::FilterRow(m_Settings.CompressionLevel, m_CurRow.data(),
+        m_Row > 0 ? m_PrevRow.data() : nullptr, m_Filtered.size() - 1,
+        BitsToBytes(m_PixelBits), m_Filtered.data() + 1, m_FilterScratch.data());
+    PNG_RETURN_IF_NOT_OK(m_Deflater->WriteVector, m_Filtered);
+
+    // The current row becomes the previous one
+    std::swap(m_PrevRow, m_CurRow);
+    m_Row++;
+    return Result::OK;
+}
+
+PNG::Result PNG::ScanlineWriter::Finish()
+{
+    if (!m_Deflater)
+        return Result::OK;
+    else if (m_Row < GetHeight())
+        return Result::InvalidImageSize;
+
+    PNG_RETURN_IF_NOT_OK(m_Deflater->Finish);
+    PNG_RETURN_IF_NOT_OK(m_IDAT->Finish);
+    PNG_RETURN_IF_NOT_OK(WriteImageEnd, *m_Out);
+
+    m_Deflater.reset();
+    m_IDAT.reset();
+    m_Out = nullptr;
+    return Result::OK;
+}
@@ -1,14 +1,30 @@
 #include "png/stream.h"
 
+#include <algorithm>
 #include <thread>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else // _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
 PNG::Result PNG::IStreamWrapper::ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead)
 {
     if (bytesRead) {
+        // readsome only returns what the stream has already buffered, which may be nothing before the end
         auto bRead = m_Stream.readsome((char*)buf, bufLen);
-        if (bRead <= 0) {
-            *bytesRead = 0;
-            return Result::EndOfFile;
+        if (bRead <= 0 && bufLen > 0) {
+            if (!m_Stream.read((char*)buf, 1)) {
+                *bytesRead = 0;
+                return m_Stream.eof() ? Result::EndOfFile : Result::Unknown;
+            }
+            bRead = 1 + std::max<std::streamsize>(m_Stream.readsome((char*)buf + 1, bufLen - 1), 0);
         }
         *bytesRead = bRead;
         return Result::OK;
@@ -24,6 +40,31 @@ PNG::Result PNG::IStreamWrapper::ReadBuffer(void* buf, size_t bufLen, size_t* by
     return Result::OK;
 }
 
+PNG::Result PNG::IStreamWrapper::Skip(size_t len)
+{
+    if (m_Stream.seekg((std::streamoff)len, std::ios::cur))
+        return Result::OK;
+
+    // Pipes and the like can't seek
+    m_Stream.clear();
+    m_Stream.ignore((std::streamsize)len);
+    if ((size_t)m_Stream.gcount() < len)
+        return m_Stream.eof() ? Result::UnexpectedEOF : Result::Unknown;
+    return Result::OK;
+}
+
+PNG::Result PNG::IStreamWrapper::Unread(size_t len)
+{
+    // Reading up to the end leaves eofbit and failbit set, which would make seekg fail
+    const auto state = m_Stream.rdstate();
+    m_Stream.clear();
+    if (m_Stream.seekg(-(std::streamoff)len, std::ios::cur))
+        return Result::OK;
+
+    m_Stream.clear(state);
+    return Result::UnsupportedStreamOperation;
+}
+
 PNG::Result PNG::OStreamWrapper::WriteBuffer(const void* buf, size_t bufLen)
 {
     if (!m_Stream.write((char*)buf, bufLen))
@@ -38,6 +79,150 @@ PNG::Result PNG::OStreamWrapper::Flush()
     return Result::OK;
 }
 
+PNG::BufferedIStream::~BufferedIStream()
+{
+    // The underlying stream may hold more data after what was read, e.g. another image
+    // Streams which can't go back lose the rest of the block, which is why readers may disable buffering
+    if (GetBuffered() > 0)
+        m_Stream.Unread(GetBuffered());
+}
+
+PNG::Result PNG::BufferedIStream::Fill()
+{
+    m_Block.resize(m_BlockSize);
+    m_Cursor = 0;
+    m_End = 0;
+
+    size_t bRead;
+    PNG_RETURN_IF_NOT_OK(m_Stream.ReadBuffer, m_Block.data(), m_Block.size(), &bRead);
+    m_End = bRead;
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferedIStream::ReadBuffer(void* _buf, size_t bufLen, size_t* bytesRead)
+{
+    uint8_t* buf = (uint8_t*)_buf;
+
+    size_t avail = m_End - m_Cursor;
+    if (avail >= bufLen || (bytesRead && avail > 0)) {
+        size_t rLen = std::min(avail, bufLen);
+        // The block is not allocated before the first Fill
+        if (rLen > 0)
+            memcpy(buf, m_Block.data() + m_Cursor, rLen);
+        m_Cursor += rLen;
+        if (bytesRead)
+            *bytesRead = rLen;
+        return Result::OK;
+    }
+
+    // Whatever is left in the block comes first, this only happens if the caller needs all of `bufLen`
+    if (avail > 0)
+        memcpy(buf, m_Block.data() + m_Cursor, avail);
+    m_Cursor = m_End;
+    size_t totalRead = avail;
+
+    // Big reads go straight to the underlying stream
+    if (bufLen - totalRead >= m_BlockSize)
+        return m_Stream.ReadBuffer(buf + totalRead, bufLen - totalRead, bytesRead);
+
+    while (totalRead < bufLen) {
+        auto fres = Fill();
+        if (fres == Result::EndOfFile) {
+            if (!bytesRead)
+                return Result::UnexpectedEOF;
+            *bytesRead = 0;
+            return Result::EndOfFile;
+        } else if (fres != Result::OK)
+            return fres;
+
+        size_t rLen = std::min(m_End, bufLen - totalRead);
+        memcpy(buf + totalRead, m_Block.data(), rLen);
+        m_Cursor = rLen;
+        totalRead += rLen;
+
+        // The caller only needs at least one byte
+        if (bytesRead)
+            break;
+    }
+
+    if (bytesRead)
+        *bytesRead = totalRead;
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferedIStream::ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed)
+{
+    if (m_Cursor < m_End)
+        return Result::UnsupportedStreamOperation;
+    return m_Stream.ReadView(view, viewLen, bytesViewed);
+}
+
+PNG::Result PNG::BufferedIStream::Skip(size_t len)
+{
+    size_t avail = m_End - m_Cursor;
+    if (len <= avail) {
+        m_Cursor += len;
+        return Result::OK;
+    }
+    m_Cursor = m_End;
+    return m_Stream.Skip(len - avail);
+}
+
+PNG::Result PNG::BufferedIStream::ReadString(std::string& out)
+{
+    out.resize(0);
+    while (true) {
+        if (m_Cursor == m_End) {
+            auto fres = Fill();
+            if (fres == Result::EndOfFile)
+                return Result::UnexpectedEOF;
+            else if (fres != Result::OK)
+                return fres;
+        }
+
+        const uint8_t* begin = m_Block.data() + m_Cursor;
+        const uint8_t* null = (const uint8_t*)memchr(begin, '\0', m_End - m_Cursor);
+        if (null) {
+            out.append((const char*)begin, null - begin);
+            m_Cursor += null - begin + 1; // Consume NULL character
+            return Result::OK;
+        }
+        out.append((const char*)begin, m_End - m_Cursor);
+        m_Cursor = m_End;
+    }
+}
+
+PNG::Result PNG::BufferedOStream::Drain()
+{
+    if (m_Block.empty())
+        return Result::OK;
+    PNG_RETURN_IF_NOT_OK(m_Stream.WriteBuffer, m_Block.data(), m_Block.size());
+    m_Block.resize(0);
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferedOStream::WriteBuffer(const void* buf, size_t bufLen)
+{
+    if (m_Block.size() + bufLen <= m_BlockSize) {
+        if (m_Block.capacity() < m_BlockSize)
+            m_Block.reserve(m_BlockSize);
+        m_Block.insert(m_Block.end(), (const uint8_t*)buf, (const uint8_t*)buf + bufLen);
+        return Result::OK;
+    }
+
+    PNG_RETURN_IF_NOT_OK(Drain);
+    // Big writes go straight to the underlying stream
+    if (bufLen >= m_BlockSize)
+        return m_Stream.WriteBuffer(buf, bufLen);
+    return WriteBuffer(buf, bufLen);
+}
+
+PNG::Result PNG::BufferedOStream::Flush()
+{
+    PNG_RETURN_IF_NOT_OK(Drain);
+    return m_Stream.Flush();
+}
+
 PNG::Result PNG::ByteStream::ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead)
 {
     std::lock_guard<std::mutex> lock(m_Mutex);
@@ -80,21 +265,314 @@ PNG::Result PNG::ByteStream::ReadString(std::string& out)
     return Result::UnexpectedEOF;
 }
 
+PNG::Result PNG::ByteStream::Skip(size_t len)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    size_t avail = m_BufferLen - m_ReadCursor;
+    if (avail < len) {
+        m_ReadCursor = m_BufferLen;
+        return Result::UnexpectedEOF;
+    }
+    m_ReadCursor += len;
+    return Result::OK;
+}
+
+PNG::Result PNG::ByteStream::Unread(size_t len)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (len > m_ReadCursor)
+        return Result::UnsupportedStreamOperation;
+    m_ReadCursor -= len;
+    return Result::OK;
+}
+
+PNG::Result PNG::ByteStream::ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    size_t avail = m_BufferLen - m_ReadCursor;
+    if (avail == 0 && bytesViewed) {
+        *bytesViewed = 0;
+        return Result::EndOfFile;
+    }
+
+    if (avail < viewLen) {
+        if (!bytesViewed)
+            return Result::UnexpectedEOF;
+        viewLen = avail;
+    }
+
+    view = (const uint8_t*)m_Buffer + m_ReadCursor;
+    m_ReadCursor += viewLen;
+    if (bytesViewed)
+        *bytesViewed = viewLen;
+
+    return Result::OK;
+}
+
+PNG::Result PNG::MappedFileStream::Open(const std::string& filePath)
+{
+    Close();
+
+    size_t fileSize = 0;
+    void* mapping = nullptr;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return Result::FileMappingError;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return Result::FileMappingError;
+    }
+    fileSize = (size_t)size.QuadPart;
+
+    // Empty files can't be mapped
+    if (fileSize > 0) {
+        HANDLE fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (fileMapping)
+            mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+        // The view keeps a reference to the mapping, so handles can be closed
+        if (fileMapping)
+            CloseHandle(fileMapping);
+        if (!mapping) {
+            CloseHandle(file);
+            return Result::FileMappingError;
+        }
+    }
+    CloseHandle(file);
+#else // _WIN32
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Result::FileMappingError;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        close(fd);
+        return Result::FileMappingError;
+    }
+    fileSize = (size_t)fileStat.st_size;
+
+    // Empty files can't be mapped
+    if (fileSize > 0) {
+        mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return Result::FileMappingError;
+        }
+        // Data is consumed front to back, so the kernel can read ahead aggressively
+        madvise(mapping, fileSize, MADV_SEQUENTIAL);
+    }
+    // The mapping keeps a reference to the file, so it can be closed
+    close(fd);
+#endif // _WIN32
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Buffer = (char*)mapping;
+    m_BufferLen = fileSize;
+    m_ReadCursor = 0;
+    m_IsOpen = true;
+    return Result::OK;
+}
+
+void PNG::MappedFileStream::Close()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Buffer) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_Buffer);
+#else // _WIN32
+        munmap(m_Buffer, m_BufferLen);
+#endif // _WIN32
+    }
+
+    m_Buffer = nullptr;
+    m_BufferLen = 0;
+    m_ReadCursor = 0;
+    m_IsOpen = false;
+}
+
+bool PNG::BufferQueueStream::WaitPushable(std::unique_lock<std::mutex>& lock, size_t len)
+{
+    m_Pushable.wait(lock, [this, len]() {
+        return m_Discarding || m_Capacity == 0 || m_QueuedBytes == 0 || m_QueuedBytes + len <= m_Capacity;
+    });
+    return !m_Discarding;
+}
+
+void PNG::BufferQueueStream::Consumed(size_t len)
+{
+    m_QueuedBytes -= len;
+    if (m_Capacity > 0)
+        m_Pushable.notify_one();
+}
+
+PNG::Result PNG::BufferQueueStream::PushView(const void* view, size_t viewLen)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_Closed)
+        return Result::UpdatingClosedStreamError;
+    // Empty buffers would make readers wake up for nothing
+    if (viewLen == 0 || !WaitPushable(lock, viewLen))
+        return Result::OK;
+
+    m_Queue.push_back(Entry{ (const uint8_t*)view, viewLen, {}, nullptr });
+    m_QueuedBytes += viewLen;
+    m_Available.notify_one();
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferQueueStream::PushBuffer(std::vector<uint8_t>&& buf, BufferCheck check)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_Closed)
+        return Result::UpdatingClosedStreamError;
+    if (buf.size() == 0 || !WaitPushable(lock, buf.size()))
+        return Result::OK;
+
+    m_QueuedBytes += buf.size();
+    Entry& entry = m_Queue.emplace_back(Entry{ nullptr, buf.size(), std::move(buf), std::move(check) });
+    // std::deque never moves its elements when pushing at the back
+    entry.Data = entry.Buffer.data();
+    m_Available.notify_one();
+    return Result::OK;
+}
+
+void PNG::BufferQueueStream::PopConsumed()
+{
+    while (!m_Queue.empty() && m_FrontCursor >= m_Queue.front().Length) {
+        m_Queue.pop_front();
+        m_FrontCursor = 0;
+    }
+}
+
+bool PNG::BufferQueueStream::WaitAvailable(std::unique_lock<std::mutex>& lock)
+{
+    PopConsumed();
+    m_Available.wait(lock, [this]() { return m_Closed || !m_Queue.empty(); });
+    return !m_Queue.empty();
+}
+
+PNG::Result PNG::BufferQueueStream::CheckFront()
+{
+    if (m_CheckResult != Result::OK)
+        return m_CheckResult;
+
+    Entry& entry = m_Queue.front();
+    if (entry.Check) {
+        // The lock is kept, since StopReading may clear the queue from another thread
+        m_CheckResult = entry.Check(entry.Data, entry.Length);
+        entry.Check = nullptr;
+    }
+    return m_CheckResult;
+}
+
+PNG::Result PNG::BufferQueueStream::ReadBuffer(void* _buf, size_t bufLen, size_t* bytesRead)
+{
+    uint8_t* buf = (uint8_t*)_buf;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    size_t totalRead = 0;
+    while (totalRead < bufLen) {
+        if (!WaitAvailable(lock)) {
+            if (!bytesRead)
+                return Result::UnexpectedEOF;
+            break;
+        }
+
+        // Copy everything that is available without waiting
+        while (totalRead < bufLen && !m_Queue.empty()) {
+            PNG_RETURN_IF_NOT_OK(CheckFront);
+            const Entry& entry = m_Queue.front();
+            size_t rLen = std::min(entry.Length - m_FrontCursor, bufLen - totalRead);
+            memcpy(buf + totalRead, entry.Data + m_FrontCursor, rLen);
+            m_FrontCursor += rLen;
+            totalRead += rLen;
+            Consumed(rLen);
+            PopConsumed();
+        }
+
+        // The caller only needs at least one byte
+        if (bytesRead)
+            break;
+    }
+
+    if (bytesRead) {
+        *bytesRead = totalRead;
+        if (totalRead == 0 && bufLen > 0)
+            return Result::EndOfFile;
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferQueueStream::ReadView(const uint8_t*& view, size_t viewLen, size_t* bytesViewed)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (!WaitAvailable(lock)) {
+        if (!bytesViewed)
+            return viewLen == 0 ? Result::OK : Result::UnexpectedEOF;
+        *bytesViewed = 0;
+        return Result::EndOfFile;
+    }
+
+    PNG_RETURN_IF_NOT_OK(CheckFront);
+    const Entry& entry = m_Queue.front();
+    size_t avail = entry.Length - m_FrontCursor;
+    if (avail < viewLen) {
+        if (!bytesViewed)
+            return Result::UnsupportedStreamOperation;
+        viewLen = avail;
+    }
+
+    // The entry is popped on the next read, so the view stays valid until then
+    view = entry.Data + m_FrontCursor;
+    m_FrontCursor += viewLen;
+    Consumed(viewLen);
+    if (bytesViewed)
+        *bytesViewed = viewLen;
+
+    return Result::OK;
+}
+
+PNG::Result PNG::BufferQueueStream::Close()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Closed = true;
+    m_Available.notify_all();
+    return Result::OK;
+}
+
+void PNG::BufferQueueStream::StopReading()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Discarding = true;
+    m_Queue.clear();
+    m_FrontCursor = 0;
+    m_QueuedBytes = 0;
+    m_Pushable.notify_all();
+}
+
 PNG::Result PNG::DynamicByteStream::ReadBuffer(void* buf, size_t bufLen, size_t* bytesRead)
 {
+    std::unique_lock<std::mutex> lock(m_IMutex);
+
     // If bytesRead is not nullptr then the caller wants to receive a variable amount of bytes
     if (bytesRead) {
-        size_t avail = GetAvailable();
-        while (avail == 0) {
+        // Wait until either some data is flushed or the stream is closed
+        m_IAvailable.wait(lock, [this]() { return m_Closed || m_IBuffer.size() > m_ICursor; });
+
+        size_t avail = m_IBuffer.size() - m_ICursor;
+        if (avail == 0) {
             // If the Stream is closed, EOF has been reached
-            if (m_Closed)
-                return Result::EndOfFile;
-            // Otherwise we wait for m_IPollInterval and check again
-            std::this_thread::sleep_for(m_IPollInterval);
-            avail = GetAvailable();
+            *bytesRead = 0;
+            return Result::EndOfFile;
         }
 
-        std::lock_guard<std::mutex> lock(m_IMutex);
         size_t rLen = avail < bufLen ? avail : bufLen;
         memcpy(buf, m_IBuffer.data() + m_ICursor, rLen);
         m_ICursor += rLen;
@@ -103,13 +581,10 @@ PNG::Result PNG::DynamicByteStream::ReadBuffer(void* buf, size_t bufLen, size_t*
         return PNG::Result::OK;
     }
 
-    while (GetAvailable() < bufLen) {
-        if (m_Closed)
-            return Result::UnexpectedEOF;
-        std::this_thread::sleep_for(m_IPollInterval);
-    }
+    m_IAvailable.wait(lock, [this, bufLen]() { return m_Closed || m_IBuffer.size() - m_ICursor >= bufLen; });
+    if (m_IBuffer.size() - m_ICursor < bufLen)
+        return Result::UnexpectedEOF;
 
-    std::lock_guard<std::mutex> lock(m_IMutex);
     memcpy(buf, m_IBuffer.data() + m_ICursor, bufLen);
     m_ICursor += bufLen;
 
@@ -136,21 +611,28 @@ PNG::Result PNG::DynamicByteStream::Flush()
     if (m_ICursor >= m_TrimSize)
         TrimInputBuffer();
 
-    std::lock_guard<std::mutex> iLock(m_IMutex);
-    std::lock_guard<std::mutex> oLock(m_OMutex);
+    {
+        std::lock_guard<std::mutex> iLock(m_IMutex);
+        std::lock_guard<std::mutex> oLock(m_OMutex);
 
-    size_t writeCursor = m_IBuffer.size();
-    m_IBuffer.resize(m_IBuffer.size()+m_OBuffer.size());
-    memcpy(m_IBuffer.data()+writeCursor, m_OBuffer.data(), m_OBuffer.size());
-    m_OBuffer.resize(0);
-    
+        size_t writeCursor = m_IBuffer.size();
+        m_IBuffer.resize(m_IBuffer.size()+m_OBuffer.size());
+        memcpy(m_IBuffer.data()+writeCursor, m_OBuffer.data(), m_OBuffer.size());
+        m_OBuffer.resize(0);
+    }
+
+    m_IAvailable.notify_all();
     return Result::OK;
 }
 
 PNG::Result PNG::DynamicByteStream::Close()
 {
     PNG_RETURN_IF_NOT_OK(Flush);
-    m_Closed = true;
+    {
+        std::lock_guard<std::mutex> lock(m_IMutex);
+        m_Closed = true;
+    }
+    m_IAvailable.notify_all();
     return Result::OK;
 }
 
@@ -164,3 +646,284 @@ void PNG::DynamicByteStream::TrimInputBuffer()
     m_IBuffer.resize(m_IBuffer.size() - m_ICursor);
     m_ICursor = 0;
 }
+
+void PNG::PipeStream::Grow(size_t size)
+{
+    if (m_Buffer.size() >= size)
+        return;
+
+    size_t newSize = std::max<size_t>({ size, m_Buffer.size() * 2, 4096 });
+    if (m_Capacity > 0)
+        newSize = std::min(newSize, m_Capacity);
+
+    // Unwrap the ring into the new buffer
+    std::vector<uint8_t> newBuffer(newSize);
+    if (m_Size > 0) {
+        size_t firstLen = std::min(m_Size, m_Buffer.size() - m_ReadCursor);
+        memcpy(newBuffer.data(), m_Buffer.data() + m_ReadCursor, firstLen);
+        memcpy(newBuffer.data() + firstLen, m_Buffer.data(), m_Size - firstLen);
+    }
+
+    m_Buffer = std::move(newBuffer);
+    m_ReadCursor = 0;
+}
+
+size_t PNG::PipeStream::Consume(uint8_t* buf, size_t bufLen)
+{
+    size_t rLen = std::min(bufLen, m_Size);
+    size_t firstLen = std::min(rLen, m_Buffer.size() - m_ReadCursor);
+    memcpy(buf, m_Buffer.data() + m_ReadCursor, firstLen);
+    memcpy(buf + firstLen, m_Buffer.data(), rLen - firstLen);
+
+    m_ReadCursor = (m_ReadCursor + rLen) % m_Buffer.size();
+    m_Size -= rLen;
+    if (m_Size == 0)
+        m_ReadCursor = 0;
+    return rLen;
+}
+
+PNG::Result PNG::PipeStream::ReadBuffer(void* _buf, size_t bufLen, size_t* bytesRead)
+{
+    uint8_t* buf = (uint8_t*)_buf;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    // If bytesRead is not nullptr then the caller wants to receive a variable amount of bytes
+    if (bytesRead) {
+        m_CanRead.wait(lock, [this]() { return m_Closed || m_Size > 0; });
+        if (m_Size == 0) {
+            *bytesRead = 0;
+            return Result::EndOfFile;
+        }
+
+        *bytesRead = Consume(buf, bufLen);
+        m_CanWrite.notify_one();
+        return Result::OK;
+    }
+
+    // Data is consumed as it arrives, since bufLen may be greater than the capacity
+    size_t totalRead = 0;
+    while (totalRead < bufLen) {
+        m_CanRead.wait(lock, [this]() { return m_Closed || m_Size > 0; });
+        if (m_Size == 0)
+            return Result::UnexpectedEOF;
+
+        totalRead += Consume(buf + totalRead, bufLen - totalRead);
+        m_CanWrite.notify_one();
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::PipeStream::WriteBuffer(const void* _buf, size_t bufLen)
+{
+    const uint8_t* buf = (const uint8_t*)_buf;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_Closed)
+        return Result::UpdatingClosedStreamError;
+
+    while (bufLen > 0) {
+        if (m_Discarding)
+            return Result::OK;
+
+        if (m_Capacity == 0)
+            Grow(m_Size + bufLen);
+        else if (m_Size == m_Capacity) {
+            // Readers must be woken up before waiting, otherwise unflushed data could never be read
+            m_CanRead.notify_one();
+            m_CanWrite.wait(lock, [this]() { return m_Discarding || m_Size < m_Capacity; });
+            continue;
+        } else
+            Grow(std::min(m_Size + bufLen, m_Capacity));
+
+        size_t writeCursor = (m_ReadCursor + m_Size) % m_Buffer.size();
+        size_t wLen = std::min(bufLen, m_Buffer.size() - m_Size);
+        size_t firstLen = std::min(wLen, m_Buffer.size() - writeCursor);
+        memcpy(m_Buffer.data() + writeCursor, buf, firstLen);
+        memcpy(m_Buffer.data(), buf + firstLen, wLen - firstLen);
+
+        m_Size += wLen;
+        buf += wLen;
+        bufLen -= wLen;
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::PipeStream::Flush()
+{
+    if (m_Closed)
+        return Result::UpdatingClosedStreamError;
+    m_CanRead.notify_one();
+    return Result::OK;
+}
+
+PNG::Result PNG::PipeStream::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Closed = true;
+    }
+    m_CanRead.notify_all();
+    return Result::OK;
+}
+
+void PNG::PipeStream::StopReading()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Discarding = true;
+        m_Size = 0;
+        m_ReadCursor = 0;
+    }
+    m_CanWrite.notify_all();
+}
+
+PNG::RingBufferStream::RingBufferStream(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_Buffer.resize(size);
+    m_Mask = size - 1;
+}
+
+void PNG::RingBufferStream::SignalReader()
+{
+    m_ReaderSignal.fetch_add(1, std::memory_order_release);
+    m_ReaderSignal.notify_one();
+}
+
+void PNG::RingBufferStream::SignalWriter()
+{
+    m_WriterSignal.fetch_add(1, std::memory_order_release);
+    m_WriterSignal.notify_one();
+}
+
+bool PNG::RingBufferStream::WaitWritable()
+{
+    while (true) {
+        if (m_Discarding.load(std::memory_order_acquire))
+            return false;
+        m_CachedTail = m_Tail.load(std::memory_order_acquire);
+        if (m_Head.load(std::memory_order_relaxed) - m_CachedTail < m_Buffer.size())
+            return true;
+
+        // The reader may be waiting for data which was not flushed yet
+        SignalReader();
+
+        uint32_t signal = m_WriterSignal.load(std::memory_order_acquire);
+        // Check again after loading the signal, so that a wake up can't be missed
+        if (m_Discarding.load(std::memory_order_acquire) ||
+            m_Head.load(std::memory_order_relaxed) - m_Tail.load(std::memory_order_acquire) < m_Buffer.size())
+            continue;
+        m_WriterSignal.wait(signal, std::memory_order_acquire);
+    }
+}
+
+bool PNG::RingBufferStream::WaitReadable()
+{
+    while (true) {
+        m_CachedHead = m_Head.load(std::memory_order_acquire);
+        if (m_CachedHead != m_Tail.load(std::memory_order_relaxed))
+            return true;
+        if (m_Closed.load(std::memory_order_acquire)) {
+            // Data may have been written right before closing the stream
+            m_CachedHead = m_Head.load(std::memory_order_acquire);
+            return m_CachedHead != m_Tail.load(std::memory_order_relaxed);
+        }
+
+        uint32_t signal = m_ReaderSignal.load(std::memory_order_acquire);
+        // Check again after loading the signal, so that a wake up can't be missed
+        if (m_Head.load(std::memory_order_acquire) != m_Tail.load(std::memory_order_relaxed) ||
+            m_Closed.load(std::memory_order_acquire))
+            continue;
+        m_ReaderSignal.wait(signal, std::memory_order_acquire);
+    }
+}
+
+size_t PNG::RingBufferStream::Consume(uint8_t* buf, size_t bufLen)
+{
+    size_t tail = m_Tail.load(std::memory_order_relaxed);
+    size_t rLen = std::min(bufLen, m_CachedHead - tail);
+
+    size_t readCursor = tail & m_Mask;
+    size_t firstLen = std::min(rLen, m_Buffer.size() - readCursor);
+    memcpy(buf, m_Buffer.data() + readCursor, firstLen);
+    memcpy(buf + firstLen, m_Buffer.data(), rLen - firstLen);
+
+    m_Tail.store(tail + rLen, std::memory_order_release);
+    SignalWriter();
+    return rLen;
+}
+
+PNG::Result PNG::RingBufferStream::ReadBuffer(void* _buf, size_t bufLen, size_t* bytesRead)
+{
+    uint8_t* buf = (uint8_t*)_buf;
+
+    // If bytesRead is not nullptr then the caller wants to receive a variable amount of bytes
+    if (bytesRead) {
+        if (!WaitReadable()) {
+            *bytesRead = 0;
+            return Result::EndOfFile;
+        }
+        *bytesRead = Consume(buf, bufLen);
+        return Result::OK;
+    }
+
+    // Data is consumed as it arrives, since bufLen may be greater than the capacity
+    size_t totalRead = 0;
+    while (totalRead < bufLen) {
+        if (m_CachedHead == m_Tail.load(std::memory_order_relaxed) && !WaitReadable())
+            return Result::UnexpectedEOF;
+        totalRead += Consume(buf + totalRead, bufLen - totalRead);
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::RingBufferStream::WriteBuffer(const void* _buf, size_t bufLen)
+{
+    const uint8_t* buf = (const uint8_t*)_buf;
+    if (m_Closed.load(std::memory_order_relaxed))
+        return Result::UpdatingClosedStreamError;
+
+    size_t head = m_Head.load(std::memory_order_relaxed);
+    while (bufLen > 0) {
+        if (head - m_CachedTail == m_Buffer.size() && !WaitWritable())
+            return Result::OK;
+
+        size_t wLen = std::min(bufLen, m_Buffer.size() - (head - m_CachedTail));
+        size_t writeCursor = head & m_Mask;
+        size_t firstLen = std::min(wLen, m_Buffer.size() - writeCursor);
+        memcpy(m_Buffer.data() + writeCursor, buf, firstLen);
+        memcpy(m_Buffer.data(), buf + firstLen, wLen - firstLen);
+
+        head += wLen;
+        m_Head.store(head, std::memory_order_release);
+        buf += wLen;
+        bufLen -= wLen;
+    }
+
+    return Result::OK;
+}
+
+PNG::Result PNG::RingBufferStream::Flush()
+{
+    if (m_Closed.load(std::memory_order_relaxed))
+        return Result::UpdatingClosedStreamError;
+    SignalReader();
+    return Result::OK;
+}
+
+PNG::Result PNG::RingBufferStream::Close()
+{
+    m_Closed.store(true, std::memory_order_release);
+    SignalReader();
+    return Result::OK;
+}
+
+void PNG::RingBufferStream::StopReading()
+{
+    m_Discarding.store(true, std::memory_order_release);
+    SignalWriter();
+}
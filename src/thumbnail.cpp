@@ -0,0 +1,160 @@
+#include "png/thumbnail.h"
+
+#include <algorithm>
+#include <cmath>
+
+void PNG::GetThumbnailSize(size_t width, size_t height, size_t maxWidth, size_t maxHeight, size_t& thumbWidth, size_t& thumbHeight)
+{
+    thumbWidth = thumbHeight = 0;
+    if (!(width && height && maxWidth && maxHeight))
+        return;
+
+    const double scale = std::min({ (double)maxWidth / width, (double)maxHeight / height, 1.0 });
+    thumbWidth = std::clamp<size_t>((size_t)std::lround(width * scale), 1, std::min(width, maxWidth));
+    thumbHeight = std::clamp<size_t>((size_t)std::lround(height * scale), 1, std::min(height, maxHeight));
+}
+
+namespace
+{
+    // The source pixels which make up a pixel of the thumbnail along one axis, and how much each one weighs
+    struct Footprint
+    {
+        size_t First = 0;
+        std::vector<float> Weights;
+    };
+
+    // Each destination pixel covers `srcSize / dstSize` source pixels, partially covered ones weigh less
+    std::vector<Footprint> GetBoxFootprints(size_t srcSize, size_t dstSize)
+    {
+        std::vector<Footprint> footprints(dstSize);
+        const double scale = (double)srcSize / dstSize;
+        for (size_t i = 0; i < dstSize; i++) {
+            const double start = i * scale;
+            const double end = std::min((i+1) * scale, (double)srcSize);
+            Footprint& footprint = footprints[i];
+            footprint.First = (size_t)start;
+            for (size_t src = footprint.First; src < end; src++) {
+                const double weight = std::min(src + 1.0, end) - std::max((double)src, start);
+                footprint.Weights.push_back((float)(weight / scale));
+            }
+        }
+        return footprints;
+    }
+
+    // Same mapping as PNG::Image::Resize, the first and last pixels of both images line up
+    std::vector<Footprint> GetBilinearFootprints(size_t srcSize, size_t dstSize)
+    {
+        std::vector<Footprint> footprints(dstSize);
+        const double scale = dstSize > 1 ? (srcSize-1.0) / (dstSize-1.0) : 0.0;
+        for (size_t i = 0; i < dstSize; i++) {
+            const double c = i * scale;
+            Footprint& footprint = footprints[i];
+            footprint.First = std::min((size_t)std::floor(c), srcSize - 1);
+            const float t = (float)(c - footprint.First);
+            if (footprint.First + 1 < srcSize)
+                footprint.Weights = { 1.0f - t, t };
+            else
+                footprint.Weights = { 1.0f };
+        }
+        return footprints;
+    }
+
+    void ScaleRow(const PNG::Color* in, const std::vector<Footprint>& footprints, PNG::Color* out)
+    {
+        for (size_t x = 0; x < footprints.size(); x++) {
+            const Footprint& footprint = footprints[x];
+            PNG::Color color(0.0f, 0.0f);
+            for (size_t i = 0; i < footprint.Weights.size(); i++)
+                color += in[footprint.First + i] * footprint.Weights[i];
+            out[x] = color;
+        }
+    }
+}
+
+PNG::Result PNG::DecodeThumbnail(IStream& _in, Image& out, size_t maxWidth, size_t maxHeight, ThumbnailMethod method, const ImportSettings& cfg)
+{
+    if (!(maxWidth && maxHeight))
+        return Result::InvalidImageSize;
+
+    BufferedIStream bufferedIn(_in, cfg.ReadBufferSize);
+    IStream& in = cfg.ReadBufferSize > 0 && !_in.IsBuffered() ? bufferedIn : _in;
+
+    ChunkReader chunkReader(cfg);
+    PNG_RETURN_IF_NOT_OK(chunkReader.ReadHeader, in);
+    const ImageHeader& ihdr = chunkReader.GetHeader();
+
+    size_t width, height;
+    {
+        const ImageRegion region = cfg.Region.Resolve(chunkReader.GetDecodedHeader());
+        GetThumbnailSize(region.Width, region.Height, maxWidth, maxHeight, width, height);
+    }
+
+    // Later Adam7 passes only add detail which the thumbnail would scale away
+    // Regions are given within the decoded image, so its size must not change if there is one
+    ImportSettings& readerCfg = chunkReader.GetSettings();
+    if (ihdr.InterlaceMethod == InterlaceMethod::ADAM7 && !cfg.ExpandAdam7Passes && cfg.Region.IsEmpty()) {
+        const size_t maxPasses = std::clamp<size_t>(cfg.Adam7Passes, 1, 7);
+        for (size_t passes = 1; passes <= maxPasses; passes++) {
+            size_t gridWidth, gridHeight;
+            Adam7::GetPassGridSize(passes, ihdr.Width, ihdr.Height, gridWidth, gridHeight);
+            readerCfg.Adam7Passes = passes;
+            if (gridWidth >= width && gridHeight >= height)
+                break;
+        }
+    }
+
+    ChunkView idat;
+    PNG_RETURN_IF_NOT_OK(ReadImageHead, in, chunkReader, idat);
+    const ImageRegion region = readerCfg.Region.Resolve(chunkReader.GetDecodedHeader());
+    // The grid of the passes may be smaller than the thumbnail if cfg.Adam7Passes stops them early
+    width = std::min<size_t>(width, region.Width);
+    height = std::min<size_t>(height, region.Height);
+    const size_t regionOffset = region.X * ColorType::GetSamples(ihdr.ColorType) * ColorType::GetBytesPerSample(ihdr.BitDepth);
+
+    const bool box = method == ThumbnailMethod::Box;
+    const std::vector<Footprint> columns = box ? GetBoxFootprints(region.Width, width) : GetBilinearFootprints(region.Width, width);
+    const std::vector<Footprint> rows = box ? GetBoxFootprints(region.Height, height) : GetBilinearFootprints(region.Height, height);
+
+    Image img(width, height);
+    for (size_t y = 0; y < height; y++)
+        std::fill_n(img[y], width, Color(0.0f, 0.0f));
+
+    // Single-threaded reads load rows in order, each one is added to the rows of the thumbnail it makes up
+    // The footprints of rows only move forward, so scanning starts from the first one which isn't complete
+    std::vector<Color> srcRow(region.Width);
+    std::vector<Color> scaledRow(width);
+    size_t firstRow = 0;
+    auto loadRow = [&ihdr, &chunkReader, &region, regionOffset, &columns, &rows, &img, &srcRow, &scaledRow, &firstRow](size_t _y, const uint8_t* rawRow) {
+        const size_t y = _y - region.Y;
+        while (firstRow < rows.size() && rows[firstRow].First + rows[firstRow].Weights.size() <= y)
+            firstRow++;
+        // Rows which no pixel of the thumbnail samples are not even converted
+        if (firstRow == rows.size() || rows[firstRow].First > y)
+            return Result::OK;
+
+        PNG_RETURN_IF_NOT_OK(Image::LoadRawRow, ihdr.ColorType, ihdr.BitDepth, &chunkReader.GetPalette(), rawRow + regionOffset, region.Width, srcRow.data());
+        ScaleRow(srcRow.data(), columns, scaledRow.data());
+        for (size_t dstY = firstRow; dstY < rows.size() && rows[dstY].First <= y; dstY++) {
+            const float weight = rows[dstY].Weights[y - rows[dstY].First];
+            Color* dstRow = img[dstY];
+            for (size_t x = 0; x < scaledRow.size(); x++)
+                dstRow[x] += scaledRow[x] * weight;
+        }
+        return Result::OK;
+    };
+    PNG_RETURN_IF_NOT_OK(ReadImageData, in, chunkReader, idat, loadRow);
+
+    for (size_t y = 0; y < height; y++) {
+        Color* row = img[y];
+        for (size_t x = 0; x < width; x++)
+            row[x].Clamp();
+    }
+    out = std::move(img);
+
+    if (cfg.IHDROut)
+        *cfg.IHDROut = ihdr;
+    if (cfg.PaletteOut)
+        *cfg.PaletteOut = std::move(chunkReader.GetPalette());
+
+    return Result::OK;
+}